@@ -17,15 +17,52 @@ typedef struct PredResults_ {
 	double bbGyration; /**< Gyration radius for the backbone beads */
 } PredResults;
 
-/** Given a protein in the HPElem * format, searches the 3D conformation with minimal energy.
+/** Everything a prediction works with: the protein, the energy parameters, the fitness calculator
+ *   (with its lattices and scratch memory), the slab of movement chains, and, while a prediction
+ *   runs, the hive.
+ * Predictions share no state besides the read-only configuration, so different threads may
+ *   run predictions at the same time, each with its own context.
+ * The calculator and the slab are made by the first prediction, and kept for the next ones, so
+ *   predicting the same protein again (e.g. with another seed) allocates nothing but the hive.
+ */
+typedef struct PredictionContext_ {
+	HPElem *chaininghp;       /**< Copy of the protein being predicted */
+	int hpSize;               /**< Number of beads of the protein */
+	EnergyParams energy;      /**< Energy of contacts and collisions */
+	uint32_t seed;            /**< Seed from which the random streams of the prediction derive */
+	FitnessCalc *fit;         /**< Calculator for the protein, or NULL if not made yet */
+	ChainSlab *slab;          /**< Slab for the chains of the hive, or NULL if not made yet */
+	struct HIVE_ *hive;       /**< Hive of the running prediction, or NULL */
+	const char *checkpointFile; /**< File for checkpoints of the prediction (see checkpoint.h), or NULL */
+	int checkpointInterval;   /**< Cycles between checkpoints, also written on SIGTERM. If 0, none are written */
+	bool resume;              /**< Whether the prediction continues from the checkpoint in 'checkpointFile' */
+} PredictionContext;
+
+/** Creates a context for predicting protein 'chaininghp', with 'hpSize' beads, under 'energy'.
+ * The seed of the context is the one given to random_initialize, and may be changed before predicting.
+ * The context writes no checkpoints, nor resumes from one, unless told to through its fields.
+ */
+PredictionContext *PredictionContext_create(const HPElem *chaininghp, int hpSize, const EnergyParams *energy);
+
+/** Makes the context predict protein 'chaininghp', with 'hpSize' beads, from then on.
+ * The calculator is kept if the protein is the same, and the slab if the protein is not longer.
+ * No prediction may be running.
+ */
+void PredictionContext_retarget(PredictionContext *ctx, const HPElem *chaininghp, int hpSize);
+
+/** Frees the context, which must have no prediction running. */
+void PredictionContext_destroy(PredictionContext *ctx);
+
+/** Given the protein of 'ctx', searches the 3D conformation with minimal energy.
  * 'nCycles' is the number of cycles desired for the algorithm to run.
  *
  * Returns a shiftmel *, which is a sequence of movements of the backbone of the protein,
  *   and also the movements of the side-chain beads relative to the backbone.
+ * The solution belongs to the caller, who frees it with Solution_free(NULL, ...).
  *
  * If 'results' is not NULL, it receives additional values about the predicted
  *   protein (see the structure itself for what values are given).
  */
-Solution ABC_predict_structure(const HPElem * chaininghp, int hpSize, int nCycles, PredResults *results);
+Solution ABC_predict_structure(PredictionContext *ctx, int nCycles, PredResults *results);
 
 #endif // ABC_ALG_H
@@ -2,41 +2,196 @@
 #include <string.h>
 #include <math.h>
 #include <mpi/mpi.h>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
 
 #include <migrch.h>
 #include <chaininghp.h>
 #include <fitness/fitness.h>
 #include <random.h>
+#include <heap.h>
 #include <solution/solution_mpi.h>
 
 #include "abc_alg.h"
 #include "hive.h"
+#include "checkpoint.h"
 
+/* Communication within the hive of this process. MPI_Init is called by ABC_predict_structure,
+ *   so in the MPI builds, each process runs a single prediction and this state is per process.
+ */
 struct {
 	MPI_Comm comm;
 	int      size;
+	ElfTreeHier *tree; // Two-level tree over 'comm', used by the block evaluator
+	EvalLoad load;   // Work done by the master, under dynamic scheduling
+	SolutionReplica *replica; // Hive solutions as known by the slaves, under block scheduling
 } HIVE_COMM;
 
+/* Calculates the fitness of the given solutions with the nodes of the hive,
+ *   splitting them in blocks or handing them out dynamically (see MPI_DYNAMIC_SCHEDULING).
+ */
+static
+void calculate_fitness(PredictionContext *ctx, Solution *sols, int nSols, int hpSize){
+	if(MPI_DYNAMIC_SCHEDULING)
+		Solution_calculate_fitness_master_dynamic(ctx->fit, sols, nSols, hpSize, MPI_REQUESTS_IN_FLIGHT, &HIVE_COMM.load, HIVE_COMM.comm);
+	else
+		Solution_calculate_fitness_master(ctx->fit, sols, nSols, hpSize, HIVE_COMM.tree);
+}
+
+/* Starts calculating the fitness of the given solutions, which must be perturbed from hive
+ *   solutions 'parents', and returns as soon as the slaves have their blocks. So the master can
+ *   prepare more candidates while they evaluate. Fitnesses are set by Solution_wait_fitness_master.
+ * Hive solutions replaced since the last block are sent along, so the replicas of the slaves
+ *   stay up to date.
+ * The dynamic evaluator has no such split, so it evaluates everything before returning.
+ */
+static
+void calculate_fitness_post(PredictionContext *ctx, Solution *sols, const int *parents, int nSols, int hpSize, PendingBlock *pend){
+	if(MPI_DYNAMIC_SCHEDULING){
+		Solution_calculate_fitness_master_dynamic(ctx->fit, sols, nSols, hpSize, MPI_REQUESTS_IN_FLIGHT, &HIVE_COMM.load, HIVE_COMM.comm);
+		pend->nSols = 0;
+	} else if(nSols > 0){
+		// Without candidates nothing is sent, so the replaced solutions are left for the next block
+		int replaced[HIVE_nSols(ctx->hive)];
+		int nReplaced = HIVE_take_replaced(ctx->hive, replaced);
+		Solution_post_fitness_master_delta(ctx->fit, sols, parents, nSols, hpSize, HIVE_COMM.replica,
+				HIVE_solutions(ctx->hive), replaced, nReplaced, HIVE_COMM.tree, pend);
+	} else {
+		pend->nSols = 0;
+	}
+}
+
+/* Prints how busy each node of the hive was, given their loads. */
+static
+void report_load(const EvalLoad *loads, int hiveId){
+	int i;
+	fprintf(stderr, "Hive %d utilisation:\n", hiveId);
+	for(i = 0; i < HIVE_COMM.size; i++){
+		double usage = loads[i].elapsed > 0 ? 100 * loads[i].busyTime / loads[i].elapsed : 0;
+		fprintf(stderr, "  rank %d: %.0f evaluations, busy %.3fs of %.3fs (%.1f%%)\n",
+				i, loads[i].evaluations, loads[i].busyTime, loads[i].elapsed, usage);
+	}
+}
+
+/* Returns the index of the hive this node belongs to, or -1 if hives can't be formed.
+ *
+ * Hives never span machines, unless there are fewer hives than machines. So the master/slave
+ *   tree of a hive stays within shared memory, and only hive masters talk across the network.
+ * The N_HIVES hives are spread evenly over the machines, and the nodes of each machine are split
+ *   in contiguous groups among its hives. Groups may differ in size by one node.
+ * If there are fewer hives than machines, each hive takes a run of whole machines instead.
+ */
+static
+int hive_index(){
+	int myRank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
+
+	MPI_Comm machineComm = ElfTreeComm_machine_comm(MPI_COMM_WORLD);
+	int machineRank, machineSize;
+	MPI_Comm_rank(machineComm, &machineRank);
+	MPI_Comm_size(machineComm, &machineSize);
+
+	// Number the machines through the communicator of their first nodes
+	MPI_Comm leaderComm;
+	int machine[2]; // Index of this machine, and number of machines
+	MPI_Comm_split(MPI_COMM_WORLD, machineRank == 0 ? 0 : MPI_UNDEFINED, myRank, &leaderComm);
+	if(machineRank == 0){
+		MPI_Comm_rank(leaderComm, &machine[0]);
+		MPI_Comm_size(leaderComm, &machine[1]);
+		MPI_Comm_free(&leaderComm);
+	}
+	MPI_Bcast(machine, 2, MPI_INT, 0, machineComm);
+	MPI_Comm_free(&machineComm);
+
+	int myMachine = machine[0], nMachines = machine[1];
+	int hive;
+
+	if(N_HIVES < nMachines){
+		hive = myMachine * N_HIVES / nMachines;
+	} else {
+		int base = N_HIVES / nMachines, extra = N_HIVES % nMachines;
+		int nHives = base + (myMachine < extra);               // Hives on this machine
+		int firstHive = myMachine * base + (myMachine < extra ? myMachine : extra);
+		hive = nHives <= machineSize ? firstHive + machineRank * nHives / machineSize : -1;
+	}
+
+	// All nodes must agree on whether hives could be formed
+	int ok = hive >= 0, allOk;
+	MPI_Allreduce(&ok, &allOk, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+	return allOk ? hive : -1;
+}
+
+/* In the hybrid build, sets the number of threads with which this node evaluates its blocks.
+ * That is THREADS_PER_RANK, or if it is 0, the cores of the machine divided among the nodes on it.
+ * Must be called before the fitness calculator is created, as it prepares memory for each thread.
+ */
+static
+void set_threads_per_rank(){
+#ifdef _OPENMP
+	int nThreads = THREADS_PER_RANK;
+
+	if(nThreads <= 0){
+		int ranksOnMachine;
+		MPI_Comm machineComm = ElfTreeComm_machine_comm(MPI_COMM_WORLD);
+		MPI_Comm_size(machineComm, &ranksOnMachine);
+		MPI_Comm_free(&machineComm);
+
+		nThreads = omp_get_num_procs() / ranksOnMachine;
+		if(nThreads < 1)
+			nThreads = 1;
+	}
+
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+/** Number of chunks in which forager and onlooker candidates are generated and evaluated.
+ * While the slaves evaluate a chunk, the master generates the next one, and once all are
+ *   generated, it replaces solutions of the earlier chunks while the last one is evaluated.
+ * No solution is replaced before all candidates of the phase exist, as with a single batch,
+ *   so the search is the same for any number of chunks.
+ */
+#define PIPELINE_CHUNKS 2
+
 /* Performs the forager phase of the searching cycle
  * Procedure idea:
  *   For each solution, generate a new one in the neighborhood
  *   replace the varied solution if it was improved
  */
 static
-void parallel_forager_phase(int hpSize){
-	int i;
-	Solution sols[HIVE_nSols()];
+void parallel_forager_phase(PredictionContext *ctx, int hpSize){
+	int i, c;
+	Hive *hive = ctx->hive;
+	int nSols = HIVE_nSols(hive);
+	Solution sols[nSols];
+	int indexes[nSols];
+
+	PendingBlock pend;
+	pend.nSols = 0;
+	int chunkFirst = 0;
+
+	for(c = 0; c < PIPELINE_CHUNKS; c++){
+		// Generate new random solutions
+		chunkFirst = nSols * c / PIPELINE_CHUNKS;
+		int chunkEnd = nSols * (c + 1) / PIPELINE_CHUNKS;
+		for(i = chunkFirst; i < chunkEnd; i++){
+			sols[i] = HIVE_perturb_solution(hive, i, hpSize, HIVE_rng(hive));
+			indexes[i] = i;
+		}
 
-	// Generate new random solutions
-	for(i = 0; i < HIVE_nSols(); i++)
-		sols[i] = HIVE_perturb_solution(i, hpSize);
+		// Calculate fitnesses, once the previous chunk is done
+		Solution_wait_fitness_master(&pend);
+		calculate_fitness_post(ctx, sols + chunkFirst, indexes + chunkFirst, chunkEnd - chunkFirst, hpSize, &pend);
+	}
 
-	// Calculate fitnesses
-	Solution_calculate_fitness_master(sols, HIVE_nSols(), hpSize, HIVE_COMM.comm);
+	// Replace solutions in the hive
+	for(i = 0; i < chunkFirst; i++)
+		HIVE_try_replace_solution(hive, sols[i], i, hpSize);
 
-	// Replace solutions in the HIVE
-	for(i = 0; i < HIVE_nSols(); i++)
-		HIVE_try_replace_solution(sols[i], i, hpSize);
+	Solution_wait_fitness_master(&pend);
+	for(i = chunkFirst; i < nSols; i++)
+		HIVE_try_replace_solution(hive, sols[i], i, hpSize);
 }
 
 /* Performs the onlooker phase of the searching cycle
@@ -47,52 +202,65 @@ void parallel_forager_phase(int hpSize){
  *   (PROB * nOnlookers) is the number of perturbations that should be generated
  */
 static
-void parallel_onlooker_phase(int hpSize){
-	int i, j;
+void parallel_onlooker_phase(PredictionContext *ctx, int hpSize){
+	int i, j, c;
+	Hive *hive = ctx->hive;
 	int nOnlookers = COLONY_SIZE - (COLONY_SIZE * FORAGER_RATIO);
 
-	Solution sols[nOnlookers + HIVE_nSols()]; // Overestimate due to possible rounding errors.
-	int indexes[nOnlookers + HIVE_nSols()];   // Stores indexes where each solution belong
+	Solution sols[nOnlookers + HIVE_nSols(hive)]; // Overestimate due to possible rounding errors.
+	int indexes[nOnlookers + HIVE_nSols(hive)];   // Stores indexes where each solution belong
 	int nSols;
 
 	// Find the minimum (If no negative numbers, min should be 0)
 	double min = 0;
-	for(i = 0; i < HIVE_nSols(); i++){
-		double fit = Solution_fitness(HIVE_solution(i));
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		double fit = Solution_fitness(HIVE_solution(hive, i));
 		if(fit < min)
 			min = fit;
 	}
 
 	// Sum the 'normalized' fitnesses
 	double sum = 0;
-	for(i = 0; i < HIVE_nSols(); i++){
-		sum += Solution_fitness(HIVE_solution(i)) - min;
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		sum += Solution_fitness(HIVE_solution(hive, i)) - min;
 	}
 
+	PendingBlock pend;
+	pend.nSols = 0;
+	int chunkFirst = 0;
+
 	// For each solution, count the number of onlooker bees that should perturb it
-	//   then add perturbed solutions into the sols vector
+	//   then add perturbed solutions into the sols vector, a chunk of the hive at a time
 	nSols = 0;
-	for(i = 0; i < HIVE_nSols(); i++){
-		double norm = Solution_fitness(HIVE_solution(i)) - min;
-		double prob = norm / sum; // The probability of perturbing such solution
-
-		// Count number of onlookers that should perturb such solution
-		int nIter = round(prob * nOnlookers);
-
-		// Generate perturbations
-		for(j = 0; j < nIter; j++){
-			sols[nSols] = HIVE_perturb_solution(i, hpSize);
-			indexes[nSols] = i;
-			nSols++;
+	for(c = 0; c < PIPELINE_CHUNKS; c++){
+		chunkFirst = nSols;
+		for(i = HIVE_nSols(hive) * c / PIPELINE_CHUNKS; i < HIVE_nSols(hive) * (c + 1) / PIPELINE_CHUNKS; i++){
+			double norm = Solution_fitness(HIVE_solution(hive, i)) - min;
+			double prob = norm / sum; // The probability of perturbing such solution
+
+			// Count number of onlookers that should perturb such solution
+			int nIter = round(prob * nOnlookers);
+
+			// Generate perturbations
+			for(j = 0; j < nIter; j++){
+				sols[nSols] = HIVE_perturb_solution(hive, i, hpSize, HIVE_rng(hive));
+				indexes[nSols] = i;
+				nSols++;
+			}
 		}
-	}
 
-	// Calculate fitness
-	Solution_calculate_fitness_master(sols, nSols, hpSize, HIVE_COMM.comm);
+		// Calculate fitness, once the previous chunk is done
+		Solution_wait_fitness_master(&pend);
+		calculate_fitness_post(ctx, sols + chunkFirst, indexes + chunkFirst, nSols - chunkFirst, hpSize, &pend);
+	}
 
 	// Replace solutions where due
-	for(i = 0; i < nSols; i++)
-		HIVE_try_replace_solution(sols[i], indexes[i], hpSize);
+	for(i = 0; i < chunkFirst; i++)
+		HIVE_try_replace_solution(hive, sols[i], indexes[i], hpSize);
+
+	Solution_wait_fitness_master(&pend);
+	for(i = chunkFirst; i < nSols; i++)
+		HIVE_try_replace_solution(hive, sols[i], indexes[i], hpSize);
 }
 
 /* Performs the scout phase of the searching cycle
@@ -103,93 +271,507 @@ void parallel_onlooker_phase(int hpSize){
  *   Replace solutions
  */
 static
-void parallel_scout_phase(int hpSize){
+void parallel_scout_phase(PredictionContext *ctx, int hpSize){
 	int i;
+	Hive *hive = ctx->hive;
 
-	Solution sols[HIVE_nSols()];
-	int indexes[HIVE_nSols()];
+	Solution sols[HIVE_nSols(hive)];
+	int indexes[HIVE_nSols(hive)];
 	int nSols = 0;
 
 	// Find idle solutions
-	for(i = 0; i < HIVE_nSols(); i++){
-		int idle = Solution_idle_iterations(HIVE_solution(i));
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		int idle = Solution_idle_iterations(HIVE_solution(hive, i));
 		if(idle > IDLE_LIMIT)
 			indexes[nSols++] = i;
 	}
 
 	// Generate random solutions
 	for(i = 0; i < nSols; i++)
-		sols[i] = Solution_random(hpSize);
+		sols[i] = Solution_random(HIVE_slab(hive), hpSize, HIVE_rng(hive));
 
 	// Calculate fitness
-	Solution_calculate_fitness_master(sols, nSols, hpSize, HIVE_COMM.comm);
+	calculate_fitness(ctx, sols, nSols, hpSize);
 
 	// Replace solutions
 	for(i = 0; i < nSols; i++)
-		HIVE_force_replace_solution(sols[i], indexes[i]);
+		HIVE_force_replace_solution(hive, sols[i], indexes[i]);
 }
 
-/* Exchanges solutions among the hives.
+/** @{ */
+/** Topologies along which hives exchange solutions (see MIGRATION_TOPOLOGY). */
+#define TOPOLOGY_RING   0
+#define TOPOLOGY_TORUS  1
+#define TOPOLOGY_RANDOM 2
+/** @} */
+
+#define MAX_PEERS 2
+
+/* State of the exchange of solutions among hives, which is posted in one cycle and
+ *   completed in the next one.
+ */
+static struct {
+	MPI_Comm comm;        // Communicator containing the masters of each hive
+	int      interval;    // Number of cycles between migrations
+	int      msgSize;     // Maximum size of the message sent to each peer
+	int      nDests;      // Number of hives we send emigrants to
+	int      nSrcs;       // Number of hives we receive immigrants from
+	char    *outBufs[MAX_PEERS]; // Records of the emigrants for each peer (see Solution_write_record)
+	char    *inBufs[MAX_PEERS];
+	MPI_Request reqs[2 * MAX_PEERS]; // Receives first, then sends
+	bool     persistent;  // Whether peers are fixed, so 'reqs' are persistent requests set up once
+	bool     pending;     // Whether there is an exchange posted but not completed
+	mt_state pairRng;     // Stream shared by all hive masters, to pair hives randomly
+} MIGRATION;
+
+static int migration_peers(int myRank, int commSize, int *dests, int *srcs);
+
+/* Prepares the exchange of solutions among hives.
  * 'ringComm' should be the communicator containing the masters of each hive.
+ * Unless hives are paired randomly, peers never change, so the sends and receives of all
+ *   exchanges are set up here once, as persistent requests over the record buffers.
  */
 static
-void ring_exchange(MPI_Comm ringComm, int hpSize){
-	int commSize, myRank;
+void migration_initialize(MPI_Comm ringComm, int hpSize, int nCycles){
+	int i, commSize, myRank;
 	MPI_Comm_size(ringComm, &commSize);
 	MPI_Comm_rank(ringComm, &myRank);
 
-	// If there is only 1 process, it's not a ring.
-	if(commSize == 1) return;
+	MIGRATION.comm = ringComm;
+	MIGRATION.pending = false;
+	MIGRATION.persistent = false;
+
+	if(MIGRATION_INTERVAL > 0)
+		MIGRATION.interval = MIGRATION_INTERVAL;
+	else
+		MIGRATION.interval = nCycles / 10 > 0 ? nCycles / 10 : 1;
+
+	// Seeded after all hive streams, and the same in all hive masters
+	random_seed_stream(&MIGRATION.pairRng, N_HIVES);
+
+	MIGRATION.msgSize = N_EMIGRANTS * Solution_record_size(hpSize);
+	for(i = 0; i < MAX_PEERS; i++){
+		MIGRATION.outBufs[i] = heap_alloc(MIGRATION.msgSize);
+		MIGRATION.inBufs[i] = heap_alloc(MIGRATION.msgSize);
+	}
+
+	if(commSize > 1 && N_EMIGRANTS >= 1 && MIGRATION_TOPOLOGY != TOPOLOGY_RANDOM){
+		int dests[MAX_PEERS], srcs[MAX_PEERS];
+		int nPeers = migration_peers(myRank, commSize, dests, srcs);
+		for(i = 0; i < nPeers; i++){
+			MPI_Recv_init(MIGRATION.inBufs[i], MIGRATION.msgSize, MPI_BYTE, srcs[i], 0, MIGRATION.comm, &MIGRATION.reqs[i]);
+			MPI_Send_init(MIGRATION.outBufs[i], MIGRATION.msgSize, MPI_BYTE, dests[i], 0, MIGRATION.comm, &MIGRATION.reqs[nPeers + i]);
+		}
+		MIGRATION.nDests = MIGRATION.nSrcs = nPeers;
+		MIGRATION.persistent = true;
+	}
+}
+
+/* Frees the memory and requests allocated by migration_initialize. */
+static
+void migration_destroy(){
+	int i;
+	if(MIGRATION.persistent)
+		for(i = 0; i < MIGRATION.nSrcs + MIGRATION.nDests; i++)
+			MPI_Request_free(&MIGRATION.reqs[i]);
+
+	for(i = 0; i < MAX_PEERS; i++){
+		free(MIGRATION.outBufs[i]);
+		free(MIGRATION.inBufs[i]);
+	}
+}
 
-	// Get solutions to send
-	Solution randSol = HIVE_solutions()[urandom_max(HIVE_nSols())];
-	Solution bestSol = HIVE_best_sol();
+/* Finds the hives this hive sends emigrants to ('dests') and receives immigrants from ('srcs'),
+ *   according to MIGRATION_TOPOLOGY. Returns the number of each (both are always the same).
+ */
+static
+int migration_peers(int myRank, int commSize, int *dests, int *srcs){
+	if(MIGRATION_TOPOLOGY == TOPOLOGY_TORUS){
+		// Hives are laid row by row in a grid, and send to the right and downwards
+		int dims[2] = {0, 0};
+		MPI_Dims_create(commSize, 2, dims);
+		int rows = dims[0], cols = dims[1];
+		int row = myRank / cols, col = myRank % cols;
+
+		int n = 0;
+		if(cols > 1){
+			dests[n] = row * cols + (col + 1) % cols;
+			srcs[n]  = row * cols + (col + cols - 1) % cols;
+			n++;
+		}
+		if(rows > 1){
+			dests[n] = ((row + 1) % rows) * cols + col;
+			srcs[n]  = ((row + rows - 1) % rows) * cols + col;
+			n++;
+		}
+		return n;
+	}
+
+	if(MIGRATION_TOPOLOGY == TOPOLOGY_RANDOM){
+		// All masters draw the same permutation, and hives in consecutive positions swap solutions
+		int i, perm[commSize];
+		for(i = 0; i < commSize; i++)
+			perm[i] = i;
+		for(i = commSize - 1; i > 0; i--){
+			int j = urandom_max_r(&MIGRATION.pairRng, i + 1);
+			int aux = perm[i]; perm[i] = perm[j]; perm[j] = aux;
+		}
+
+		for(i = 0; i + 1 < commSize; i += 2){
+			if(perm[i] == myRank || perm[i+1] == myRank){
+				dests[0] = srcs[0] = perm[i] == myRank ? perm[i+1] : perm[i];
+				return 1;
+			}
+		}
+		return 0; // Odd hive out
+	}
 
-	// Create input/output buffers
-	int maxSize = 2 * hpSize + sizeof(double) * 2 + 32; // We overestimate a bit
-	char inBuf[maxSize];
-	char outBuf[maxSize];
+	// Ring
+	dests[0] = (myRank + 1) % commSize;
+	srcs[0] = (myRank + commSize - 1) % commSize;
+	return 1;
+}
 
-	// Pack data
-	int position = 0;
-	Solution_pack(bestSol, hpSize, outBuf, maxSize, &position, ringComm);
-	Solution_pack(randSol, hpSize, outBuf, maxSize, &position, ringComm);
+/* Sends emigrants to other hives and posts the receipt of immigrants, without waiting for either.
+ * The emigrants are the best solution and N_EMIGRANTS-1 random ones.
+ */
+static
+void migration_post(Hive *hive, int hpSize){
+	int i, j, commSize, myRank;
+	MPI_Comm_size(MIGRATION.comm, &commSize);
+	MPI_Comm_rank(MIGRATION.comm, &myRank);
+
+	// If there is only 1 process, there is nobody to migrate to.
+	if(commSize == 1 || N_EMIGRANTS < 1) return;
+
+	int dests[MAX_PEERS], srcs[MAX_PEERS];
+	int nPeers;
+	if(MIGRATION.persistent){
+		nPeers = MIGRATION.nDests;
+	} else {
+		nPeers = migration_peers(myRank, commSize, dests, srcs);
+		MIGRATION.nDests = MIGRATION.nSrcs = nPeers;
+	}
 
-	// Send data
-	int src, dest;
-	if(myRank % 2 == 0){
-		dest = (myRank+1) % commSize;
-		MPI_Send(outBuf, position, MPI_PACKED, dest, 0, ringComm);
+	// Emigrants are written straight into the send buffers, as records
+	int recordSize = Solution_record_size(hpSize);
+	for(i = 0; i < nPeers; i++){
+		Solution_write_record(HIVE_best_sol(hive), hpSize, MIGRATION.outBufs[i]);
+		for(j = 1; j < N_EMIGRANTS; j++){
+			Solution randSol = HIVE_solution(hive, urandom_max_r(HIVE_rng(hive), HIVE_nSols(hive)));
+			Solution_write_record(randSol, hpSize, MIGRATION.outBufs[i] + j * recordSize);
+		}
+	}
 
-		src = myRank == 0 ? commSize-1 : myRank-1;
-		MPI_Recv(inBuf, position, MPI_PACKED, src, 0, ringComm, MPI_STATUS_IGNORE);
+	if(MIGRATION.persistent){
+		MPI_Startall(2 * nPeers, MIGRATION.reqs);
 	} else {
-		src = myRank-1;
-		MPI_Recv(inBuf, position, MPI_PACKED, src, 0, ringComm, MPI_STATUS_IGNORE);
+		for(i = 0; i < nPeers; i++)
+			MPI_Irecv(MIGRATION.inBufs[i], MIGRATION.msgSize, MPI_BYTE, srcs[i], 0, MIGRATION.comm, &MIGRATION.reqs[i]);
+		for(i = 0; i < nPeers; i++)
+			MPI_Isend(MIGRATION.outBufs[i], MIGRATION.msgSize, MPI_BYTE, dests[i], 0, MIGRATION.comm, &MIGRATION.reqs[nPeers + i]);
+	}
+
+	MIGRATION.pending = nPeers > 0;
+}
 
-		dest = (myRank+1) % commSize;
-		MPI_Send(outBuf, position, MPI_PACKED, dest, 0, ringComm);
+/* Waits for the exchange posted by migration_post, if any, and places the immigrants into
+ *   random spots of the hive.
+ */
+static
+void migration_complete(Hive *hive, int hpSize){
+	int i, j;
+
+	if(!MIGRATION.pending) return;
+	MIGRATION.pending = false;
+
+	MPI_Waitall(MIGRATION.nSrcs + MIGRATION.nDests, MIGRATION.reqs, MPI_STATUSES_IGNORE);
+
+	int recordSize = Solution_record_size(hpSize);
+	for(i = 0; i < MIGRATION.nSrcs; i++){
+		for(j = 0; j < N_EMIGRANTS; j++){
+			Solution sol = Solution_read_record(HIVE_slab(hive), MIGRATION.inBufs[i] + j * recordSize, hpSize);
+			HIVE_force_replace_solution(hive, sol, urandom_max_r(HIVE_rng(hive), HIVE_nSols(hive)));
+		}
+	}
+}
+
+/* State of the periodic reduction of the best solution among hives. */
+static struct {
+	MPI_Comm     comm;       // Communicator containing the masters of each hive
+	MPI_Datatype recordType; // A packed (fitness, chain) record
+	MPI_Op       op;         // Keeps the best of two records
+	char        *record;     // Our record, which becomes the global best one
+	int          recordSize;
+	double       bestFit;    // Global best fitness at the last reduction
+	int          bestCycle;  // Cycle at which the global best fitness last improved
+} GLOBAL_BEST;
+
+/* MPI_Op that keeps, for each pair of records, the one with best fitness.
+ * Ties are broken by the chain, so the operation is commutative.
+ */
+static
+void best_record_op(void *in, void *inout, int *len, MPI_Datatype *type){
+	int i, size;
+	MPI_Type_size(*type, &size);
+
+	for(i = 0; i < *len; i++){
+		char *a = (char *) in + i * size;
+		char *b = (char *) inout + i * size;
+		double fitA, fitB;
+		memcpy(&fitA, a, sizeof(double));
+		memcpy(&fitB, b, sizeof(double));
+
+		if(fitA > fitB || (fitA == fitB && memcmp(a + sizeof(double), b + sizeof(double), size - sizeof(double)) < 0))
+			memcpy(b, a, size);
+	}
+}
+
+/* Prepares the reduction of the best solution among hives.
+ * 'ringComm' should be the communicator containing the masters of each hive.
+ */
+static
+void global_best_initialize(MPI_Comm ringComm, int hpSize){
+	GLOBAL_BEST.comm = ringComm;
+	GLOBAL_BEST.recordSize = Solution_record_size(hpSize);
+	GLOBAL_BEST.record = heap_alloc(GLOBAL_BEST.recordSize);
+	GLOBAL_BEST.bestFit = FITNESS_MIN;
+	GLOBAL_BEST.bestCycle = 0;
+
+	MPI_Type_contiguous(GLOBAL_BEST.recordSize, MPI_BYTE, &GLOBAL_BEST.recordType);
+	MPI_Type_commit(&GLOBAL_BEST.recordType);
+	MPI_Op_create(best_record_op, 1, &GLOBAL_BEST.op);
+}
+
+/* Frees what global_best_initialize allocated. */
+static
+void global_best_destroy(){
+	MPI_Op_free(&GLOBAL_BEST.op);
+	MPI_Type_free(&GLOBAL_BEST.recordType);
+	free(GLOBAL_BEST.record);
+}
+
+/* Finds the best solution among all hives, which becomes the best solution of this hive
+ *   and replaces its worst one, if it came from another hive.
+ * Returns whether all hives should stop, because the global best solution reached
+ *   TARGET_FITNESS or did not improve within STAGNATION_WINDOW cycles.
+ * The answer is the same in all hives, as it only depends on the global best solution.
+ */
+static
+bool global_best_sync(Hive *hive, int hpSize, int cycle){
+	int i;
+	Solution best = HIVE_best_sol(hive);
+	double fit = Solution_fitness(best);
+
+	Solution_write_record(best, hpSize, GLOBAL_BEST.record);
+	MPI_Allreduce(MPI_IN_PLACE, GLOBAL_BEST.record, 1, GLOBAL_BEST.recordType, GLOBAL_BEST.op, GLOBAL_BEST.comm);
+
+	double globalFit;
+	memcpy(&globalFit, GLOBAL_BEST.record, sizeof(double));
+
+	if(globalFit > fit){
+		Solution sol = Solution_read_record(HIVE_slab(hive), GLOBAL_BEST.record, hpSize);
+
+		int worst = 0;
+		for(i = 1; i < HIVE_nSols(hive); i++)
+			if(Solution_fitness(HIVE_solution(hive, i)) < Solution_fitness(HIVE_solution(hive, worst)))
+				worst = i;
+
+		HIVE_force_replace_solution(hive, Solution_copy(HIVE_slab(hive), sol, hpSize), worst);
+		HIVE_replace_best(hive, sol);
+	}
+
+	if(globalFit > GLOBAL_BEST.bestFit){
+		GLOBAL_BEST.bestFit = globalFit;
+		GLOBAL_BEST.bestCycle = cycle;
+	}
+
+	if(globalFit >= TARGET_FITNESS)
+		return true;
+	if(STAGNATION_WINDOW > 0 && cycle - GLOBAL_BEST.bestCycle >= STAGNATION_WINDOW)
+		return true;
+	return false;
+}
+
+/* State of checkpointing (see CHECKPOINT_INTERVAL), kept by the masters of each hive.
+ * The record of a hive is its state followed by the state of its migrations and reductions,
+ *   so that the exchanges of all hives continue as they would have.
+ */
+static struct {
+	MPI_Comm comm;            // Communicator containing the masters of each hive
+	CheckpointWriter *writer; // In node 0, the writer of the checkpoint file
+	int hiveSize;             // Size of the state of the hive
+	int recordSize;
+	char *record;             // Record of this hive
+	MPI_Request stopReq;      // Reduction, posted in the previous cycle, of whether any master got SIGTERM
+	int sigterm;
+	int anySigterm;
+} CHECKPOINT;
+
+/* Returns the size of the state of the migrations and reductions of a hive, as saved in its record. */
+static
+int exchange_state_size(){
+	return sizeof(double) + 3 * sizeof(int) + sizeof(mt_state) + MAX_PEERS * MIGRATION.msgSize;
+}
+
+/* Writes the state of the migrations and reductions of this hive in 'buf'.
+ * Immigrants posted for the next cycle are waited for, and saved as they arrived.
+ */
+static
+void exchange_state_save(char *buf){
+	int i;
+	int pending = MIGRATION.pending;
+
+	// Completed requests are left inactive, so migration_complete will not wait for them again
+	if(pending)
+		MPI_Waitall(MIGRATION.nSrcs + MIGRATION.nDests, MIGRATION.reqs, MPI_STATUSES_IGNORE);
+
+	memcpy(buf, &GLOBAL_BEST.bestFit, sizeof(double));
+	buf += sizeof(double);
+	memcpy(buf, &GLOBAL_BEST.bestCycle, sizeof(int));
+	buf += sizeof(int);
+	memcpy(buf, &pending, sizeof(int));
+	buf += sizeof(int);
+	memcpy(buf, &MIGRATION.nSrcs, sizeof(int));
+	buf += sizeof(int);
+	memcpy(buf, &MIGRATION.pairRng, sizeof(mt_state));
+	buf += sizeof(mt_state);
+	for(i = 0; i < MAX_PEERS; i++)
+		memcpy(buf + i * MIGRATION.msgSize, MIGRATION.inBufs[i], MIGRATION.msgSize);
+}
+
+/* Restores the state written by exchange_state_save from 'buf'. */
+static
+void exchange_state_load(const char *buf){
+	int i;
+	int pending;
+
+	memcpy(&GLOBAL_BEST.bestFit, buf, sizeof(double));
+	buf += sizeof(double);
+	memcpy(&GLOBAL_BEST.bestCycle, buf, sizeof(int));
+	buf += sizeof(int);
+	memcpy(&pending, buf, sizeof(int));
+	buf += sizeof(int);
+	memcpy(&MIGRATION.nSrcs, buf, sizeof(int));
+	buf += sizeof(int);
+	memcpy(&MIGRATION.pairRng, buf, sizeof(mt_state));
+	buf += sizeof(mt_state);
+	for(i = 0; i < MAX_PEERS; i++)
+		memcpy(MIGRATION.inBufs[i], buf + i * MIGRATION.msgSize, MIGRATION.msgSize);
+
+	// The immigrants already arrived, so there is nothing left to wait for
+	MIGRATION.pending = pending;
+	MIGRATION.nDests = MIGRATION.nSrcs;
+	if(pending && !MIGRATION.persistent)
+		for(i = 0; i < 2 * MIGRATION.nSrcs; i++)
+			MIGRATION.reqs[i] = MPI_REQUEST_NULL;
+}
+
+/* Prepares checkpointing among the hive masters, which must have their migrations and
+ *   reductions initialized. 'ringComm' should be the communicator containing them.
+ */
+static
+void checkpoint_initialize(PredictionContext *ctx, MPI_Comm ringComm){
+	int myRank, commSize;
+	MPI_Comm_rank(ringComm, &myRank);
+	MPI_Comm_size(ringComm, &commSize);
+
+	CHECKPOINT.comm = ringComm;
+	CHECKPOINT.hiveSize = HIVE_state_size(ctx->hive);
+	CHECKPOINT.recordSize = CHECKPOINT.hiveSize + exchange_state_size();
+	CHECKPOINT.record = heap_alloc(CHECKPOINT.recordSize);
+	CHECKPOINT.stopReq = MPI_REQUEST_NULL;
+	CHECKPOINT.writer = NULL;
+	if(myRank == 0 && ctx->checkpointInterval > 0)
+		CHECKPOINT.writer = CheckpointWriter_create(ctx->checkpointFile, Checkpoint_size(ctx, commSize, CHECKPOINT.recordSize));
+}
+
+/* Waits for the last checkpoint to be written, and frees what checkpoint_initialize allocated. */
+static
+void checkpoint_destroy(){
+	MPI_Wait(&CHECKPOINT.stopReq, MPI_STATUS_IGNORE);
+	if(CHECKPOINT.writer)
+		CheckpointWriter_destroy(CHECKPOINT.writer);
+	free(CHECKPOINT.record);
+}
+
+/* Gathers the records of all hives into a checkpoint in node 0, which its writer writes to the
+ *   checkpoint file while the search goes on.
+ */
+static
+void checkpoint_save(PredictionContext *ctx){
+	int commSize;
+	MPI_Comm_size(CHECKPOINT.comm, &commSize);
+	Hive *hive = ctx->hive;
+
+	HIVE_save_state(hive, CHECKPOINT.record);
+	exchange_state_save(CHECKPOINT.record + CHECKPOINT.hiveSize);
+
+	// Records arrive straight at their place in the checkpoint
+	void *ckpt = CHECKPOINT.writer ? CheckpointWriter_buffer(CHECKPOINT.writer) : NULL;
+	MPI_Gather(CHECKPOINT.record, CHECKPOINT.recordSize, MPI_BYTE, ckpt ? Checkpoint_record(ckpt, ctx, CHECKPOINT.recordSize, 0) : NULL,
+			CHECKPOINT.recordSize, MPI_BYTE, 0, CHECKPOINT.comm);
+
+	if(ckpt){
+		Checkpoint_set_header(ckpt, ctx, HIVE_nSols(hive), commSize, CHECKPOINT.recordSize, HIVE_cycle(hive));
+		CheckpointWriter_submit(CHECKPOINT.writer);
 	}
+}
 
-	// Unpack data
-	position = 0;
-	Solution sol1 = Solution_unpack(hpSize, inBuf, maxSize, &position, ringComm);
-	Solution sol2 = Solution_unpack(hpSize, inBuf, maxSize, &position, ringComm);
+/* Restores every hive from the checkpoint file, which node 0 reads and scatters among the masters.
+ * Returns false, in all masters, if it could not be read.
+ */
+static
+bool checkpoint_load(PredictionContext *ctx){
+	int myRank, commSize;
+	MPI_Comm_rank(CHECKPOINT.comm, &myRank);
+	MPI_Comm_size(CHECKPOINT.comm, &commSize);
+	Hive *hive = ctx->hive;
+
+	void *ckpt = NULL;
+	if(myRank == 0)
+		ckpt = Checkpoint_read(ctx->checkpointFile, ctx, HIVE_nSols(hive), commSize, CHECKPOINT.recordSize);
+
+	int ok = myRank != 0 || ckpt != NULL;
+	MPI_Bcast(&ok, 1, MPI_INT, 0, CHECKPOINT.comm);
+	if(!ok) return false;
+
+	MPI_Scatter(ckpt ? Checkpoint_record(ckpt, ctx, CHECKPOINT.recordSize, 0) : NULL, CHECKPOINT.recordSize, MPI_BYTE,
+			CHECKPOINT.record, CHECKPOINT.recordSize, MPI_BYTE, 0, CHECKPOINT.comm);
+	HIVE_load_state(hive, CHECKPOINT.record);
+	exchange_state_load(CHECKPOINT.record + CHECKPOINT.hiveSize);
+
+	// Later checkpoints keep the seed of the run that was resumed
+	if(ckpt)
+		ctx->seed = Checkpoint_header(ckpt)->seed;
+	free(ckpt);
+	return true;
+}
 
-	int ridx1 = urandom_max(HIVE_nSols());
-	HIVE_force_replace_solution(sol1, ridx1);
+/* Returns whether all masters should write a checkpoint and stop, because one of them got SIGTERM.
+ * Masters tell each other whether they got it along with the next cycle, so they all learn it
+ *   after the same cycle, without ever waiting for each other.
+ */
+static
+bool checkpoint_stop_requested(){
+	bool stop = false;
+	if(CHECKPOINT.stopReq != MPI_REQUEST_NULL){
+		MPI_Wait(&CHECKPOINT.stopReq, MPI_STATUS_IGNORE);
+		stop = CHECKPOINT.anySigterm;
+	}
 
-	int ridx2 = urandom_max(HIVE_nSols());
-	HIVE_force_replace_solution(sol2, ridx2);
+	CHECKPOINT.sigterm = Checkpoint_sigterm_received();
+	MPI_Iallreduce(&CHECKPOINT.sigterm, &CHECKPOINT.anySigterm, 1, MPI_INT, MPI_MAX, CHECKPOINT.comm, &CHECKPOINT.stopReq);
+	return stop;
 }
 
 /* Gathers the best solutions among the hives in node 0.
  * 'ringComm' should be the communicator containing the masters of each hive.
- * The HIVE in node 0 is altered so that HIVE.best is the best among all best solutions
+ * The hive in node 0 is altered so that its best solution is the best among all best solutions
  *   of all hives.
  */
 static
-void ring_gather(MPI_Comm ringComm, int hpSize){
+void ring_gather(Hive *hive, MPI_Comm ringComm, int hpSize){
 	int i, commSize, myRank;
 	MPI_Comm_size(ringComm, &commSize);
 	MPI_Comm_rank(ringComm, &myRank);
@@ -198,30 +780,25 @@ void ring_gather(MPI_Comm ringComm, int hpSize){
 	if(commSize == 1) return;
 
 	// Get my solution
-	Solution sol = HIVE_best_sol();
+	Solution sol = HIVE_best_sol(hive);
 
-	// Create gather buffer
-	int maxSize = commSize * (hpSize + sizeof(double) + 32); // We overestimate a bit
-	char *gatBuf = malloc(maxSize);
-
-	// Pack my solution
-	int position = 0;
-	Solution_pack(sol, hpSize, gatBuf, maxSize, &position, ringComm);
+	// Create gather buffer, with one record per hive
+	int recordSize = Solution_record_size(hpSize);
+	char *gatBuf = heap_alloc(commSize * recordSize);
 
 	// Gather solutions
-	int byteCount = position;
-	ElfTreeComm_gather(gatBuf, byteCount, MPI_PACKED, ringComm);
+	Solution_write_record(sol, hpSize, gatBuf);
+	ElfTreeComm_gather(gatBuf, recordSize, MPI_BYTE, ringComm);
 
 	// Find best solution
 	if(myRank == 0){
-		position = 0;
 		for(i = 0; i < commSize; i++){
-			sol = Solution_unpack(hpSize, gatBuf, maxSize, &position, ringComm);
+			sol = Solution_read_record(HIVE_slab(hive), gatBuf + i * recordSize, hpSize);
 
-			if(Solution_fitness(sol) > Solution_fitness(HIVE_best_sol())){
-				HIVE_replace_best(sol);
+			if(Solution_fitness(sol) > Solution_fitness(HIVE_best_sol(hive))){
+				HIVE_replace_best(hive, sol);
 			} else {
-				Solution_free(sol);
+				Solution_free(HIVE_slab(hive), sol);
 			}
 		}
 	}
@@ -229,23 +806,36 @@ void ring_gather(MPI_Comm ringComm, int hpSize){
 	free(gatBuf);
 }
 
-Solution ABC_predict_structure(const HPElem * chaininghp, int hpSize, int nCycles, PredResults *results){
+Solution ABC_predict_structure(PredictionContext *ctx, int nCycles, PredResults *results){
+	int hpSize = ctx->hpSize;
+
+#ifdef _OPENMP
+	// Only the main thread calls MPI, while the whole team calculates fitnesses
+	int provided;
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+	if(provided < MPI_THREAD_FUNNELED){
+		fprintf(stderr, "The MPI library does not support threads!\n");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+#else
 	MPI_Init(NULL, NULL);
+#endif
+
+	// All nodes must draw from the same streams, even if the seed was chosen randomly
+	MPI_Bcast(&ctx->seed, 1, MPI_UINT32_T, 0, MPI_COMM_WORLD);
+	random_set_base_seed(ctx->seed);
+
 	int commSize, myRank;
 	MPI_Comm_size(MPI_COMM_WORLD, &commSize);
 	MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
 
-	/* We will divide COMM_WORLD into N_HIVES groups with same number of nodes each.
-	 * If COMM_WORLD has the nodes:
+	/* We divide COMM_WORLD into N_HIVES groups of nearby nodes, keeping each hive within a machine
+	 *   (see hive_index). If COMM_WORLD has the nodes:
 	 * 0 1 2 3 4 5
-	 * And N_HIVES == 2, then we will only place adjacent nodes in each subgroup:
-	 * (0 1 2) and (3 4 5)    (in contrast with, for example [0 2 4] and [1 3 5])
-	 *
-	 * So upon program call, keep this in mind in order keep processes of a single HIVE
-	 *   nearby, such as in a single multi-core processor.
+	 * all in one machine, and N_HIVES == 2, then the hives are (0 1 2) and (3 4 5).
+	 * If the nodes were split in machines (0 1) and (2 3 4 5), then the hives would be
+	 *   (0 1) and (2 3 4 5) instead.
 	 */
-	int nodesPerHive = commSize / N_HIVES;
-
 	if(N_HIVES > commSize){
 		if(myRank == 0)
 			fprintf(stderr, "Number of Hives cannot be greater than number of launched processes!\n");
@@ -253,21 +843,28 @@ Solution ABC_predict_structure(const HPElem * chaininghp, int hpSize, int nCycle
 		exit(0);
 	}
 
-	if(commSize % N_HIVES != 0){
+	int myColor = hive_index();
+	if(myColor < 0){
 		if(myRank == 0)
-			fprintf(stderr, "Number of Hives must divide the number of nodes!\n");
+			fprintf(stderr, "Some machine has fewer processes than the hives placed on it!\n");
 		MPI_Finalize();
-		exit(0);
+		exit(EXIT_FAILURE);
 	}
 
 	MPI_Comm hiveComm;
-	int myColor = myRank / nodesPerHive;
+	int hiveSize;
 	MPI_Comm_split(MPI_COMM_WORLD, myColor, myRank, &hiveComm);
+	MPI_Comm_size(hiveComm, &hiveSize);
 
-	HIVE_initialize();
+	set_threads_per_rank();
+	PredictionContext_start(ctx, myColor);
+	Hive *hive = ctx->hive;
 	HIVE_COMM.comm = hiveComm;
-	HIVE_COMM.size = nodesPerHive;
-	FitnessCalc_initialize(chaininghp, hpSize);
+	HIVE_COMM.size = hiveSize;
+	HIVE_COMM.tree = ElfTreeHier_create(hiveComm);
+	HIVE_COMM.load = (EvalLoad) {0, 0, 0};
+	int nOnlookers = COLONY_SIZE - (COLONY_SIZE * FORAGER_RATIO);
+	HIVE_COMM.replica = Solution_replica_create(HIVE_solutions(hive), HIVE_nSols(hive), nOnlookers + HIVE_nSols(hive), hpSize, hiveComm);
 
 	int myHiveRank, myWorldRank;
 	MPI_Comm_rank(hiveComm, &myHiveRank);
@@ -277,53 +874,119 @@ Solution ABC_predict_structure(const HPElem * chaininghp, int hpSize, int nCycle
 	int color = myHiveRank == 0 ? 0 : MPI_UNDEFINED;
 	MPI_Comm ringComm;
 	MPI_Comm_split(MPI_COMM_WORLD, color, myWorldRank, &ringComm);
+	if(myHiveRank == 0){
+		migration_initialize(ringComm, hpSize, nCycles);
+		global_best_initialize(ringComm, hpSize);
+		checkpoint_initialize(ctx, ringComm);
+	}
+
+	// Slaves keep nothing worth saving, so only the masters are restored, and the number of nodes
+	//   per hive may differ from the interrupted run. Replicas catch up at the next evaluation.
+	bool checkpointing = ctx->checkpointFile && ctx->checkpointInterval > 0;
+	if(checkpointing)
+		Checkpoint_catch_sigterm();
+
+	if(ctx->resume){
+		int ok = myHiveRank != 0 || checkpoint_load(ctx);
+		MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+		if(!ok){
+			MPI_Finalize();
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	Solution retval;
 	if(myHiveRank != 0){
-		Solution_calculate_fitness_slave(chaininghp, hpSize, HIVE_COMM.comm);
+		if(MPI_DYNAMIC_SCHEDULING)
+			Solution_calculate_fitness_slave_dynamic(ctx->fit, hpSize, HIVE_COMM.comm);
+		else
+			Solution_calculate_fitness_slave(ctx->fit, hpSize, HIVE_COMM.replica, HIVE_COMM.tree);
 		results->fitness = -1;
 		results->contactsH = -1;
 		results->collisions = -1;
 		results->bbGyration = -1;
 	} else {
 		int i;
+		double begin = MPI_Wtime();
+		long allocations = heap_allocations();
 
-		for(i = 0; i < nCycles; i++){
+		for(i = HIVE_cycle(hive); i < nCycles; i++){
 
-			parallel_forager_phase(hpSize);
+			parallel_forager_phase(ctx, hpSize);
 
-			parallel_onlooker_phase(hpSize);
+			parallel_onlooker_phase(ctx, hpSize);
 
 			/* For each solution, check its idle_iterations
 			 * If it exceeded the limit, replace it with a new random solution
 			 */
-			parallel_scout_phase(hpSize);
+			parallel_scout_phase(ctx, hpSize);
 
-			const int migCycle = nCycles * 0.1; // Migration cycle
-			if( i != 0 && (i % migCycle == 0) ){
-				ring_exchange(ringComm, hpSize);
+			/* Immigrants posted in the previous cycle should have arrived while this one was
+			 *   being evaluated. Then new emigrants are sent, to arrive during the next cycle.
+			 */
+			migration_complete(hive, hpSize);
+			if( i != 0 && (i % MIGRATION.interval == 0) ){
+				migration_post(hive, hpSize);
 			}
 
-			HIVE_increment_cycle();
+			HIVE_increment_cycle(hive);
+
+			if( BEST_SYNC_INTERVAL > 0 && (i + 1) % BEST_SYNC_INTERVAL == 0 ){
+				if(global_best_sync(hive, hpSize, i + 1)){
+					if(myWorldRank == 0)
+						fprintf(stderr, "Stopping after %d cycles, with global best fitness %lf.\n", i + 1, GLOBAL_BEST.bestFit);
+					break;
+				}
+			}
+
+			if(checkpointing){
+				bool stop = checkpoint_stop_requested();
+				if(stop || (i + 1) % ctx->checkpointInterval == 0)
+					checkpoint_save(ctx);
+				if(stop){
+					if(myWorldRank == 0)
+						fprintf(stderr, "Stopping after %d cycles on SIGTERM, with a checkpoint in '%s'.\n", i + 1, ctx->checkpointFile);
+					break;
+				}
+			}
 		}
 
-		ring_gather(ringComm, hpSize);
+		// The steady-state loop never touches the heap, as in the sequential builds
+		assert(heap_allocations() == allocations);
 
-		retval = HIVE_best_sol();
-		double fit = Solution_fitness(retval);
+		checkpoint_destroy();
+		migration_complete(hive, hpSize);
+		migration_destroy();
+		global_best_destroy();
+		ring_gather(hive, ringComm, hpSize);
+
+		Solution best = HIVE_best_sol(hive);
 
 		if(results && myWorldRank == 0){
-			results->fitness = fit;
-			FitnessCalc_measures(Solution_chain(retval), &results->contactsH, &results->collisions, &results->bbGyration);
+			results->fitness = Solution_fitness(best);
+			FitnessCalc_measures(ctx->fit, Solution_chain(best), &results->contactsH, &results->collisions, &results->bbGyration);
+		} else if(results){
+			results->fitness = -1;
+			results->contactsH = -1;
+			results->collisions = -1;
+			results->bbGyration = -1;
 		}
 
 		// Tell slaves to stop
-		Solution_calculate_fitness_master_kill_slaves(hpSize, HIVE_COMM.comm);
+		if(MPI_DYNAMIC_SCHEDULING){
+			EvalLoad loads[HIVE_COMM.size];
+			loads[0] = HIVE_COMM.load;
+			loads[0].elapsed = MPI_Wtime() - begin;
+			Solution_calculate_fitness_master_dynamic_kill_slaves(loads, HIVE_COMM.comm);
+			report_load(loads, myColor);
+		} else {
+			Solution_calculate_fitness_master_kill_slaves(hpSize, HIVE_COMM.comm);
+		}
 	}
 
 	MPI_Barrier(hiveComm);
-	FitnessCalc_cleanup();
-	HIVE_destroy();
+	Solution retval = PredictionContext_finish(ctx);
+	Solution_replica_destroy(HIVE_COMM.replica);
+	ElfTreeHier_destroy(HIVE_COMM.tree);
 	MPI_Comm_free(&hiveComm);
 	MPI_Finalize();
 
@@ -1,34 +1,89 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <sched.h>
 
 #include <migrch.h>
 #include <chaininghp.h>
 #include <fitness/fitness.h>
 #include <random.h>
+#include <heap.h>
+#include <spsc.h>
+
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
 
 #include "abc_alg.h"
 #include "hive.h"
+#include "checkpoint.h"
 
 
 /******************************************/
 /****** OTHER PROCEDURES           ********/
 /******************************************/
 
+/* Calculates the fitnesses of 'nSols' solutions in a single batch.
+ * If 'indexes' is not NULL, sols[i] is expected to be a perturbation of the indexes[i]-th solution
+ *   of the hive, so that its fitness can be calculated incrementally.
+ */
+static
+void calculate_fitness(PredictionContext *ctx, Solution *sols, const int *indexes, int nSols){
+	if(nSols == 0) return;
+
+	int i;
+	const shiftmel *chains[nSols];
+	const shiftmel *parents[nSols];
+	int positions[nSols];
+	double fits[nSols];
+
+	for(i = 0; i < nSols; i++){
+		chains[i] = Solution_chain(sols[i]);
+		if(indexes){
+			parents[i] = Solution_chain(HIVE_solution(ctx->hive, indexes[i]));
+			positions[i] = Solution_perturbed_pos(sols[i]);
+		}
+	}
+
+	if(indexes)
+		FitnessCalc_run_batch_delta(ctx->fit, parents, chains, positions, nSols, fits);
+	else
+		FitnessCalc_run_batch(ctx->fit, chains, nSols, fits);
+
+	for(i = 0; i < nSols; i++)
+		Solution_set_fitness(&sols[i], fits[i]);
+}
+
 /* Performs the forager phase of the searching cycle
  * Procedure idea:
  *   For each solution, generate a new one in the neighborhood
  *   replace the varied solution if it was improved
+ * Returns the number of candidate solutions generated.
  */
 static
-void forager_phase(int hpSize){
+int forager_phase(PredictionContext *ctx, int hpSize){
 	int i;
+	Hive *hive = ctx->hive;
+	Solution sols[HIVE_nSols(hive)];
+	int indexes[HIVE_nSols(hive)];
 
-	for(i = 0; i < HIVE_nSols(); i++){
-		// Change a random element of the solution
-		Solution alt = HIVE_perturb_solution(i, hpSize);
-		HIVE_try_replace_solution(alt, i, hpSize);
+	// Generate new random solutions
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		sols[i] = HIVE_perturb_solution(hive, i, hpSize, HIVE_rng(hive));
+		indexes[i] = i;
 	}
+
+	// Calculate fitnesses
+	calculate_fitness(ctx, sols, indexes, HIVE_nSols(hive));
+
+	// Replace solutions in the hive
+	for(i = 0; i < HIVE_nSols(hive); i++)
+		HIVE_try_replace_solution(hive, sols[i], i, hpSize);
+
+	return HIVE_nSols(hive);
 }
 
 /* Performs the onlooker phase of the searching cycle
@@ -37,83 +92,360 @@ void forager_phase(int hpSize){
  *   Fitness can be negative, so we add a BASE that is the lowest fitness found
  *   For each solution SOL, (SOL.fitness/SUM) is its probability PROB of being perturbed
  *   (PROB * nOnlookers) is the number of perturbations that should be generated
+ * Returns the number of candidate solutions generated.
  */
 static
-void onlooker_phase(int hpSize){
+int onlooker_phase(PredictionContext *ctx, int hpSize){
 	int i, j;
+	Hive *hive = ctx->hive;
 	int nOnlookers = COLONY_SIZE - (COLONY_SIZE * FORAGER_RATIO);
 
+	Solution sols[nOnlookers + HIVE_nSols(hive)]; // Overestimate due to possible rounding errors.
+	int indexes[nOnlookers + HIVE_nSols(hive)];   // Stores indexes where each solution belong
+	int nSols;
+
 	// Find the minimum (If no negative numbers, min should be 0)
 	double min = 0;
-	for(i = 0; i < HIVE_nSols(); i++){
-		double fit = Solution_fitness(HIVE_solution(i));
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		double fit = Solution_fitness(HIVE_solution(hive, i));
 		if(fit < min)
 			min = fit;
 	}
 
 	// Sum the 'normalized' fitnesses
 	double sum = 0;
-	for(i = 0; i < HIVE_nSols(); i++){
-		double fit = Solution_fitness(HIVE_solution(i));
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		double fit = Solution_fitness(HIVE_solution(hive, i));
 		sum += fit - min;
 	}
 
 	// For each solution, count the number of onlooker bees that should perturb it
-	//   then perturb it.
-	for(i = 0; i < HIVE_nSols(); i++){
-		double norm = Solution_fitness(HIVE_solution(i)) - min;
+	//   then add perturbed solutions into the sols vector
+	nSols = 0;
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		double norm = Solution_fitness(HIVE_solution(hive, i)) - min;
 		double prob = norm / sum; // The probability of perturbing such solution
 
 		// Count number of onlookers that should perturb such solution
 		int nIter = round(prob * nOnlookers);
 
+		// Generate perturbations
 		for(j = 0; j < nIter; j++){
-			// Change a random element of the solution
-			Solution alt = HIVE_perturb_solution(i, hpSize);
-			HIVE_try_replace_solution(alt, i, hpSize);
+			sols[nSols] = HIVE_perturb_solution(hive, i, hpSize, HIVE_rng(hive));
+			indexes[nSols] = i;
+			nSols++;
 		}
 	}
+
+	// Calculate fitnesses
+	calculate_fitness(ctx, sols, indexes, nSols);
+
+	// Replace solutions where due
+	for(i = 0; i < nSols; i++)
+		HIVE_try_replace_solution(hive, sols[i], indexes[i], hpSize);
+
+	return nSols;
 }
 
 /* Performs the scout phase of the searching cycle
  * Procedure idea:
  *   Find all the solutions whose idle_iterations exceeded the limit
- *   Replace such solutions by random solutions
+ *   Generate replacement solutions
+ *   Calculate fitness
+ *   Replace solutions
+ * Returns the number of candidate solutions generated.
  */
 static
-void scout_phase(int hpSize){
+int scout_phase(PredictionContext *ctx, int hpSize){
 	int i;
+	Hive *hive = ctx->hive;
 
-	for(i = 0; i < HIVE_nSols(); i++){
-		int idle = Solution_idle_iterations(HIVE_solution(i));
-		if(idle > IDLE_LIMIT){
-            Solution sol = Solution_random(hpSize);
-			HIVE_force_replace_solution(sol, i);
-		}
+	Solution sols[HIVE_nSols(hive)];
+	int indexes[HIVE_nSols(hive)];
+	int nSols = 0;
+
+	// Find idle solutions
+	for(i = 0; i < HIVE_nSols(hive); i++){
+		int idle = Solution_idle_iterations(HIVE_solution(hive, i));
+		if(idle > IDLE_LIMIT)
+			indexes[nSols++] = i;
 	}
+
+	// Generate random solutions
+	for(i = 0; i < nSols; i++)
+		sols[i] = Solution_random(HIVE_slab(hive), hpSize, HIVE_rng(hive));
+
+	// Calculate fitnesses
+	calculate_fitness(ctx, sols, NULL, nSols);
+
+	// Replace solutions
+	for(i = 0; i < nSols; i++)
+		HIVE_force_replace_solution(hive, sols[i], indexes[i]);
+
+	return nSols;
 }
 
-Solution ABC_predict_structure(const HPElem * chaininghp, int hpSize, int nCycles, PredResults *results){
-	HIVE_initialize();
-	FitnessCalc_initialize(chaininghp, hpSize);
+/* Predictions running in the process, and predictions started so far.
+ * Allocations are counted for the whole process, so the steady-state loop of a prediction is
+ *   only checked not to touch the heap if no other prediction ran alongside it.
+ */
+static atomic_int N_RUNNING = 0;
+static atomic_long N_STARTED = 0;
+
+/* Island hives of a run, each running on its own thread.
+ * Emigrants travel along a ring: island k sends to island k+1, through the queue of the latter.
+ * Islands only wait for each other at migrations, where each one waits for the emigrants its
+ *   predecessor sent at that same cycle. So a run is reproduced exactly from its seed.
+ */
+typedef struct Islands_ {
+	int nIslands;
+	int interval;       // Number of cycles between migrations
+	SpscQueue **queues; // queues[k] holds the immigrants of island k, as records (see Solution_write_record)
+} Islands;
+
+/* Pushes 'rec' into 'queue', waiting while the queue is full. */
+static
+void push_waiting(SpscQueue *queue, const char *rec){
+	while(!SpscQueue_push(queue, rec))
+		sched_yield();
+}
 
+/* Pops a record from 'queue' into 'rec', waiting while the queue is empty. */
+static
+void pop_waiting(SpscQueue *queue, char *rec){
+	while(!SpscQueue_pop(queue, rec))
+		sched_yield();
+}
+
+/* If it is time to, sends the best solution and N_EMIGRANTS-1 random ones to the next island,
+ *   then waits for the N_EMIGRANTS the previous island sent at this cycle, and places them into
+ *   random spots of the hive.
+ */
+static
+void migrate(PredictionContext *ctx, const Islands *islands, int cycle, int island, int hpSize){
 	int i;
-	for(i = 0; i < nCycles; i++){
-		forager_phase(hpSize);
-		onlooker_phase(hpSize);
-		scout_phase(hpSize);
+	Hive *hive = ctx->hive;
+	char rec[Solution_record_size(hpSize)];
+
+	if((cycle + 1) % islands->interval != 0 || N_EMIGRANTS < 1) return;
+
+	SpscQueue *dest = islands->queues[(island + 1) % islands->nIslands];
+	Solution_write_record(HIVE_best_sol(hive), hpSize, rec);
+	push_waiting(dest, rec);
+	for(i = 1; i < N_EMIGRANTS; i++){
+		Solution randSol = HIVE_solution(hive, urandom_max_r(HIVE_rng(hive), HIVE_nSols(hive)));
+		Solution_write_record(randSol, hpSize, rec);
+		push_waiting(dest, rec);
+	}
+
+	for(i = 0; i < N_EMIGRANTS; i++){
+		pop_waiting(islands->queues[island], rec);
+		Solution sol = Solution_read_record(HIVE_slab(hive), rec, hpSize);
+		HIVE_force_replace_solution(hive, sol, urandom_max_r(HIVE_rng(hive), HIVE_nSols(hive)));
+	}
+}
+
+/* Waits for all islands of the run to reach this point.
+ * A single island runs on the thread of the caller, which may belong to a team of its own,
+ *   so it must not wait for the rest of that team.
+ */
+static
+void islands_barrier(const Islands *islands){
+	if(islands->nIslands > 1){
+		#pragma omp barrier
 	}
+}
 
-	Solution retval = HIVE_best_sol();
+/* Restores the hive of 'ctx' from its checkpoint, exiting if it cannot be read. */
+static
+void resume_hive(PredictionContext *ctx){
+	Hive *hive = ctx->hive;
+	void *ckpt = Checkpoint_read(ctx->checkpointFile, ctx, HIVE_nSols(hive), 1, HIVE_state_size(hive));
+	if(!ckpt)
+		exit(EXIT_FAILURE);
+
+	HIVE_load_state(hive, Checkpoint_record(ckpt, ctx, HIVE_state_size(hive), 0));
+	ctx->seed = Checkpoint_header(ckpt)->seed;
+	free(ckpt);
+}
+
+/* Hands a checkpoint of the hive of 'ctx' to 'writer', without waiting for it to be written. */
+static
+void checkpoint_hive(PredictionContext *ctx, CheckpointWriter *writer){
+	Hive *hive = ctx->hive;
+	void *ckpt = CheckpointWriter_buffer(writer);
+	HIVE_save_state(hive, Checkpoint_record(ckpt, ctx, HIVE_state_size(hive), 0));
+	Checkpoint_set_header(ckpt, ctx, HIVE_nSols(hive), 1, HIVE_state_size(hive), HIVE_cycle(hive));
+	CheckpointWriter_submit(writer);
+}
+
+/* Runs a prediction with 'ctx', as island 'island', in the calling thread, and returns its best solution.
+ * With several islands, it must be called by every thread of the team running them.
+ */
+static
+Solution run_hive(PredictionContext *ctx, const Islands *islands, int nCycles, int island, PredResults *results){
+	int hpSize = ctx->hpSize;
+	PredictionContext_start(ctx, island);
+
+	// Only single hives are checkpointed (see predict_islands)
+	CheckpointWriter *writer = NULL;
+	if(islands->nIslands == 1){
+		if(ctx->resume)
+			resume_hive(ctx);
+		if(ctx->checkpointFile && ctx->checkpointInterval > 0){
+			writer = CheckpointWriter_create(ctx->checkpointFile, Checkpoint_size(ctx, 1, HIVE_state_size(ctx->hive)));
+			Checkpoint_catch_sigterm();
+		}
+	}
+
+	// Chains come from the slab of the hive, and bead buffers from the scratch arenas.
+	// Allocations are counted for the whole process, so every island must be done setting up.
+	islands_barrier(islands);
+	long started = atomic_load(&N_STARTED);
+	bool alone = atomic_load(&N_RUNNING) == 1;
+	long allocations = heap_allocations();
+
+	int i;
+	for(i = HIVE_cycle(ctx->hive); i < nCycles; i++){
+		long evaluations = FitnessCalc_evaluations(ctx->fit);
+		int nCandidates = 0;
+
+		nCandidates += forager_phase(ctx, hpSize);
+		nCandidates += onlooker_phase(ctx, hpSize);
+		nCandidates += scout_phase(ctx, hpSize);
+
+		// Solutions in the hive are never evaluated again, only the new candidates are
+		assert(FitnessCalc_evaluations(ctx->fit) - evaluations == nCandidates);
+
+		if(islands->nIslands > 1)
+			migrate(ctx, islands, i, island, hpSize);
+
+		HIVE_increment_cycle(ctx->hive);
+
+		if(writer){
+			bool stop = Checkpoint_sigterm_received();
+			if(stop || (i + 1) % ctx->checkpointInterval == 0)
+				checkpoint_hive(ctx, writer);
+			if(stop){
+				fprintf(stderr, "Stopping after %d cycles on SIGTERM, with a checkpoint in '%s'.\n", i + 1, ctx->checkpointFile);
+				break;
+			}
+		}
+	}
+
+	// The steady-state loop never touches the heap, which is checked before any island starts tearing down
+	islands_barrier(islands);
+	long finalAllocations = heap_allocations();
+	alone = alone && atomic_load(&N_STARTED) == started;
+	islands_barrier(islands);
+	assert(!alone || finalAllocations == allocations);
+
+	// The last checkpoint is written before the prediction ends
+	if(writer)
+		CheckpointWriter_destroy(writer);
 
 	if(results){
-		results->fitness = Solution_fitness(retval);
-		FitnessCalc_measures(Solution_chain(retval), &results->contactsH, &results->collisions, &results->bbGyration);
+		Solution best = HIVE_best_sol(ctx->hive);
+		results->fitness = Solution_fitness(best);
+		FitnessCalc_measures(ctx->fit, Solution_chain(best), &results->contactsH, &results->collisions, &results->bbGyration);
+	}
+
+	return PredictionContext_finish(ctx);
+}
+
+/* Runs the prediction of 'ctx', on N_HIVES island threads if there are several. */
+static
+Solution predict_islands(PredictionContext *ctx, int nCycles, PredResults *results){
+	int nIslands = N_HIVES > 1 ? N_HIVES : 1;
+
+#ifndef _OPENMP
+	if(nIslands > 1){
+		fprintf(stderr, "Island hives need OpenMP; running a single hive instead of %d.\n", nIslands);
+		nIslands = 1;
+	}
+#endif
+
+	if(nIslands > 1 && ctx->resume){
+		fprintf(stderr, "Island hives are never checkpointed, so they cannot be resumed.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(nIslands > 1 && ctx->checkpointFile && ctx->checkpointInterval > 0)
+		fprintf(stderr, "Island hives are never checkpointed; running without checkpoints.\n");
+
+	Islands islands = {nIslands, 0, NULL};
+	if(nIslands == 1)
+		return run_hive(ctx, &islands, nCycles, 0, results);
+
+	int i;
+	if(MIGRATION_INTERVAL > 0)
+		islands.interval = MIGRATION_INTERVAL;
+	else
+		islands.interval = nCycles / 10 > 0 ? nCycles / 10 : 1;
+
+	// Room for a few exchanges, so that an island rarely waits to send to one that fell behind
+	islands.queues = heap_alloc(sizeof(SpscQueue *) * nIslands);
+	for(i = 0; i < nIslands; i++)
+		islands.queues[i] = SpscQueue_create(4 * (N_EMIGRANTS > 0 ? N_EMIGRANTS : 1), Solution_record_size(ctx->hpSize));
+
+	Solution bests[nIslands];
+	PredResults islandResults[nIslands];
+
+	int nThreads = nIslands;
+
+#ifdef _OPENMP
+	// The cores are split among the islands, for the fitness backends that use threads
+	int threadsPerIsland = omp_get_num_procs() / nIslands;
+	omp_set_max_active_levels(2);
+
+	#pragma omp parallel num_threads(nIslands)
+	{
+		// OpenMP may start fewer threads than asked for (e.g. OMP_THREAD_LIMIT), and then no island runs
+		#pragma omp single
+		nThreads = omp_get_num_threads();
+
+		if(nThreads == nIslands){
+			int island = omp_get_thread_num();
+			omp_set_num_threads(threadsPerIsland > 0 ? threadsPerIsland : 1);
+
+			// Each island has its own calculator and hive, set up after its thread count
+			PredictionContext *islandCtx = PredictionContext_create(ctx->chaininghp, ctx->hpSize, &ctx->energy);
+			islandCtx->seed = ctx->seed;
+			bests[island] = run_hive(islandCtx, &islands, nCycles, island, &islandResults[island]);
+			PredictionContext_destroy(islandCtx);
+		}
+	}
+#endif
+
+	for(i = 0; i < nIslands; i++)
+		SpscQueue_destroy(islands.queues[i]);
+	free(islands.queues);
+
+	if(nThreads != nIslands){
+		fprintf(stderr, "Only %d threads could be started for %d island hives; running a single hive instead.\n", nThreads, nIslands);
+		islands.nIslands = 1;
+		return run_hive(ctx, &islands, nCycles, 0, results);
+	}
+
+	int best = 0;
+	for(i = 1; i < nIslands; i++){
+		if(Solution_fitness(bests[i]) > Solution_fitness(bests[best]))
+			best = i;
+	}
+	for(i = 0; i < nIslands; i++){
+		if(i != best)
+			Solution_free(NULL, bests[i]);
 	}
 
-	FitnessCalc_cleanup();
-	HIVE_destroy();
+	if(results)
+		*results = islandResults[best];
 
-	return retval;
+	return bests[best];
 }
 
+Solution ABC_predict_structure(PredictionContext *ctx, int nCycles, PredResults *results){
+	atomic_fetch_add(&N_STARTED, 1);
+	atomic_fetch_add(&N_RUNNING, 1);
+	Solution best = predict_islands(ctx, nCycles, results);
+	atomic_fetch_sub(&N_RUNNING, 1);
+	return best;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <heap.h>
+
+#include "checkpoint.h"
+
+/******************************************/
+/****** FILE LAYOUT                ********/
+/******************************************/
+
+// Documented in header file
+size_t Checkpoint_size(const PredictionContext *ctx, int nHives, int recordSize){
+	return sizeof(CheckpointHeader) + ctx->hpSize + (size_t) nHives * recordSize;
+}
+
+// Documented in header file
+void Checkpoint_set_header(void *ckpt, const PredictionContext *ctx, int nSols, int nHives, int recordSize, int cycle){
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.hpSize = ctx->hpSize;
+	header.nSols = nSols;
+	header.nHives = nHives;
+	header.recordSize = recordSize;
+	header.cycle = cycle;
+	header.seed = ctx->seed;
+
+	memcpy(ckpt, &header, sizeof(header));
+	memcpy((char *) ckpt + sizeof(header), ctx->chaininghp, ctx->hpSize);
+}
+
+// Documented in header file
+char *Checkpoint_record(void *ckpt, const PredictionContext *ctx, int recordSize, int hive){
+	return (char *) ckpt + sizeof(CheckpointHeader) + ctx->hpSize + (size_t) hive * recordSize;
+}
+
+// Documented in header file
+const CheckpointHeader *Checkpoint_header(const void *ckpt){
+	return ckpt;
+}
+
+// Documented in header file
+void *Checkpoint_read(const char *path, const PredictionContext *ctx, int nSols, int nHives, int recordSize){
+	FILE *fp = fopen(path, "rb");
+	if(!fp){
+		fprintf(stderr, "Could not open the checkpoint '%s'.\n", path);
+		return NULL;
+	}
+
+	size_t size = Checkpoint_size(ctx, nHives, recordSize);
+	char *ckpt = heap_alloc(size);
+	size_t nRead = fread(ckpt, 1, size, fp);
+	bool atEnd = fgetc(fp) == EOF;
+	fclose(fp);
+
+	const char *problem = NULL;
+	CheckpointHeader header;
+	memcpy(&header, ckpt, nRead < sizeof(header) ? nRead : sizeof(header));
+
+	if(nRead < sizeof(header) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+		problem = "it is not a checkpoint of this version";
+	else if(header.hpSize != ctx->hpSize || memcmp(ckpt + sizeof(header), ctx->chaininghp, ctx->hpSize) != 0)
+		problem = "it is for another protein";
+	else if(header.nHives != nHives)
+		problem = "it has another number of hives (N_HIVES)";
+	else if(header.nSols != nSols || header.recordSize != recordSize)
+		problem = "it has another colony, or another migration setup";
+	else if(nRead != size || !atEnd)
+		problem = "it is truncated or corrupt";
+
+	if(problem){
+		fprintf(stderr, "Cannot resume from the checkpoint '%s': %s.\n", path, problem);
+		free(ckpt);
+		return NULL;
+	}
+
+	return ckpt;
+}
+
+/******************************************/
+/****** WRITER                     ********/
+/******************************************/
+
+/** The search fills one buffer while the thread writes the other.
+ * A buffer is at any time being filled, pending, being written, or free. Only the search picks
+ *   buffers to fill, never the one being written, and only the thread picks the pending one.
+ */
+struct CheckpointWriter_ {
+	char *path;
+	char *tmpPath;  /**< Where checkpoints are written before being renamed to 'path' */
+	size_t size;
+	char *bufs[2];
+	int filling;    /**< Buffer being filled by the search, or -1 */
+	int pending;    /**< Buffer submitted but not yet being written, or -1 */
+	int writing;    /**< Buffer being written by the thread, or -1 */
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+};
+
+/* Writes 'buf' into the file of the writer, atomically replacing the previous checkpoint. */
+static
+void write_file(CheckpointWriter *writer, const char *buf){
+	FILE *fp = fopen(writer->tmpPath, "wb");
+	bool ok = fp != NULL;
+
+	if(fp){
+		ok = fwrite(buf, 1, writer->size, fp) == writer->size;
+		ok = fflush(fp) == 0 && ok;
+		ok = fsync(fileno(fp)) == 0 && ok;
+		ok = fclose(fp) == 0 && ok;
+	}
+
+	if(!ok || rename(writer->tmpPath, writer->path) != 0)
+		fprintf(stderr, "Could not write the checkpoint '%s'.\n", writer->path);
+}
+
+/* Body of the thread of the writer: writes pending checkpoints until told to stop. */
+static
+void *writer_thread(void *arg){
+	CheckpointWriter *writer = arg;
+
+	pthread_mutex_lock(&writer->lock);
+	while(true){
+		while(writer->pending < 0 && !writer->stop)
+			pthread_cond_wait(&writer->changed, &writer->lock);
+		if(writer->pending < 0)
+			break;
+
+		writer->writing = writer->pending;
+		writer->pending = -1;
+		pthread_mutex_unlock(&writer->lock);
+
+		write_file(writer, writer->bufs[writer->writing]);
+
+		pthread_mutex_lock(&writer->lock);
+		writer->writing = -1;
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+// Documented in header file
+CheckpointWriter *CheckpointWriter_create(const char *path, size_t size){
+	CheckpointWriter *writer = heap_alloc(sizeof(CheckpointWriter));
+	writer->path = heap_alloc(strlen(path) + 1);
+	strcpy(writer->path, path);
+	writer->tmpPath = heap_alloc(strlen(path) + 5);
+	sprintf(writer->tmpPath, "%s.tmp", path);
+
+	writer->size = size;
+	writer->bufs[0] = heap_alloc(size);
+	writer->bufs[1] = heap_alloc(size);
+	writer->filling = writer->pending = writer->writing = -1;
+	writer->stop = false;
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->changed, NULL);
+	pthread_create(&writer->thread, NULL, writer_thread, writer);
+	return writer;
+}
+
+// Documented in header file
+void CheckpointWriter_destroy(CheckpointWriter *writer){
+	// The thread writes what is pending before it stops
+	pthread_mutex_lock(&writer->lock);
+	writer->stop = true;
+	pthread_cond_signal(&writer->changed);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	pthread_cond_destroy(&writer->changed);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->bufs[0]);
+	free(writer->bufs[1]);
+	free(writer->tmpPath);
+	free(writer->path);
+	free(writer);
+}
+
+// Documented in header file
+void *CheckpointWriter_buffer(CheckpointWriter *writer){
+	pthread_mutex_lock(&writer->lock);
+	if(writer->pending >= 0){
+		// It was never written, and is overwritten with a newer checkpoint
+		writer->filling = writer->pending;
+		writer->pending = -1;
+	} else {
+		writer->filling = writer->writing == 0 ? 1 : 0;
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return writer->bufs[writer->filling];
+}
+
+// Documented in header file
+void CheckpointWriter_submit(CheckpointWriter *writer){
+	pthread_mutex_lock(&writer->lock);
+	writer->pending = writer->filling;
+	writer->filling = -1;
+	pthread_cond_signal(&writer->changed);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/******************************************/
+/****** SIGNALS                    ********/
+/******************************************/
+
+static volatile sig_atomic_t SIGTERM_RECEIVED = 0;
+
+/* Handler of SIGTERM, which only raises the flag. */
+static
+void on_sigterm(int signum){
+	(void) signum;
+	SIGTERM_RECEIVED = 1;
+}
+
+// Documented in header file
+void Checkpoint_catch_sigterm(){
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_sigterm;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+}
+
+// Documented in header file
+bool Checkpoint_sigterm_received(){
+	return SIGTERM_RECEIVED != 0;
+}
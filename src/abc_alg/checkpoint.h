@@ -0,0 +1,83 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/** \file checkpoint.h Checkpoints of the whole state of a prediction, from which it can be resumed.
+ *
+ * A checkpoint file holds a header, the protein, and then one record per hive. The record of a hive
+ *   is its state (see HIVE_save_state) followed by whatever state the driver keeps for it, such as
+ *   migrations in flight. All records have the same size.
+ * Checkpoints are plain bytes, meant to be read by the same build on the same kind of machine.
+ *
+ * Files are written by a background thread, so the search never waits for the disk, and replaced
+ *   atomically, so a run killed while writing one leaves the previous one intact.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "abc_alg.h"
+
+/** Identifies checkpoint files, and the version of their layout. */
+#define CHECKPOINT_MAGIC "PROVCK1"
+
+/** Header of a checkpoint file. */
+typedef struct CheckpointHeader_ {
+	char magic[8];      /**< CHECKPOINT_MAGIC */
+	int32_t hpSize;     /**< Number of beads of the protein, which follows the header */
+	int32_t nSols;      /**< Number of solutions of each hive */
+	int32_t nHives;     /**< Number of hive records, which follow the protein */
+	int32_t recordSize; /**< Size of each hive record */
+	int32_t cycle;      /**< Number of cycles completed */
+	uint32_t seed;      /**< Seed the prediction started from */
+} CheckpointHeader;
+
+/** Returns the size of a checkpoint of 'nHives' hives predicting the protein of 'ctx', with
+ *   records of 'recordSize' bytes.
+ */
+size_t Checkpoint_size(const PredictionContext *ctx, int nHives, int recordSize);
+
+/** Fills the header and protein of checkpoint 'ckpt'. */
+void Checkpoint_set_header(void *ckpt, const PredictionContext *ctx, int nSols, int nHives, int recordSize, int cycle);
+
+/** Returns the record of hive number 'hive' within checkpoint 'ckpt', for the protein of 'ctx' and
+ *   records of 'recordSize' bytes. The place of records does not depend on the contents of 'ckpt',
+ *   so they may be filled before the header.
+ */
+char *Checkpoint_record(void *ckpt, const PredictionContext *ctx, int recordSize, int hive);
+
+/** Returns the header of checkpoint 'ckpt'. */
+const CheckpointHeader *Checkpoint_header(const void *ckpt);
+
+/** Reads the checkpoint in file 'path', which must be for the protein of 'ctx', with 'nHives'
+ *   hives of 'nSols' solutions and records of 'recordSize' bytes.
+ * Returns the checkpoint, to be freed by the caller, or NULL if it could not be read or does
+ *   not match, in which case the reason is printed to stderr.
+ */
+void *Checkpoint_read(const char *path, const PredictionContext *ctx, int nSols, int nHives, int recordSize);
+
+/** Writes checkpoints of a fixed size to a file, from a thread of its own.
+ * The search fills a buffer and submits it, and goes on while it is written. If it submits a new
+ *   checkpoint before the previous one is written, only the newest one is written.
+ */
+typedef struct CheckpointWriter_ CheckpointWriter;
+
+/** Creates a writer of checkpoints of 'size' bytes into file 'path', and starts its thread. */
+CheckpointWriter *CheckpointWriter_create(const char *path, size_t size);
+
+/** Waits until all submitted checkpoints are written, stops the thread and frees the writer. */
+void CheckpointWriter_destroy(CheckpointWriter *writer);
+
+/** Returns a buffer to fill with the next checkpoint, which is not being written. */
+void *CheckpointWriter_buffer(CheckpointWriter *writer);
+
+/** Hands the buffer returned by CheckpointWriter_buffer to the thread, to be written. */
+void CheckpointWriter_submit(CheckpointWriter *writer);
+
+/** Makes SIGTERM set a flag instead of killing the process, so that a final checkpoint can be written. */
+void Checkpoint_catch_sigterm();
+
+/** Returns whether the process received SIGTERM since Checkpoint_catch_sigterm was called. */
+bool Checkpoint_sigterm_received();
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <fitness/fitness.h>
+#include <heap.h>
+#include <random.h>
+
+#include "abc_alg.h"
+#include "hive.h"
+
+// Documented in header file
+PredictionContext *PredictionContext_create(const HPElem *chaininghp, int hpSize, const EnergyParams *energy){
+	PredictionContext *ctx = heap_calloc(1, sizeof(PredictionContext));
+	ctx->energy = *energy;
+	ctx->seed = random_base_seed();
+	PredictionContext_retarget(ctx, chaininghp, hpSize);
+	return ctx;
+}
+
+// Documented in header file
+void PredictionContext_retarget(PredictionContext *ctx, const HPElem *chaininghp, int hpSize){
+	assert(ctx->hive == NULL);
+
+	if(ctx->chaininghp && ctx->hpSize == hpSize && memcmp(ctx->chaininghp, chaininghp, hpSize) == 0)
+		return;
+
+	// The calculator points to the protein, so it goes before the protein does
+	if(ctx->fit){
+		FitnessCalc_destroy(ctx->fit);
+		ctx->fit = NULL;
+	}
+	if(ctx->slab && !ChainSlab_fits(ctx->slab, hpSize)){
+		ChainSlab_destroy(ctx->slab);
+		ctx->slab = NULL;
+	}
+
+	free(ctx->chaininghp);
+	ctx->chaininghp = heap_alloc(hpSize + 1);
+	memcpy(ctx->chaininghp, chaininghp, hpSize);
+	ctx->chaininghp[hpSize] = '\0';
+	ctx->hpSize = hpSize;
+}
+
+// Documented in header file
+void PredictionContext_destroy(PredictionContext *ctx){
+	assert(ctx->hive == NULL);
+	if(ctx->fit)
+		FitnessCalc_destroy(ctx->fit);
+	if(ctx->slab)
+		ChainSlab_destroy(ctx->slab);
+	free(ctx->chaininghp);
+	free(ctx);
+}
+
+// Documented in header file
+void PredictionContext_start(PredictionContext *ctx, int hiveId){
+	assert(ctx->hive == NULL);
+	if(!ctx->fit)
+		ctx->fit = FitnessCalc_create(ctx->chaininghp, ctx->hpSize, &ctx->energy);
+	if(!ctx->slab)
+		ctx->slab = HIVE_create_slab(ctx->hpSize);
+	ctx->hive = HIVE_create(ctx->fit, ctx->slab, ctx->hpSize, ctx->seed, hiveId);
+}
+
+// Documented in header file
+Solution PredictionContext_finish(PredictionContext *ctx){
+	Solution best = HIVE_destroy(ctx->hive);
+	ctx->hive = NULL;
+	return best;
+}
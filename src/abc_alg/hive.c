@@ -2,12 +2,14 @@
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <assert.h>
 
 #include <migrch.h>
 #include <chaininghp.h>
 #include <fitness/fitness.h>
 #include <random.h>
 #include <config.h>
+#include <heap.h>
 #include <string.h>
 
 #include <solution/solution.h>
@@ -22,109 +24,240 @@ struct HIVE_ {
 	int cycle;      /**< Keeps track of what cycle we are running */
 	int hpSize;     /**< Stores size of the HP chain of the protein being predicted. */
 	Solution best;  /**< Best solution found so far */
+	mt_state rng;   /**< Random stream of this hive */
+	ChainSlab *slab; /**< Slab holding the movement chains of the solutions and candidates, lent by the creator */
+	FitnessCalc *fit; /**< Calculator with which solutions are evaluated */
+	int *replaced;    /**< Indexes of the solutions replaced since HIVE_take_replaced, each listed once */
+	int nReplaced;
+	bool *isReplaced; /**< Whether each solution is listed in 'replaced' */
 };
 
-/** Our global HIVE */
-struct HIVE_ HIVE;
-
 /******************************************/
 /****** HIVE PROCEDURES            ********/
 /******************************************/
 
+/* Notes that the solution at 'index' was replaced, for HIVE_take_replaced. */
+static inline
+void mark_replaced(Hive *hive, int index){
+	if(!hive->isReplaced[index]){
+		hive->isReplaced[index] = true;
+		hive->replaced[hive->nReplaced++] = index;
+	}
+}
+
+// Documented in header file
+ChainSlab *HIVE_create_slab(int hpSize){
+	/* At most, the hive holds its solutions, the best one, and the candidates of a phase,
+	 *   which are never more than nSols + nOnlookers. A few more are left for migrants.
+	 * If the slab is ever exhausted, chains come from the heap instead.
+	 */
+	int nSols = COLONY_SIZE * FORAGER_RATIO;
+	int nOnlookers = COLONY_SIZE - nSols;
+	return ChainSlab_create(hpSize, 2 * nSols + nOnlookers + 16);
+}
+
 // Documented in header file
-void HIVE_initialize(){
-	HIVE.nSols = COLONY_SIZE * FORAGER_RATIO;
-	HIVE.sols = malloc(sizeof(Solution) * HIVE.nSols);
-	HIVE.hpSize = strlen(HP_CHAIN);
+Hive *HIVE_create(FitnessCalc *fit, ChainSlab *slab, int hpSize, uint32_t baseSeed, int hiveId){
+	Hive *hive = heap_alloc(sizeof(Hive));
+	hive->nSols = COLONY_SIZE * FORAGER_RATIO;
+	hive->sols = heap_alloc(sizeof(Solution) * hive->nSols);
+	hive->replaced = heap_alloc(sizeof(int) * hive->nSols);
+	hive->isReplaced = heap_calloc(hive->nSols, sizeof(bool));
+	hive->nReplaced = 0;
+	hive->hpSize = hpSize;
+	hive->fit = fit;
+	hive->slab = slab;
+	random_seed_stream_from(&hive->rng, baseSeed, hiveId);
 
 	int i;
-	for(i = 0; i < HIVE.nSols; i++)
-		HIVE.sols[i] = Solution_random(HIVE.hpSize);
+	for(i = 0; i < hive->nSols; i++)
+		hive->sols[i] = Solution_random(hive->slab, hive->hpSize, &hive->rng);
+
+	hive->cycle = 0;
+	hive->best = Solution_random(hive->slab, hive->hpSize, &hive->rng);
+
+	// The hive never holds unevaluated solutions
+	const shiftmel *chains[hive->nSols];
+	double fits[hive->nSols];
+	for(i = 0; i < hive->nSols; i++)
+		chains[i] = Solution_chain(hive->sols[i]);
+
+	FitnessCalc_run_batch(fit, chains, hive->nSols, fits);
+	for(i = 0; i < hive->nSols; i++)
+		Solution_set_fitness(&hive->sols[i], fits[i]);
+	Solution_evaluate(fit, &hive->best);
 
-	HIVE.cycle = 0;
-	HIVE.best = Solution_random(HIVE.hpSize);
+	return hive;
 }
 
 // Documented in header file
-void HIVE_destroy(){
+Solution HIVE_destroy(Hive *hive){
 	int i;
-	for(i = 0; i < HIVE.nSols; i++){
-		Solution_free(HIVE.sols[i]);
+	for(i = 0; i < hive->nSols; i++){
+		Solution_free(hive->slab, hive->sols[i]);
 	}
-	free(HIVE.sols);
+	free(hive->sols);
+	free(hive->replaced);
+	free(hive->isReplaced);
+
+	// The best solution outlives the hive, so it is moved out of the slab
+	Solution best = Solution_copy(NULL, hive->best, hive->hpSize);
+	Solution_free(hive->slab, hive->best);
+	free(hive);
+
+	return best;
+}
+
+int HIVE_nSols(const Hive *hive){
+	return hive->nSols;
+}
+
+int HIVE_cycle(const Hive *hive){
+	return hive->cycle;
+}
+
+Solution *HIVE_solutions(Hive *hive){
+	return hive->sols;
 }
 
-int HIVE_nSols(){
-	return HIVE.nSols;
+Solution HIVE_solution(const Hive *hive, int idx){
+	return hive->sols[idx];
 }
 
-int HIVE_cycle(){
-	return HIVE.cycle;
+Solution HIVE_best_sol(const Hive *hive){
+	return hive->best;
 }
 
-Solution *HIVE_solutions(){
-	return HIVE.sols;
+int HIVE_hp_size(const Hive *hive){
+	return hive->hpSize;
 }
 
-Solution HIVE_solution(int idx){
-	return HIVE.sols[idx];
+mt_state *HIVE_rng(Hive *hive){
+	return &hive->rng;
 }
 
-Solution HIVE_best_sol(){
-	return HIVE.best;
+ChainSlab *HIVE_slab(Hive *hive){
+	return hive->slab;
 }
 
-int HIVE_hp_size(){
-	return HIVE.hpSize;
+FitnessCalc *HIVE_fitness(Hive *hive){
+	return hive->fit;
 }
 
 // Documented in header file
-void HIVE_increment_cycle(){
-	HIVE.cycle++;
+void HIVE_increment_cycle(Hive *hive){
+	hive->cycle++;
 }
 
 // Documented in header file
-void HIVE_increment_idle(int index){
-	Solution_inc_idle_iterations(&HIVE.sols[index]);
+void HIVE_increment_idle(Hive *hive, int index){
+	Solution_inc_idle_iterations(&hive->sols[index]);
 }
 
 // Documented in header file
-Solution HIVE_perturb_solution(int index, int hpSize){
+Solution HIVE_perturb_solution(Hive *hive, int index, int hpSize, mt_state *rng){
 	int other;
 
 	do {
-		other = urandom_max(HIVE.nSols);
+		other = urandom_max_r(rng, hive->nSols);
 	} while(other == index);
 
-	return Solution_perturb_relative(HIVE.sols[index], HIVE.sols[other], hpSize);
+	return Solution_perturb_relative(hive->slab, hive->sols[index], hive->sols[other], hpSize, rng);
 }
 
-void HIVE_try_replace_solution(Solution alt, int index, int hpSize){
-	double altFit = Solution_fitness(alt);
-	double curFit = Solution_fitness(HIVE.sols[index]);
+void HIVE_try_replace_solution(Hive *hive, Solution alt, int index, int hpSize){
+	// 'alt' was perturbed from the solution it competes with
+	double altFit = Solution_fitness_from_parent(hive->fit, &alt, hive->sols[index]);
+	double curFit = Solution_fitness(hive->sols[index]);
 
     if(altFit > curFit){
-		Solution_free(HIVE.sols[index]);
-		HIVE.sols[index] = alt;
+		Solution_free(hive->slab, hive->sols[index]);
+		hive->sols[index] = alt;
+		mark_replaced(hive, index);
 
-		double bestFit = Solution_fitness(HIVE.best);
+		double bestFit = Solution_fitness(hive->best);
 		if(altFit > bestFit){
-			Solution_free(HIVE.best);
-			HIVE.best = Solution_copy(alt, hpSize);
+			Solution_free(hive->slab, hive->best);
+			hive->best = Solution_copy(hive->slab, alt, hpSize);
 		}
     } else {
-		Solution_free(alt);
-		Solution_inc_idle_iterations(&HIVE.sols[index]);
+		Solution_free(hive->slab, alt);
+		Solution_inc_idle_iterations(&hive->sols[index]);
 	}
 }
 
-void HIVE_force_replace_solution(Solution alt, int index){
-	Solution_free(HIVE.sols[index]);
-	HIVE.sols[index] = alt;
+void HIVE_force_replace_solution(Hive *hive, Solution alt, int index){
+	assert(Solution_is_evaluated(alt));
+	Solution_free(hive->slab, hive->sols[index]);
+	hive->sols[index] = alt;
+	mark_replaced(hive, index);
 }
 
 // Documented in header file
-void HIVE_replace_best(Solution newBest){
-	Solution_free(HIVE.best);
-	HIVE.best = newBest;
+int HIVE_take_replaced(Hive *hive, int *indexes){
+	int i, n = hive->nReplaced;
+	for(i = 0; i < n; i++){
+		indexes[i] = hive->replaced[i];
+		hive->isReplaced[indexes[i]] = false;
+	}
+	hive->nReplaced = 0;
+	return n;
+}
+
+// Documented in header file
+void HIVE_replace_best(Hive *hive, Solution newBest){
+	assert(Solution_is_evaluated(newBest));
+	Solution_free(hive->slab, hive->best);
+	hive->best = newBest;
+}
+
+// Documented in header file
+int HIVE_state_size(const Hive *hive){
+	int recordSize = Solution_record_size(hive->hpSize);
+	return sizeof(int) + sizeof(mt_state) + recordSize + hive->nSols * (recordSize + sizeof(int));
+}
+
+// Documented in header file
+void HIVE_save_state(const Hive *hive, void *buf){
+	int i;
+	int recordSize = Solution_record_size(hive->hpSize);
+	char *p = buf;
+
+	memcpy(p, &hive->cycle, sizeof(int));
+	p += sizeof(int);
+	memcpy(p, &hive->rng, sizeof(mt_state));
+	p += sizeof(mt_state);
+	Solution_write_record(hive->best, hive->hpSize, p);
+	p += recordSize;
+
+	// Each solution is a record followed by its idle iterations
+	for(i = 0; i < hive->nSols; i++){
+		int idle = Solution_idle_iterations(hive->sols[i]);
+		Solution_write_record(hive->sols[i], hive->hpSize, p);
+		memcpy(p + recordSize, &idle, sizeof(int));
+		p += recordSize + sizeof(int);
+	}
+}
+
+// Documented in header file
+void HIVE_load_state(Hive *hive, const void *buf){
+	int i;
+	int recordSize = Solution_record_size(hive->hpSize);
+	const char *p = buf;
+
+	memcpy(&hive->cycle, p, sizeof(int));
+	p += sizeof(int);
+	memcpy(&hive->rng, p, sizeof(mt_state));
+	p += sizeof(mt_state);
+	HIVE_replace_best(hive, Solution_read_record(hive->slab, p, hive->hpSize));
+	p += recordSize;
+
+	for(i = 0; i < hive->nSols; i++){
+		int idle;
+		Solution sol = Solution_read_record(hive->slab, p, hive->hpSize);
+		memcpy(&idle, p + recordSize, sizeof(int));
+		Solution_set_idle_iterations(&sol, idle);
+		HIVE_force_replace_solution(hive, sol, i);
+		p += recordSize + sizeof(int);
+	}
 }
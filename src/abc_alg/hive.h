@@ -1,51 +1,81 @@
 #ifndef _HIVE_H_
 #define _HIVE_H_
 
-/** \file hive.h Routines for manipulating the bee hive global object. */
+/** \file hive.h Routines for manipulating bee hive objects. */
 
 #include <solution/solution.h>
 
-/** Initializes the global HIVE object. */
-void HIVE_initialize();
+#include "abc_alg.h"
 
-/** Frees memory allocated in HIVE.
- * Does not free the best solution */
-void HIVE_destroy();
+/** A hive that develops a number of solutions using a number of bees.
+ * A hive is used by one thread at a time, so different threads may run different hives.
+ */
+typedef struct HIVE_ Hive;
+
+/** Creates a slab with room for the movement chains of a hive for proteins with up to 'hpSize' beads. */
+ChainSlab *HIVE_create_slab(int hpSize);
+
+/** Creates a hive for a protein with 'hpSize' beads, whose solutions are evaluated with 'fit'.
+ * Movement chains are allocated from 'slab', made by HIVE_create_slab, which the hive uses alone
+ *   until it is destroyed.
+ * The random stream of the hive is seeded as stream 'hiveId' of 'baseSeed' (see random_seed_stream_from).
+ * The fitness of the initial solutions is calculated, and from then on, all solutions held by
+ *   the hive are evaluated. 'fit' and 'slab' must outlive the hive.
+ */
+Hive *HIVE_create(FitnessCalc *fit, ChainSlab *slab, int hpSize, uint32_t baseSeed, int hiveId);
+
+/** Frees the hive and all memory allocated in it, giving all its chains back to its slab, which
+ *   may then be used by another hive.
+ * Does not free the best solution, which is moved to the heap and returned, so it outlives the
+ *   hive and must be freed with Solution_free(NULL, ...).
+ */
+Solution HIVE_destroy(Hive *hive);
 
 /** Returns the number of solutions in the hive. */
-int HIVE_nSols();
+int HIVE_nSols(const Hive *hive);
 
 /** Returns the number of cycles elapsed within the hive. */
-int HIVE_cycle();
+int HIVE_cycle(const Hive *hive);
 
 /** Returns the vector of solutions within the hive. */
-Solution *HIVE_solutions();
+Solution *HIVE_solutions(Hive *hive);
 
 /** Returns a specific solution. */
-Solution HIVE_solution(int idx);
+Solution HIVE_solution(const Hive *hive, int idx);
 
 /** Returns a pointer to the best solution found so far in the hive. */
-Solution HIVE_best_sol();
+Solution HIVE_best_sol(const Hive *hive);
 
 /** Returns the size of the protein being predicted. */
-int HIVE_hp_size();
+int HIVE_hp_size(const Hive *hive);
+
+/** Returns the random stream of the hive. */
+mt_state *HIVE_rng(Hive *hive);
+
+/** Returns the slab from which solutions held by the hive must be allocated, and with which
+ *   solutions taken out of it must be freed.
+ */
+ChainSlab *HIVE_slab(Hive *hive);
+
+/** Returns the calculator with which the hive evaluates solutions. */
+FitnessCalc *HIVE_fitness(Hive *hive);
 
 /** Nullifies the best solution, without freeing it. */
-void HIVE_nullify_best();
+void HIVE_nullify_best(Hive *hive);
 
-/** Tells the HIVE to increment one cycle in the cycle counter */
-void HIVE_increment_cycle();
+/** Tells the hive to increment one cycle in the cycle counter */
+void HIVE_increment_cycle(Hive *hive);
 
-/** Adds solution 'sol' as the index-th solution of the HIVE.
+/** Adds solution 'sol' as the index-th solution of the hive.
  * No deep copy is made.
  *
- * Also checks the fitness of 'sol' and replaces the best solution in the HIVE if needed
+ * Also checks the fitness of 'sol' and replaces the best solution in the hive if needed
  * This procedure does not free the current solution in that spot.
  */
-void HIVE_add_solution(Solution sol, int index, int hpSize);
+void HIVE_add_solution(Hive *hive, Solution sol, int index, int hpSize);
 
 /** Increments the idle_iterations of the solution desired. */
-void HIVE_increment_idle(int index);
+void HIVE_increment_idle(Hive *hive, int index);
 
 /** Causes a minor variation in the solution at given index.
  *
@@ -53,24 +83,62 @@ void HIVE_increment_idle(int index);
  *   spot SPOT in the Solutions' movement chain.
  * SOL1's movement at spot SPOT is made to approach the value in SOL2's movement
  *   at the same spot.
+ * All random numbers are drawn from random stream 'rng', and the new solution is allocated
+ *   from the slab of the hive.
  */
-Solution HIVE_perturb_solution(int index, int hpSize);
+Solution HIVE_perturb_solution(Hive *hive, int index, int hpSize, mt_state *rng);
 
 /** The current Solution with index 'index' is SOL1.
  * Checks if 'alt' has a better fitness, and if that is so, replaces SOL1 with 'alt'.
  * If 'alt' is worse, this function frees it, so manipulating 'alt' later is unsafe, and the idle interations of SOL1 is increased.
  * Checks if 'alt' is the new best solution of the hive.
+ *
+ * If the fitness of 'alt' is not yet calculated, 'alt' is expected to have been made by
+ *   HIVE_perturb_solution from SOL1, so that its fitness can be calculated incrementally.
  */
-void HIVE_try_replace_solution(Solution alt, int index, int hpSize);
+void HIVE_try_replace_solution(Hive *hive, Solution alt, int index, int hpSize);
 
 /** Replaces solution at index 'index', unconditionally.
  * Does not check if 'alt' is the new best solution of the hive.
+ * The fitness of 'alt' must have already been calculated.
  */
-void HIVE_force_replace_solution(Solution alt, int index);
+void HIVE_force_replace_solution(Hive *hive, Solution alt, int index);
+
+/** Stores in 'indexes' the indexes of the solutions replaced, by HIVE_try_replace_solution or
+ *   HIVE_force_replace_solution, since the last call or since the hive was created, and returns
+ *   how many there are. Each index is stored once. 'indexes' must have room for HIVE_nSols indexes.
+ */
+int HIVE_take_replaced(Hive *hive, int *indexes);
 
 /** Replaces the best solution with the given solution.
  * A deep copy is not made, so modifying 'newBest' after calling this function is unsafe.
+ * The fitness of 'newBest' must have already been calculated.
+ */
+void HIVE_replace_best(Hive *hive, Solution newBest);
+
+/** Returns the size of the state of the hive, as written by HIVE_save_state. */
+int HIVE_state_size(const Hive *hive);
+
+/** Writes in 'buf' the state of the hive: its cycle counter, its random stream, its best
+ *   solution, and its solutions with their fitnesses and idle iterations.
+ * The state is plain bytes, meant to be restored by the same build on the same kind of machine.
+ */
+void HIVE_save_state(const Hive *hive, void *buf);
+
+/** Restores the state written by HIVE_save_state from 'buf' into the hive, which must be for the
+ *   same protein and colony. The hive then continues exactly as the saved one would have.
+ */
+void HIVE_load_state(Hive *hive, const void *buf);
+
+/** Creates the hive of 'ctx' for a prediction, seeded as stream 'hiveId', and the fitness
+ *   calculator and slab of 'ctx' if they were not made yet.
+ * Threaded fitness backends take the number of threads in effect when the calculator is made.
+ */
+void PredictionContext_start(PredictionContext *ctx, int hiveId);
+
+/** Frees the hive of 'ctx', and returns its best solution, moved to the heap (see HIVE_destroy).
+ * The calculator and the slab are kept for the next prediction.
  */
-void HIVE_replace_best(Solution newBest);
+Solution PredictionContext_finish(PredictionContext *ctx);
 
 #endif
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+#ifdef BATCH_MPI
+	#include <mpi/mpi.h>
+#endif
+
+#include "chaininghp.h"
+#include "abc_alg/abc_alg.h"
+#include "config.h"
+#include "random.h"
+#include "heap.h"
+
+/** \file batch.c Batch runner, which folds many proteins in a single process, or in a single
+ *   process per MPI node, and writes all results to one CSV file.
+ *
+ * Usage: ./sqbatch jobs.txt [results.csv]
+ *        mpirun -np N ./mbatch jobs.txt [results.csv]
+ *
+ * Each line of the job file is a job, of the form:
+ *
+ *   SEQUENCE SEED CYCLES
+ *
+ * If SEED is negative, the job takes the seed of the configuration (RANDOM_SEED). If CYCLES is
+ *   not positive, the job takes N_CYCLES. Blank lines and lines starting with '#' are skipped.
+ * Everything else (energies, colony, ...) comes from configuration.yml, as in the other executables,
+ *   except N_HIVES: each job runs a single hive, as jobs already keep all cores busy.
+ *
+ * Jobs run on a team of threads, each thread with its own PredictionContext, which keeps its fitness
+ *   calculator while predicting the same protein, and its slab of chains while proteins get shorter.
+ * So jobs are sorted from the longest protein to the shortest, with the jobs of each protein
+ *   together, and handed out in that order. In mbatch, the sorted jobs are dealt to the nodes in
+ *   contiguous chunks, and the results are collected in node 0.
+ *
+ * The CSV has one line per job, in the order of the job file, with columns:
+ *   job,sequence,seed,cycles,fitness,hcontacts,collisions,bbgyration,seconds,chain
+ * where 'job' counts jobs from 0, 'seed' is the seed actually used, and 'chain' is the movement
+ *   chain of the structure found, with 2 hexadecimal digits per movement.
+ */
+
+/** A job of the job file. */
+typedef struct BatchJob_ {
+	HPElem *chaininghp;
+	int hpSize;
+	int seed;
+	int nCycles;
+	long chainOffset; /**< Where the movement chain of the job lies among the chains of all jobs */
+} BatchJob;
+
+/** Results of all jobs, as arrays indexed by job, so that they can be reduced among nodes. */
+typedef struct BatchResults_ {
+	double *fitness;
+	double *bbGyration;
+	double *seconds;
+	int *contactsH;
+	int *collisions;
+	unsigned int *seeds;
+	shiftmel *chains; /**< Movement chains of all jobs, one after the other */
+} BatchResults;
+
+/* Prints the message, formatted as by printf, and stops all nodes. */
+static
+void fail(const char *fmt, ...){
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#ifdef BATCH_MPI
+	MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+	exit(EXIT_FAILURE);
+}
+
+/* Returns the contents of file 'path', read by node 0 and sent to all others. */
+static
+char *read_job_file(const char *path){
+	long size = 0;
+	char *text = NULL;
+	int myRank = 0;
+
+#ifdef BATCH_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
+#endif
+
+	if(myRank == 0){
+		FILE *fp = fopen(path, "r");
+		if(!fp)
+			fail("Could not open the job file.\n");
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		text = heap_alloc(size + 1);
+		size = fread(text, 1, size, fp);
+		fclose(fp);
+	}
+
+#ifdef BATCH_MPI
+	MPI_Bcast(&size, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	if(myRank != 0)
+		text = heap_alloc(size + 1);
+	MPI_Bcast(text, size, MPI_CHAR, 0, MPI_COMM_WORLD);
+#endif
+
+	text[size] = '\0';
+	return text;
+}
+
+/* Parses the jobs in 'text', returning them and their number in 'nJobs_p'. */
+static
+BatchJob *parse_jobs(char *text, int *nJobs_p){
+	int nJobs = 0, capacity = 16, lineNo = 0;
+	long chainOffset = 0;
+	BatchJob *jobs = heap_alloc(sizeof(BatchJob) * capacity);
+	char *saveptr;
+	char *line;
+
+	for(line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)){
+		lineNo++;
+		char *first = line + strspn(line, " \t\r");
+		if(*first == '\0' || *first == '#')
+			continue;
+
+		BatchJob job;
+		if(sscanf(first, "%ms %d %d", &job.chaininghp, &job.seed, &job.nCycles) != 3)
+			fail("Line %d of the job file is not of the form: SEQUENCE SEED CYCLES\n", lineNo);
+
+		job.hpSize = strlen(job.chaininghp);
+		if(job.hpSize < 2 || chaininghp_validate(job.chaininghp) != 0)
+			fail("Invalid HP chain in line %d of the job file.\n"
+			     "Chains must have at least 2 beads, consist only of 'H' and 'P', and have at least 1 'H'.\n", lineNo);
+
+		if(job.nCycles <= 0)
+			job.nCycles = N_CYCLES;
+		job.chainOffset = chainOffset;
+		chainOffset += job.hpSize - 1;
+
+		if(nJobs == capacity){
+			capacity *= 2;
+			BatchJob *grown = heap_alloc(sizeof(BatchJob) * capacity);
+			memcpy(grown, jobs, sizeof(BatchJob) * nJobs);
+			free(jobs);
+			jobs = grown;
+		}
+		jobs[nJobs++] = job;
+	}
+
+	*nJobs_p = nJobs;
+	return jobs;
+}
+
+/* Jobs on which the comparison of job indexes is made */
+static const BatchJob *SORTED_JOBS;
+
+/* Orders job indexes from the longest protein to the shortest, with jobs of the same protein together,
+ *   and otherwise in the order of the job file.
+ */
+static
+int cmp_jobs(const void *a, const void *b){
+	const BatchJob *x = &SORTED_JOBS[*(const int *) a];
+	const BatchJob *y = &SORTED_JOBS[*(const int *) b];
+
+	if(x->hpSize != y->hpSize)
+		return y->hpSize - x->hpSize;
+	int cmp = strcmp(x->chaininghp, y->chaininghp);
+	if(cmp != 0)
+		return cmp;
+	return *(const int *) a - *(const int *) b;
+}
+
+/* Returns the number of seconds elapsed since some fixed moment. */
+static
+double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / (double) 1E9;
+}
+
+/* Runs the 'nMine' jobs whose indexes are in 'mine', on a team of threads, storing their results. */
+static
+void run_jobs(const BatchJob *jobs, const int *mine, int nMine, BatchResults *res){
+	#pragma omp parallel
+	{
+		EnergyParams energy = configuration_energy();
+		PredictionContext *ctx = NULL;
+		int i;
+
+		#pragma omp for schedule(dynamic, 1)
+		for(i = 0; i < nMine; i++){
+			const BatchJob *job = &jobs[mine[i]];
+			double begin = now();
+
+			if(ctx)
+				PredictionContext_retarget(ctx, job->chaininghp, job->hpSize);
+			else
+				ctx = PredictionContext_create(job->chaininghp, job->hpSize, &energy);
+			ctx->seed = job->seed >= 0 ? (uint32_t) job->seed : random_base_seed();
+
+			PredResults results;
+			Solution sol = ABC_predict_structure(ctx, job->nCycles, &results);
+
+			int k = mine[i];
+			res->fitness[k] = results.fitness;
+			res->bbGyration[k] = results.bbGyration;
+			res->contactsH[k] = results.contactsH;
+			res->collisions[k] = results.collisions;
+			res->seeds[k] = ctx->seed;
+			memcpy(res->chains + job->chainOffset, Solution_chain(sol), job->hpSize - 1);
+			Solution_free(NULL, sol);
+
+			res->seconds[k] = now() - begin;
+		}
+
+		if(ctx)
+			PredictionContext_destroy(ctx);
+	}
+}
+
+/* Writes the results of all jobs as CSV to 'fp'. */
+static
+void write_results(FILE *fp, const BatchJob *jobs, int nJobs, const BatchResults *res){
+	int i, j;
+	fprintf(fp, "job,sequence,seed,cycles,fitness,hcontacts,collisions,bbgyration,seconds,chain\n");
+
+	for(i = 0; i < nJobs; i++){
+		const BatchJob *job = &jobs[i];
+		fprintf(fp, "%d,%s,%u,%d,%lf,%d,%d,%lf,%lf,", i, job->chaininghp, res->seeds[i], job->nCycles,
+				res->fitness[i], res->contactsH[i], res->collisions[i], res->bbGyration[i], res->seconds[i]);
+		for(j = 0; j < job->hpSize - 1; j++)
+			fprintf(fp, "%02x", res->chains[job->chainOffset + j]);
+		fprintf(fp, "\n");
+	}
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2 || argc > 3){
+		fprintf(stderr, "Usage: %s [job file] [output file]\n", argv[0]);
+		return 1;
+	}
+
+	int i, nJobs, myRank = 0, commSize = 1;
+#ifdef BATCH_MPI
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
+	MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+#endif
+
+	initialize_configuration();
+	N_HIVES = 1;
+
+	// Jobs with no seed of their own must agree on it, even if it was chosen randomly
+	random_initialize(RANDOM_SEED);
+#ifdef BATCH_MPI
+	uint32_t seed = random_base_seed();
+	MPI_Bcast(&seed, 1, MPI_UINT32_T, 0, MPI_COMM_WORLD);
+	random_set_base_seed(seed);
+#endif
+
+	char *text = read_job_file(argv[1]);
+	BatchJob *jobs = parse_jobs(text, &nJobs);
+	free(text);
+
+	long totalChain = nJobs > 0 ? jobs[nJobs - 1].chainOffset + jobs[nJobs - 1].hpSize - 1 : 0;
+	BatchResults res;
+	res.fitness = heap_calloc(nJobs + 1, sizeof(double));
+	res.bbGyration = heap_calloc(nJobs + 1, sizeof(double));
+	res.seconds = heap_calloc(nJobs + 1, sizeof(double));
+	res.contactsH = heap_calloc(nJobs + 1, sizeof(int));
+	res.collisions = heap_calloc(nJobs + 1, sizeof(int));
+	res.seeds = heap_calloc(nJobs + 1, sizeof(unsigned int));
+	res.chains = heap_calloc(totalChain + 1, sizeof(shiftmel));
+
+	int *order = heap_alloc(sizeof(int) * (nJobs + 1));
+	for(i = 0; i < nJobs; i++)
+		order[i] = i;
+	SORTED_JOBS = jobs;
+	qsort(order, nJobs, sizeof(int), cmp_jobs);
+
+	// A few chunks per node, so that nodes stay balanced while each still gets runs of similar jobs
+	int chunk = nJobs / (4 * commSize);
+	if(chunk < 1) chunk = 1;
+	int nMine = 0;
+	for(i = 0; i < nJobs; i++)
+		if((i / chunk) % commSize == myRank)
+			order[nMine++] = order[i];
+
+	double begin = now();
+	run_jobs(jobs, order, nMine, &res);
+
+#ifdef BATCH_MPI
+	// Each job was run by one node, and the others left zeros in its place
+	void *sendFitness = myRank == 0 ? MPI_IN_PLACE : res.fitness;
+	void *sendGyration = myRank == 0 ? MPI_IN_PLACE : res.bbGyration;
+	void *sendSeconds = myRank == 0 ? MPI_IN_PLACE : res.seconds;
+	void *sendContacts = myRank == 0 ? MPI_IN_PLACE : res.contactsH;
+	void *sendCollisions = myRank == 0 ? MPI_IN_PLACE : res.collisions;
+	void *sendSeeds = myRank == 0 ? MPI_IN_PLACE : res.seeds;
+	void *sendChains = myRank == 0 ? MPI_IN_PLACE : res.chains;
+	MPI_Reduce(sendFitness, res.fitness, nJobs, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendGyration, res.bbGyration, nJobs, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendSeconds, res.seconds, nJobs, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendContacts, res.contactsH, nJobs, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendCollisions, res.collisions, nJobs, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendSeeds, res.seeds, nJobs, MPI_UNSIGNED, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(sendChains, res.chains, totalChain, MPI_BYTE, MPI_BOR, 0, MPI_COMM_WORLD);
+#endif
+
+	if(myRank == 0){
+		FILE *fp = argc > 2 ? fopen(argv[2], "w") : stdout;
+		if(!fp)
+			fail("Could not open the output file.\n");
+		write_results(fp, jobs, nJobs, &res);
+		if(fp != stdout)
+			fclose(fp);
+		fprintf(stderr, "%d jobs in %lf seconds.\n", nJobs, now() - begin);
+	}
+
+	for(i = 0; i < nJobs; i++)
+		free(jobs[i].chaininghp);
+	free(jobs);
+	free(order);
+	free(res.fitness);
+	free(res.bbGyration);
+	free(res.seconds);
+	free(res.contactsH);
+	free(res.collisions);
+	free(res.seeds);
+	free(res.chains);
+
+#ifdef BATCH_MPI
+	MPI_Finalize();
+#endif
+	return 0;
+}
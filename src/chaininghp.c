@@ -18,3 +18,36 @@ HPElem *chaininghp_read(FILE *fp){
 
 	return chain;
 }
+
+// Documented in header file
+char chaininghp_validate(const HPElem *chaininghp){
+	int i;
+	char bad = 1;
+
+	// Verify existence of at least 1 hydrophobic bead
+	for(i = 0; chaininghp[i] != '\0'; i++){
+		if(chaininghp[i] == 'H')
+			bad = 0;
+	}
+	if(bad){
+		// No H beads in the string.
+		return 1;
+	}
+
+	// Verify if all characters are either H or P
+	int nH = 0;
+	int nP = 0;
+	int n  = 0;
+	for(i = 0; chaininghp[i] != '\0'; i++){
+		n++;
+		if(chaininghp[i] == 'H') nH++;
+		if(chaininghp[i] == 'P') nP++;
+	}
+	if(nH + nP == n){
+		// Success
+		return 0;
+	} else {
+		// Weird characters in the string.
+		return 2;
+	}
+}
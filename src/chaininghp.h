@@ -15,5 +15,10 @@ typedef char HPElem;
  */
 HPElem * chaininghp_read(FILE *fp);
 
+/** Checks that 'chaininghp' is made only of 'H' and 'P' characters, with at least one 'H'.
+ * Returns 0 if it is, 1 if it has no 'H', and 2 if it has other characters.
+ */
+char chaininghp_validate(const HPElem *chaininghp);
+
 #endif // chaininghp_H
 
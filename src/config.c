@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
 
 #include "config.h"
 
@@ -18,16 +20,30 @@ double FORAGER_RATIO = 0.5;
 int IDLE_LIMIT = 100;
 
 int N_HIVES = 1;
+int MIGRATION_INTERVAL = 0;
+int N_EMIGRANTS = 2;
+int MIGRATION_TOPOLOGY = 0;
+int BEST_SYNC_INTERVAL = 10;
+double TARGET_FITNESS = INFINITY;
+int STAGNATION_WINDOW = 0;
+
+int MPI_DYNAMIC_SCHEDULING = 0;
+int MPI_REQUESTS_IN_FLIGHT = 2;
+int THREADS_PER_RANK = 0;
+
+int CHECKPOINT_INTERVAL = 0;
+char *CHECKPOINT_FILE = (char *) "checkpoint.bin";
 
 int RANDOM_SEED = -1;
 
 
 static const char filename[] = "configuration.yml";
 
-void initialize_configuration(){
-	FILE *fp = fopen(filename, "r");
-	if(!fp) return;
-
+/* Reads all configuration variables from 'fp', in the order of configuration.yml.
+ * Returns whether all of them were read.
+ */
+static
+bool read_configuration(FILE *fp){
 	int errSum = 0;
 	errSum += fscanf(fp, " HP_CHAIN: %ms", &HP_CHAIN);
 	errSum += fscanf(fp, " EPSILON_HYDROPHOBIC_HYDROPHOBIC: %d", &EPS_HH);
@@ -42,9 +58,27 @@ void initialize_configuration(){
 	errSum += fscanf(fp, " FORAGER_RATIO: %lf", &FORAGER_RATIO);
 	errSum += fscanf(fp, " IDLE_LIMIT: %d", &IDLE_LIMIT);
 	errSum += fscanf(fp, " N_HIVES: %d", &N_HIVES);
+	errSum += fscanf(fp, " MIGRATION_INTERVAL: %d", &MIGRATION_INTERVAL);
+	errSum += fscanf(fp, " N_EMIGRANTS: %d", &N_EMIGRANTS);
+	errSum += fscanf(fp, " MIGRATION_TOPOLOGY: %d", &MIGRATION_TOPOLOGY);
+	errSum += fscanf(fp, " BEST_SYNC_INTERVAL: %d", &BEST_SYNC_INTERVAL);
+	errSum += fscanf(fp, " TARGET_FITNESS: %lf", &TARGET_FITNESS);
+	errSum += fscanf(fp, " STAGNATION_WINDOW: %d", &STAGNATION_WINDOW);
+	errSum += fscanf(fp, " MPI_DYNAMIC_SCHEDULING: %d", &MPI_DYNAMIC_SCHEDULING);
+	errSum += fscanf(fp, " MPI_REQUESTS_IN_FLIGHT: %d", &MPI_REQUESTS_IN_FLIGHT);
+	errSum += fscanf(fp, " THREADS_PER_RANK: %d", &THREADS_PER_RANK);
+	errSum += fscanf(fp, " CHECKPOINT_INTERVAL: %d", &CHECKPOINT_INTERVAL);
+	errSum += fscanf(fp, " CHECKPOINT_FILE: %ms", &CHECKPOINT_FILE);
 	errSum += fscanf(fp, " RANDOM_SEED: %d", &RANDOM_SEED);
 
-	if(errSum != 14){
+	return errSum == 25;
+}
+
+void initialize_configuration(){
+	FILE *fp = fopen(filename, "r");
+	if(!fp) return;
+
+	if(!read_configuration(fp)){
 		fprintf(stderr, "Something went wrong while reading the configuration file '%s'.\n"
 				"Make the file is in the correct format.\n", filename);
 		exit(EXIT_FAILURE);
@@ -52,3 +86,17 @@ void initialize_configuration(){
 
 	fclose(fp);
 }
+
+bool configuration_load(const char *path){
+	FILE *fp = fopen(path, "r");
+	if(!fp) return false;
+
+	bool ok = read_configuration(fp);
+	fclose(fp);
+	return ok;
+}
+
+EnergyParams configuration_energy(){
+	EnergyParams energy = {EPS_HH, EPS_HP, EPS_HB, EPS_PP, EPS_PB, EPS_BB, PENALTY_VALUE};
+	return energy;
+}
@@ -1,6 +1,8 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stdbool.h>
+
 /** \file config.h Routines for manipulating the configuration YML file. */
 
 /** @{ */
@@ -18,10 +20,36 @@ extern int COLONY_SIZE;
 extern double FORAGER_RATIO;
 extern int IDLE_LIMIT;
 extern int N_HIVES;
+extern int MIGRATION_INTERVAL;
+extern int N_EMIGRANTS;
+extern int MIGRATION_TOPOLOGY;
+extern int BEST_SYNC_INTERVAL;
+extern double TARGET_FITNESS;
+extern int STAGNATION_WINDOW;
+extern int MPI_DYNAMIC_SCHEDULING;
+extern int MPI_REQUESTS_IN_FLIGHT;
+extern int THREADS_PER_RANK;
+extern int CHECKPOINT_INTERVAL;
+extern char *CHECKPOINT_FILE;
 extern int RANDOM_SEED;
 /** @} */
 
+/** Energy of each kind of contact between beads, and penalty for each collision. */
+typedef struct EnergyParams_ {
+	int hh, hp, hb, pp, pb, bb;
+	int penalty;
+} EnergyParams;
+
 /** Initializes configuration based on the configuration file. */
 void initialize_configuration();
 
+/** Same as initialize_configuration, but from the file at 'path'.
+ * Instead of exiting, returns false if the file could not be opened or is not in the correct format,
+ *   in which case some variables may have been read already.
+ */
+bool configuration_load(const char *path);
+
+/** Returns the energy parameters of the configuration (EPS_* and PENALTY_VALUE). */
+EnergyParams configuration_energy();
+
 #endif // CONFIG_H
@@ -0,0 +1,272 @@
+#include <mpi/mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <chaininghp.h>
+#include <fitness/fitness.h>
+#include <random.h>
+#include <config.h>
+#include <heap.h>
+#include <solution/solution_mpi.h>
+
+#include "elf_tree_comm.h"
+
+/** \file elf_bench.c Micro-benchmark of the collectives used by the hive masters.
+ *
+ * Times, for a block of candidates split among the nodes as the block evaluator does:
+ *
+ *   tree_scatter, tree_gather  ElfTreeComm_scatter / ElfTreeComm_gather
+ *   hier_scatter, hier_gather  ElfTreeHier_scatter / ElfTreeHier_gather (shared memory per machine)
+ *   mpi_scatter, mpi_gather    MPI_Scatter / MPI_Gather, with padded blocks like the tree
+ *   mpi_scatterv               MPI_Scatterv, with no padding
+ *   fitness_master             A whole Solution_calculate_fitness_master round trip
+ *
+ * Gathers move the same number of bytes as the scatters, so both directions can be compared.
+ * Every operation is swept over chain lengths from 20 to 5000 and over communicators of
+ *   2, 4, 8, ... nodes and of all nodes, and one CSV line is printed per combination.
+ * Latencies are those of the slowest node of each repetition, in microseconds.
+ *
+ * Usage: mpirun -np N [--oversubscribe] ./elfbench [repetitions] [candidates] [output.csv]
+ */
+
+/** Chain lengths swept */
+static const int CHAIN_LENGTHS[] = {20, 50, 100, 200, 500, 1000, 2000, 5000};
+#define N_CHAIN_LENGTHS (int) (sizeof(CHAIN_LENGTHS) / sizeof(CHAIN_LENGTHS[0]))
+
+/** Repetitions run before timing starts */
+#define WARMUP_REPS 3
+
+/** Parameters of one measurement */
+typedef struct BenchCase_ {
+	MPI_Comm comm;   /**< Nodes taking part */
+	int commSize;
+	int myRank;
+	int hpSize;      /**< Protein length */
+	int nCands;      /**< Number of candidates split among the nodes */
+	int blockSize;   /**< Candidates per node, rounded up */
+	int pieceBytes;  /**< Bytes per node, padded */
+	char *buf;       /**< Buffer large enough for all nodes */
+	ElfTreeHier *tree;
+} BenchCase;
+
+/* Sorts doubles in ascending order. */
+static
+int cmp_double(const void *a, const void *b){
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Returns the 'q'-quantile of the 'n' sorted values of 'v', by the nearest-rank method. */
+static
+double percentile(const double *v, int n, double q){
+	int idx = (int) ceil(q * n) - 1;
+	if(idx < 0) idx = 0;
+	if(idx >= n) idx = n - 1;
+	return v[idx];
+}
+
+/* Prints the statistics of 'times' (in seconds), which gets sorted. */
+static
+void print_stats(FILE *out, const char *method, const BenchCase *bc, double *times, int reps){
+	int i;
+	double sum = 0;
+	for(i = 0; i < reps; i++)
+		sum += times[i];
+	qsort(times, reps, sizeof(double), cmp_double);
+
+	fprintf(out, "%s,%d,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+			method, bc->commSize, bc->hpSize, bc->nCands, bc->pieceBytes, reps,
+			1e6 * times[0], 1e6 * percentile(times, reps, 0.5), 1e6 * percentile(times, reps, 0.9),
+			1e6 * percentile(times, reps, 0.99), 1e6 * times[reps - 1], 1e6 * sum / reps);
+	fflush(out);
+}
+
+enum { TREE_SCATTER, TREE_GATHER, HIER_SCATTER, HIER_GATHER, MPI_SCATTER, MPI_GATHER, MPI_SCATTERV, N_METHODS };
+static const char *METHOD_NAMES[] = {
+	"tree_scatter", "tree_gather", "hier_scatter", "hier_gather", "mpi_scatter", "mpi_gather", "mpi_scatterv"
+};
+
+/* Runs collective 'method' once. */
+static
+void run_collective(int method, BenchCase *bc, const int *counts, const int *displs){
+	bool isRoot = bc->myRank == 0;
+
+	switch(method){
+	case TREE_SCATTER:
+		ElfTreeComm_scatter(bc->buf, bc->pieceBytes, MPI_BYTE, bc->comm);
+		break;
+	case TREE_GATHER:
+		ElfTreeComm_gather(bc->buf, bc->pieceBytes, MPI_BYTE, bc->comm);
+		break;
+	case HIER_SCATTER:
+		ElfTreeHier_scatter(bc->tree, bc->pieceBytes);
+		break;
+	case HIER_GATHER:
+		ElfTreeHier_gather(bc->tree, bc->pieceBytes);
+		break;
+	case MPI_SCATTER:
+		MPI_Scatter(bc->buf, bc->pieceBytes, MPI_BYTE, isRoot ? MPI_IN_PLACE : bc->buf,
+				bc->pieceBytes, MPI_BYTE, 0, bc->comm);
+		break;
+	case MPI_GATHER:
+		MPI_Gather(isRoot ? MPI_IN_PLACE : bc->buf, bc->pieceBytes, MPI_BYTE, bc->buf,
+				bc->pieceBytes, MPI_BYTE, 0, bc->comm);
+		break;
+	case MPI_SCATTERV:
+		MPI_Scatterv(bc->buf, counts, displs, MPI_BYTE, isRoot ? MPI_IN_PLACE : bc->buf,
+				counts[bc->myRank], MPI_BYTE, 0, bc->comm);
+		break;
+	}
+}
+
+/* Times every collective for the given case, printing the results at node 0. */
+static
+void bench_collectives(BenchCase *bc, int reps, FILE *out){
+	int i, m;
+	int chainSize = bc->hpSize - 1;
+
+	// Scatterv sends each node only its real candidates
+	int counts[bc->commSize], displs[bc->commSize];
+	for(i = 0; i < bc->commSize; i++){
+		int first = i * bc->blockSize;
+		int n = bc->nCands - first;
+		n = n < 0 ? 0 : n > bc->blockSize ? bc->blockSize : n;
+		counts[i] = n * chainSize;
+		displs[i] = first * chainSize;
+	}
+
+	ElfTreeHier_reserve(bc->tree, bc->pieceBytes);
+	double times[reps];
+
+	for(m = 0; m < N_METHODS; m++){
+		for(i = -WARMUP_REPS; i < reps; i++){
+			MPI_Barrier(bc->comm);
+			double begin = MPI_Wtime();
+			run_collective(m, bc, counts, displs);
+			double elapsed = MPI_Wtime() - begin, slowest;
+
+			MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, bc->comm);
+			if(i >= 0) times[i] = slowest;
+		}
+
+		if(bc->myRank == 0)
+			print_stats(out, METHOD_NAMES[m], bc, times, reps);
+	}
+}
+
+/* Times the round trip of Solution_calculate_fitness_master over 'nCands' random solutions.
+ * Only node 0 times, as the others are serving inside Solution_calculate_fitness_slave.
+ */
+static
+void bench_fitness_master(BenchCase *bc, int reps, FILE *out){
+	int i;
+
+	// Every node evaluates the same random protein
+	HPElem *chaininghp = heap_alloc(bc->hpSize + 1);
+	mt_state rng;
+	random_seed_stream(&rng, bc->hpSize);
+	for(i = 0; i < bc->hpSize; i++)
+		chaininghp[i] = urandom_max_r(&rng, 2) ? 'H' : 'P';
+	chaininghp[bc->hpSize] = '\0';
+
+	EnergyParams energy = configuration_energy();
+	FitnessCalc *fit = FitnessCalc_create(chaininghp, bc->hpSize, &energy);
+
+	if(bc->myRank != 0){
+		Solution_calculate_fitness_slave(fit, bc->hpSize, NULL, bc->tree);
+	} else {
+		Solution *sols = heap_alloc(sizeof(Solution) * bc->nCands);
+		for(i = 0; i < bc->nCands; i++)
+			sols[i] = Solution_random(NULL, bc->hpSize, &rng);
+
+		double times[reps];
+		for(i = -WARMUP_REPS; i < reps; i++){
+			double begin = MPI_Wtime();
+			Solution_calculate_fitness_master(fit, sols, bc->nCands, bc->hpSize, bc->tree);
+			if(i >= 0) times[i] = MPI_Wtime() - begin;
+		}
+
+		Solution_calculate_fitness_master_kill_slaves(bc->hpSize, bc->comm);
+		print_stats(out, "fitness_master", bc, times, reps);
+
+		for(i = 0; i < bc->nCands; i++)
+			Solution_free(NULL, sols[i]);
+		free(sols);
+	}
+
+	FitnessCalc_destroy(fit);
+	free(chaininghp);
+}
+
+int main(int argc, char *argv[]){
+	MPI_Init(&argc, &argv);
+
+	initialize_configuration();
+	random_initialize(RANDOM_SEED);
+
+	int reps = argc > 1 ? atoi(argv[1]) : 50;
+	int nCands = argc > 2 ? atoi(argv[2]) : COLONY_SIZE * FORAGER_RATIO;
+	if(reps < 1) reps = 1;
+	if(nCands < 1) nCands = 1;
+
+	int worldRank, worldSize;
+	MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+	MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+
+	FILE *out = stdout;
+	if(worldRank == 0 && argc > 3){
+		out = fopen(argv[3], "w");
+		if(!out){
+			fprintf(stderr, "Could not open %s\n", argv[3]);
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+	}
+
+	if(worldRank == 0)
+		fprintf(out, "method,ranks,chain_length,candidates,bytes_per_rank,reps,min_us,p50_us,p90_us,p99_us,max_us,mean_us\n");
+
+	// Communicators of 2, 4, 8, ... nodes, and of all nodes
+	int commSize = worldSize < 2 ? worldSize : 2;
+	while(true){
+		BenchCase bc;
+		MPI_Comm_split(MPI_COMM_WORLD, worldRank < commSize ? 0 : MPI_UNDEFINED, worldRank, &bc.comm);
+
+		if(bc.comm != MPI_COMM_NULL){
+			int l;
+			bc.commSize = commSize;
+			MPI_Comm_rank(bc.comm, &bc.myRank);
+			bc.tree = ElfTreeHier_create(bc.comm);
+
+			for(l = 0; l < N_CHAIN_LENGTHS; l++){
+				bc.hpSize = CHAIN_LENGTHS[l];
+				bc.nCands = nCands;
+				bc.blockSize = (nCands + commSize - 1) / commSize;
+				bc.pieceBytes = bc.blockSize * (bc.hpSize - 1);
+
+				long bufBytes = (long) commSize * bc.pieceBytes;
+				bc.buf = heap_alloc(bufBytes);
+				memset(bc.buf, 0, bufBytes);
+
+				bench_collectives(&bc, reps, out);
+				bench_fitness_master(&bc, reps, out);
+
+				free(bc.buf);
+			}
+
+			ElfTreeHier_destroy(bc.tree);
+			MPI_Comm_free(&bc.comm);
+		}
+
+		MPI_Barrier(MPI_COMM_WORLD);
+		if(commSize == worldSize) break;
+		commSize = commSize * 2 < worldSize ? commSize * 2 : worldSize;
+	}
+
+	if(out != stdout)
+		fclose(out);
+
+	MPI_Finalize();
+	return 0;
+}
@@ -1,9 +1,66 @@
-
 #include <mpi/mpi.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void ElfTreeComm_scatter(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm){
-	int myRank, commSize;
+#include <heap.h>
+
+#include "elf_tree_comm.h"
+
+/** MPI tag of the messages of the tree */
+#define ELF_TREE_TAG 0
+
+/** Range of bytes [start, end) of the buffer of virtual rank 0, and the request transferring it. */
+typedef struct Segment_ {
+	long start;
+	long end;
+	MPI_Request req;
+} Segment;
+
+/* Number of consecutive virtual ranks, starting at 'vrank', whose pieces pass through 'vrank'.
+ * That is the lowest set bit of 'vrank', or for vrank 0 the lowest power of 2 >= commSize.
+ */
+static
+int subtree_span(int vrank, int commSize){
+	if(vrank != 0) return vrank & -vrank;
+
+	int span = 1;
+	while(span < commSize) span <<= 1;
+	return span;
+}
+
+/* Splits the bytes [start, end) at multiples of ELF_TREE_SEGMENT_BYTES, storing the segments in
+ *   descending order in 'segs' (if not NULL). Returns the number of segments.
+ * Both ends of a transfer split it the same way, as they use the same absolute offsets.
+ */
+static
+int split_segments(long start, long end, Segment *segs){
+	int n = 0;
+	while(end > start){
+		long segStart = ((end - 1) / ELF_TREE_SEGMENT_BYTES) * ELF_TREE_SEGMENT_BYTES;
+		if(segStart < start) segStart = start;
+		if(segs){
+			segs[n].start = segStart;
+			segs[n].end = end;
+		}
+		n++;
+		end = segStart;
+	}
+	return n;
+}
+
+/* Rotates the 'commSize' pieces of 'from' by 'shift' pieces into 'to', so that the piece of
+ *   rank r goes to position (r + shift) % commSize.
+ */
+static
+void rotate_pieces(char *to, const char *from, int shift, int commSize, long pieceBytes){
+	memcpy(to + shift * pieceBytes, from, (commSize - shift) * pieceBytes);
+	memcpy(to, from + (commSize - shift) * pieceBytes, shift * pieceBytes);
+}
+
+// Documented in header file
+void ElfTreeComm_scatter_root(void *buf, int sendCount, MPI_Datatype type, int root, MPI_Comm comm){
+	int i, k, myRank, commSize;
 	MPI_Comm_rank(comm, &myRank);
 	MPI_Comm_size(comm, &commSize);
 
@@ -11,41 +68,65 @@ void ElfTreeComm_scatter(void *buf, int sendCount, MPI_Datatype type, MPI_Comm c
 
 	int typeSize;
 	MPI_Type_size(type, &typeSize);
+	long pieceBytes = (long) sendCount * typeSize;
+
+	// Ranks are renumbered so that the root is virtual rank 0
+	int vrank = (myRank - root + commSize) % commSize;
+	int span = subtree_span(vrank, commSize);
+	int last = vrank + span < commSize ? vrank + span : commSize;
+
+	// The root lays pieces out in virtual rank order
+	char *data = buf;
+	if(vrank == 0 && root != 0){
+		data = heap_alloc(commSize * pieceBytes);
+		rotate_pieces(data, buf, commSize - root, commSize, pieceBytes);
+	}
 
-	// Find lowest power of 2 higher than or equal to commSize
-	int hipow2 = 1;
-	while(hipow2 < commSize) hipow2 <<= 1;
-
-	int control;
-	for(control = hipow2 / 2; control >= 1; control /= 2){
-		if( myRank % control != 0 ) continue;
-
-		int myDiv = myRank / control;
-		if(myDiv % 2 == 0){
-			// Send
-			int dest = myRank + control;
-			if(dest >= commSize) continue;
-
-			int farDest = dest + control;
-			if(farDest > commSize) farDest = commSize;
-
-			int dataCount = (farDest - dest) * sendCount;
-			MPI_Send( ((char*) buf) + control * sendCount * typeSize, dataCount, type, dest, 0, comm);
-		} else {
-			// Receive
-			int src = myRank - control;
-			
-			int farDest = myRank + control;
-			if(farDest > commSize) farDest = commSize;
-
-			int dataCount = (farDest - myRank) * sendCount;
-			MPI_Recv(buf, dataCount, type, src, 0, comm, MPI_STATUS_IGNORE);
+	// 'data' holds the pieces of virtual ranks [vrank, last), which start at absolute byte 'base'
+	long base = vrank * pieceBytes;
+	int nSegs = split_segments(base, last * pieceBytes, NULL);
+	Segment segs[nSegs];
+	split_segments(base, last * pieceBytes, segs);
+
+	if(vrank != 0){
+		int parent = (vrank - span + root) % commSize;
+		for(k = 0; k < nSegs; k++)
+			MPI_Irecv(data + (segs[k].start - base), segs[k].end - segs[k].start, MPI_BYTE, parent, ELF_TREE_TAG, comm, &segs[k].req);
+	}
+
+	/* The farthest children get the highest pieces, which arrive first, so each segment is
+	 *   forwarded as soon as it is received. That pipelines large payloads down the tree.
+	 */
+	int nSends = 0;
+	MPI_Request sends[nSegs * 2 + 32];
+
+	for(k = 0; k < nSegs; k++){
+		if(vrank != 0)
+			MPI_Wait(&segs[k].req, MPI_STATUS_IGNORE);
+
+		int child;
+		for(i = span / 2; i >= 1; i /= 2){
+			child = vrank + i;
+			if(child >= commSize) continue;
+
+			int childLast = child + i < commSize ? child + i : commSize;
+			long start = segs[k].start > child * pieceBytes ? segs[k].start : child * pieceBytes;
+			long end = segs[k].end < childLast * pieceBytes ? segs[k].end : childLast * pieceBytes;
+			if(start >= end) continue;
+
+			MPI_Isend(data + (start - base), end - start, MPI_BYTE, (child + root) % commSize, ELF_TREE_TAG, comm, &sends[nSends++]);
 		}
 	}
+
+	MPI_Waitall(nSends, sends, MPI_STATUSES_IGNORE);
+
+	if(data != buf)
+		free(data);
 }
 
-void ElfTreeComm_gather(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm){
-	int myRank, commSize;
+// Documented in header file
+void ElfTreeComm_gather_root(void *buf, int sendCount, MPI_Datatype type, int root, MPI_Comm comm){
+	int i, k, myRank, commSize;
 	MPI_Comm_rank(comm, &myRank);
 	MPI_Comm_size(comm, &commSize);
 
@@ -53,121 +134,231 @@ void ElfTreeComm_gather(void *buf, int sendCount, MPI_Datatype type, MPI_Comm co
 
 	int typeSize;
 	MPI_Type_size(type, &typeSize);
+	long pieceBytes = (long) sendCount * typeSize;
+
+	int vrank = (myRank - root + commSize) % commSize;
+	int span = subtree_span(vrank, commSize);
+	int last = vrank + span < commSize ? vrank + span : commSize;
+
+	// The root receives pieces in virtual rank order, starting with its own
+	char *data = buf;
+	if(vrank == 0 && root != 0){
+		data = heap_alloc(commSize * pieceBytes);
+		memcpy(data, (char *) buf + root * pieceBytes, pieceBytes);
+	}
+
+	long base = vrank * pieceBytes;
+
+	// Post the receipt of the pieces of all children
+	int nRecvs = 0;
+	for(i = span / 2; i >= 1; i /= 2){
+		int child = vrank + i;
+		if(child >= commSize) continue;
+		int childLast = child + i < commSize ? child + i : commSize;
+		nRecvs += split_segments(child * pieceBytes, childLast * pieceBytes, NULL);
+	}
 
-	// Find lowest power of 2 higher than or equal to commSize
-	int hipow2 = 1;
-	while(hipow2 < commSize) hipow2 <<= 1;
-
-	int control;
-	for(control = 1; control < hipow2; control *= 2){
-		if( myRank % control != 0 ) continue;
-
-		int myDiv = myRank / control;
-		if(myDiv % 2 == 0){
-			// Receive
-			int src = myRank + control;
-			if(src >= commSize) continue;
-
-			int farDest = src + control;
-			if(farDest > commSize) farDest = commSize;
-
-			int dataCount = (farDest - src) * sendCount;
-			MPI_Recv( ((char*) buf) + control * sendCount * typeSize, dataCount, type, src, 0, comm, MPI_STATUS_IGNORE);
-		} else {
-			// Send
-			int dest = myRank - control;
-			
-			int farDest = myRank + control;
-			if(farDest > commSize) farDest = commSize;
-
-			int dataCount = (farDest - myRank) * sendCount;
-			MPI_Send(buf, dataCount, type, dest, 0, comm);
+	Segment recvs[nRecvs > 0 ? nRecvs : 1];
+	nRecvs = 0;
+	for(i = span / 2; i >= 1; i /= 2){
+		int child = vrank + i;
+		if(child >= commSize) continue;
+		int childLast = child + i < commSize ? child + i : commSize;
+
+		int first = nRecvs;
+		nRecvs += split_segments(child * pieceBytes, childLast * pieceBytes, recvs + nRecvs);
+		for(k = first; k < nRecvs; k++)
+			MPI_Irecv(data + (recvs[k].start - base), recvs[k].end - recvs[k].start, MPI_BYTE, (child + root) % commSize, ELF_TREE_TAG, comm, &recvs[k].req);
+	}
+
+	if(vrank == 0){
+		MPI_Request reqs[nRecvs > 0 ? nRecvs : 1];
+		for(k = 0; k < nRecvs; k++)
+			reqs[k] = recvs[k].req;
+		MPI_Waitall(nRecvs, reqs, MPI_STATUSES_IGNORE);
+	} else {
+		// Send each segment up as soon as the pieces it covers arrived
+		int parent = (vrank - span + root) % commSize;
+		int nSegs = split_segments(base, last * pieceBytes, NULL);
+		Segment segs[nSegs];
+		split_segments(base, last * pieceBytes, segs);
+
+		for(k = 0; k < nSegs; k++){
+			for(i = 0; i < nRecvs; i++)
+				if(recvs[i].start < segs[k].end && recvs[i].end > segs[k].start)
+					MPI_Wait(&recvs[i].req, MPI_STATUS_IGNORE);
+
+			MPI_Isend(data + (segs[k].start - base), segs[k].end - segs[k].start, MPI_BYTE, parent, ELF_TREE_TAG, comm, &segs[k].req);
 		}
+
+		MPI_Request reqs[nSegs];
+		for(k = 0; k < nSegs; k++)
+			reqs[k] = segs[k].req;
+		MPI_Waitall(nSegs, reqs, MPI_STATUSES_IGNORE);
+	}
+
+	if(data != buf){
+		rotate_pieces(buf, data, root, commSize, pieceBytes);
+		free(data);
 	}
 }
 
+// Documented in header file
+void ElfTreeComm_scatter(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm){
+	ElfTreeComm_scatter_root(buf, sendCount, type, 0, comm);
+}
 
-/* DEBUG PROCEDURES
+// Documented in header file
+void ElfTreeComm_gather(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm){
+	ElfTreeComm_gather_root(buf, sendCount, type, 0, comm);
+}
 
-#include <unistd.h>
-#include <string.h>
+// Documented in header file
+MPI_Comm ElfTreeComm_machine_comm(MPI_Comm comm){
+	int myRank, worldRank;
+	MPI_Comm_rank(comm, &myRank);
+	MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
 
-#define STR_SIZE 15
+	MPI_Comm machineComm;
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, myRank, MPI_INFO_NULL, &machineComm);
 
-int main(int argc, char *argv[]){
-	MPI_Init(&argc, &argv);
+	const char *fake = getenv("ABC_RANKS_PER_MACHINE");
+	if(fake && atoi(fake) > 0){
+		MPI_Comm fakeComm;
+		MPI_Comm_split(machineComm, worldRank / atoi(fake), myRank, &fakeComm);
+		MPI_Comm_free(&machineComm);
+		machineComm = fakeComm;
+	}
 
-	int myRank, commSize;
-	MPI_Comm_rank(MPI_COMM_WORLD, &myRank);
-	MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+	return machineComm;
+}
 
-	// We will be scattering strings of size STR_SIZE
-	// And then gathering them back
+/******************************************/
+/****** HIERARCHICAL COLLECTIVES   ********/
+/******************************************/
+
+/** Communicators and shared memory of the two-level tree. */
+struct ElfTreeHier_ {
+	MPI_Comm comm;        /**< All nodes */
+	MPI_Comm machineComm; /**< Nodes sharing memory with this one */
+	MPI_Comm leaderComm;  /**< First node of each machine, MPI_COMM_NULL in the others */
+	int machineRank;      /**< Rank within machineComm */
+	int nMachines;        /**< Number of machines */
+	int maxMachineSize;   /**< Number of slots per machine, i.e. the size of the largest machine */
+	int *slots;           /**< At the root, the slot of the piece of each rank of 'comm' */
+	MPI_Win win;          /**< Window over the memory of the leader of the machine */
+	char *region;         /**< Leader's memory: a scatter region followed by a gather region */
+	long capacity;        /**< Size of each region, in bytes */
+};
+
+// Documented in header file
+ElfTreeHier *ElfTreeHier_create(MPI_Comm comm){
+	ElfTreeHier *tree = heap_alloc(sizeof(ElfTreeHier));
+	int myRank, commSize, machineSize;
+	MPI_Comm_rank(comm, &myRank);
+	MPI_Comm_size(comm, &commSize);
 
-	// Create scatter/gather buffer
-	int bufSize = commSize * STR_SIZE + 1;
-	char buf[bufSize];
-	char recv[bufSize];
-	buf[bufSize - 1] = '\0';
-	recv[bufSize - 1] = '\0';
+	tree->comm = comm;
+	tree->machineComm = ElfTreeComm_machine_comm(comm);
+	MPI_Comm_rank(tree->machineComm, &tree->machineRank);
+	MPI_Comm_size(tree->machineComm, &machineSize);
 
+	// Rank 0 of 'comm' is the first node of its machine, so it becomes the first leader
+	MPI_Comm_split(comm, tree->machineRank == 0 ? 0 : MPI_UNDEFINED, myRank, &tree->leaderComm);
 
-	int i, j;
-	if(myRank == 0){
-		for(i = 0; i < commSize; i++){
-			for(j = 0; j < STR_SIZE; j++){
-				buf[i * STR_SIZE + j] = 'a' + i;
-			}
-		}
+	int machine[2] = {0, 0}; // Index of this machine, and number of machines
+	if(tree->machineRank == 0){
+		MPI_Comm_rank(tree->leaderComm, &machine[0]);
+		MPI_Comm_size(tree->leaderComm, &machine[1]);
+	}
+	MPI_Bcast(machine, 2, MPI_INT, 0, tree->machineComm);
+	tree->nMachines = machine[1];
+	MPI_Allreduce(&machineSize, &tree->maxMachineSize, 1, MPI_INT, MPI_MAX, comm);
 
-		// We also have to fill recv for the section that belongs to node 0
-		// Because it needs to be there when we give 'recv' to the gather procedure
-		for(i = 0; i < STR_SIZE; i++)
-			recv[i] = 'a';
+	// The root must know where the piece of each rank lies
+	int slot = machine[0] * tree->maxMachineSize + tree->machineRank;
+	tree->slots = myRank == 0 ? heap_alloc(sizeof(int) * commSize) : NULL;
+	MPI_Gather(&slot, 1, MPI_INT, tree->slots, 1, MPI_INT, 0, comm);
 
-		printf("%s\n", buf);
-	}
+	tree->win = MPI_WIN_NULL;
+	tree->region = NULL;
+	tree->capacity = 0;
 
-	// Scatter and then each process prints their buffer content
-	ElfTreeComm_scatter(buf, STR_SIZE, MPI_CHAR, MPI_COMM_WORLD);
-	
-	// Temporarily add \0 to the buffer
-	char aux = buf[STR_SIZE];
-	buf[STR_SIZE] = '\0';
+	return tree;
+}
 
-	// Print buf
-	usleep(1000 * myRank);
-	printf("%d: %s\n", myRank, buf);
+// Documented in header file
+void ElfTreeHier_destroy(ElfTreeHier *tree){
+	if(tree->win != MPI_WIN_NULL){
+		MPI_Win_unlock_all(tree->win);
+		MPI_Win_free(&tree->win);
+	}
+	if(tree->leaderComm != MPI_COMM_NULL)
+		MPI_Comm_free(&tree->leaderComm);
+	MPI_Comm_free(&tree->machineComm);
+	free(tree->slots);
+	free(tree);
+}
 
-	// Restore buffer state (only matters for node 0)
-	buf[STR_SIZE] = aux;
+// Documented in header file
+MPI_Comm ElfTreeHier_comm(const ElfTreeHier *tree){
+	return tree->comm;
+}
 
-	MPI_Barrier(MPI_COMM_WORLD);
+// Documented in header file
+void ElfTreeHier_reserve(ElfTreeHier *tree, int pieceBytes){
+	// Leaders hold the pieces of the machines below them in the tree, so room is left for all
+	long needed = (long) tree->nMachines * tree->maxMachineSize * pieceBytes;
+	needed = (needed + 15) & ~15L;
+	if(needed <= tree->capacity) return;
 
-	// Gather and then process 0 prints the buffer content
-	if(myRank != 0){
-		ElfTreeComm_gather(buf, STR_SIZE, MPI_CHAR, MPI_COMM_WORLD);
-	} else {
-		ElfTreeComm_gather(recv, STR_SIZE, MPI_CHAR, MPI_COMM_WORLD);
+	if(tree->win != MPI_WIN_NULL){
+		MPI_Win_unlock_all(tree->win);
+		MPI_Win_free(&tree->win);
 	}
 
-	if(myRank == 0){
-		printf("\n");
-		printf("Sizes: %lu %lu\n", strlen(buf), strlen(recv));
-		
-		for(i = 0; i < bufSize; i++){
-			if(buf[i] != recv[i]){
-				printf("Difference at: %d\n", i);
-			}
-		}
+	void *mine;
+	MPI_Aint size = tree->machineRank == 0 ? 2 * needed : 0;
+	MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, tree->machineComm, &mine, &tree->win);
 
+	MPI_Aint leaderSize;
+	int dispUnit;
+	MPI_Win_shared_query(tree->win, 0, &leaderSize, &dispUnit, &tree->region);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, tree->win);
 
-		printf("%s\n", recv);
-	}
+	tree->capacity = needed;
+}
+
+/* Makes writes to the shared memory of the machine visible to all its nodes. */
+static
+void machine_sync(ElfTreeHier *tree){
+	MPI_Win_sync(tree->win);
+	MPI_Barrier(tree->machineComm);
+	MPI_Win_sync(tree->win);
+}
 
-	MPI_Finalize();
-	return 0;
+// Documented in header file
+void *ElfTreeHier_scatter_piece(ElfTreeHier *tree, int rank, int pieceBytes){
+	int slot = tree->slots ? tree->slots[rank] : tree->machineRank;
+	return tree->region + (long) slot * pieceBytes;
 }
 
+// Documented in header file
+void *ElfTreeHier_gather_piece(ElfTreeHier *tree, int rank, int pieceBytes){
+	int slot = tree->slots ? tree->slots[rank] : tree->machineRank;
+	return tree->region + tree->capacity + (long) slot * pieceBytes;
+}
+
+// Documented in header file
+void ElfTreeHier_scatter(ElfTreeHier *tree, int pieceBytes){
+	if(tree->leaderComm != MPI_COMM_NULL)
+		ElfTreeComm_scatter(tree->region, tree->maxMachineSize * pieceBytes, MPI_BYTE, tree->leaderComm);
+	machine_sync(tree);
+}
 
-*/
+// Documented in header file
+void ElfTreeHier_gather(ElfTreeHier *tree, int pieceBytes){
+	machine_sync(tree);
+	if(tree->leaderComm != MPI_COMM_NULL)
+		ElfTreeComm_gather(tree->region + tree->capacity, tree->maxMachineSize * pieceBytes, MPI_BYTE, tree->leaderComm);
+}
@@ -77,7 +77,86 @@
 
 #include <mpi/mpi.h>
 
+/** Transfers are split in segments of this many bytes, which are forwarded down (or up) the tree
+ *   as soon as they arrive, so large payloads are pipelined through the levels of the tree.
+ */
+#ifndef ELF_TREE_SEGMENT_BYTES
+	#define ELF_TREE_SEGMENT_BYTES 65536
+#endif
+
+/** Scatters 'buf' from node 0, as explained above. 'type' must be contiguous. */
 void ElfTreeComm_scatter(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm);
+
+/** Gathers into 'buf' of node 0, as explained above. 'type' must be contiguous. */
 void ElfTreeComm_gather(void *buf, int sendCount, MPI_Datatype type, MPI_Comm comm);
 
+/** Same as ElfTreeComm_scatter, but from node 'root'.
+ * The tree is the same, with ranks renumbered so that 'root' is at the top. The buffer of
+ *   the root is still in rank order, and the other nodes receive their piece at the start of 'buf'.
+ */
+void ElfTreeComm_scatter_root(void *buf, int sendCount, MPI_Datatype type, int root, MPI_Comm comm);
+
+/** Same as ElfTreeComm_gather, but into node 'root'. */
+void ElfTreeComm_gather_root(void *buf, int sendCount, MPI_Datatype type, int root, MPI_Comm comm);
+
+/** Returns a new communicator with the nodes of 'comm' that share memory with this one.
+ * Machine boundaries can be made finer by setting the environment variable ABC_RANKS_PER_MACHINE
+ *   to K, so that each K consecutive world ranks count as a machine (e.g. for testing locally).
+ */
+MPI_Comm ElfTreeComm_machine_comm(MPI_Comm comm);
+
+
+/* HIERARCHICAL COLLECTIVES
+ *
+ * The functions below scatter/gather in two levels: first among one leader node per machine
+ *   (the first node of the machine), with the tree above, and then within each machine,
+ *   through memory shared by all its nodes.
+ *
+ * Pieces are not copied within a machine: each node reads the piece scattered to it, and writes
+ *   the piece to be gathered from it, directly in the shared memory of its leader.
+ * So instead of taking a buffer, the functions give out where each piece lies:
+ *
+ *     ElfTreeHier_reserve(tree, pieceBytes);                           // All nodes
+ *     if(myRank == 0)
+ *         for each rank R: fill ElfTreeHier_scatter_piece(tree, R, pieceBytes)
+ *     ElfTreeHier_scatter(tree, pieceBytes);                           // All nodes
+ *     read ElfTreeHier_scatter_piece(tree, myRank, pieceBytes)
+ *     write ElfTreeHier_gather_piece(tree, myRank, pieceBytes)
+ *     ElfTreeHier_gather(tree, pieceBytes);                            // All nodes
+ *     if(myRank == 0)
+ *         for each rank R: read ElfTreeHier_gather_piece(tree, R, pieceBytes)
+ *
+ * The root is always node 0 of the communicator.
+ * Pieces are only valid until the next call to ElfTreeHier_reserve or ElfTreeHier_scatter.
+ */
+
+/** Two-level tree over a communicator. */
+typedef struct ElfTreeHier_ ElfTreeHier;
+
+/** Creates the two-level tree over 'comm'. Collective over 'comm'. */
+ElfTreeHier *ElfTreeHier_create(MPI_Comm comm);
+
+/** Frees the tree. Collective over the communicator of the tree. */
+void ElfTreeHier_destroy(ElfTreeHier *tree);
+
+/** Returns the communicator the tree was created over. */
+MPI_Comm ElfTreeHier_comm(const ElfTreeHier *tree);
+
+/** Makes room for pieces of 'pieceBytes' bytes. Collective, with the same size in all nodes. */
+void ElfTreeHier_reserve(ElfTreeHier *tree, int pieceBytes);
+
+/** Returns where the scattered piece of node 'rank' lies.
+ * Node 0 may ask for any node, the others only for themselves.
+ */
+void *ElfTreeHier_scatter_piece(ElfTreeHier *tree, int rank, int pieceBytes);
+
+/** Returns where the gathered piece of node 'rank' lies, with the same rules as ElfTreeHier_scatter_piece. */
+void *ElfTreeHier_gather_piece(ElfTreeHier *tree, int rank, int pieceBytes);
+
+/** Scatters the pieces filled by node 0. Collective. */
+void ElfTreeHier_scatter(ElfTreeHier *tree, int pieceBytes);
+
+/** Gathers the pieces filled by every node into node 0. Collective. */
+void ElfTreeHier_gather(ElfTreeHier *tree, int pieceBytes);
+
 #endif
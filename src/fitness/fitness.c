@@ -2,24 +2,61 @@
 #include "fitness.h"
 #include "gyration.h"
 
-double FitnessCalc_run(const numtrd *coordsBB, const numtrd *coordsSC){
+#include <heap.h>
+
+FitnessCalc *FitnessCalc_new(const HPElem *chaininghp, int hpSize, const EnergyParams *energy){
+	FitnessCalc *fit = heap_calloc(1, sizeof(FitnessCalc));
+	fit->chaininghp = chaininghp;
+	fit->hpSize = hpSize;
+	fit->energy = *energy;
+	fit->maxGyration = calc_max_gyration(chaininghp, hpSize);
+	return fit;
+}
+
+long FitnessCalc_evaluations(const FitnessCalc *fit){
+	return fit->evaluations;
+}
+
+void FitnessCalc_count_evaluations(FitnessCalc *fit, int n){
+	fit->evaluations += n;
+}
+
+ScratchArena *scratch_create(size_t size){
+	ScratchArena *arena = heap_alloc(sizeof(ScratchArena));
+	arena->base = heap_alloc(size);
+	arena->size = size;
+	arena->used = 0;
+	return arena;
+}
+
+void scratch_destroy(ScratchArena *arena){
+	if(arena == NULL) return;
+	free(arena->base);
+	free(arena);
+}
+
+double FitnessCalc_run(FitnessCalc *fit, const numtrd *coordsBB, const numtrd *coordsSC){
+	FitnessCalc_count_evaluations(fit, 1);
+	BeadMeasures measures = proteinMeasures(fit, coordsBB, coordsSC, fit->chaininghp, fit->hpSize);
+	return FitnessCalc_from_measures(fit, measures, coordsSC);
+}
+
+double FitnessCalc_from_measures(const FitnessCalc *fit, BeadMeasures measures, const numtrd *coordsSC){
 	int i;
-	FitnessCalc fitCalc = FitnessCalc_get();
+	const EnergyParams *energy = &fit->energy;
 
 	// H is the energy related to different kinds of contacts among side-chain and backbone beads.
 	double H = 0; // Free energy of the protein
 
-	BeadMeasures measures = proteinMeasures(coordsBB, coordsSC, fitCalc.chaininghp, fitCalc.hpSize);
-
 	// Keep summing on energy
-	H += EPS_HH * measures.hh;
-	H += EPS_PP * measures.pp;
-	H += EPS_HP * measures.hp;
-	H += EPS_HB * measures.hb;
-	H += EPS_PB * measures.pb;
-	H += EPS_BB * measures.bb;
+	H += energy->hh * measures.hh;
+	H += energy->pp * measures.pp;
+	H += energy->hp * measures.hp;
+	H += energy->hb * measures.hb;
+	H += energy->pb * measures.pb;
+	H += energy->bb * measures.bb;
 
-	double penalty = PENALTY_VALUE * measures.collisions;
+	double penalty = energy->penalty * measures.collisions;
 
 // Then we calculate the mass center for H beads and P beads (we'll need for gyration)
 // Sum all coordinates for P and H beads
@@ -27,8 +64,8 @@ double FitnessCalc_run(const numtrd *coordsBB, const numtrd *coordsSC){
 	numtrd sumH = numtrd_make(0, 0, 0);
 	int countP = 0;
 	int countH = 0;
-	for(i = 0; i < fitCalc.hpSize; i++){
-		if(fitCalc.chaininghp[i] == 'H'){
+	for(i = 0; i < fit->hpSize; i++){
+		if(fit->chaininghp[i] == 'H'){
 			sumH = numtrd_add(sumH, coordsSC[i]);
 			countH ++;
 		} else /* bead is Polar */ {
@@ -46,10 +83,10 @@ double FitnessCalc_run(const numtrd *coordsBB, const numtrd *coordsSC){
 					   sumP.z / (double) countP };
 
 // Calculate the gyration for both bead types
-	DPair RG_HP = calc_gyration_joint(coordsSC, fitCalc.chaininghp, fitCalc.hpSize, centerH, centerP);
+	DPair RG_HP = calc_gyration_joint(coordsSC, fit->chaininghp, fit->hpSize, centerH, centerP);
 
 // Calculate max gyration of H beads
-	double maxRG_H = fitCalc.maxGyration;
+	double maxRG_H = fit->maxGyration;
 
 // Calculate RadiusG_H
 	double radiusG_H = maxRG_H - RG_HP.first;
@@ -65,28 +102,60 @@ double FitnessCalc_run(const numtrd *coordsBB, const numtrd *coordsSC){
 	return (H - penalty) * radiusG_H * radiusG_P;
 }
 
-double FitnessCalc_run2(const shiftmel * chain){
-	numtrd *coordsBB, *coordsSC;
+double FitnessCalc_run2(FitnessCalc *fit, const shiftmel * chain){
+	int chainSize = fit->hpSize - 1;
 
-	FitnessCalc fitCalc = FitnessCalc_get();
-	int chainSize = fitCalc.hpSize - 1;
+	// The coordinates are only needed until the fitness is known
+	size_t mark = scratch_mark(fit->scratch);
+	numtrd *coordsBB = scratch_alloc(fit->scratch, sizeof(numtrd) * fit->hpSize);
+	numtrd *coordsSC = scratch_alloc(fit->scratch, sizeof(numtrd) * fit->hpSize);
 
-	migrch_build_3d(chain, chainSize, &coordsBB, &coordsSC);
-	double fit = FitnessCalc_run(coordsBB, coordsSC);
-	free(coordsBB);
-	free(coordsSC);
-	return fit;
+	migrch_fill_3d(chain, chainSize, coordsBB, coordsSC);
+	double fitness = FitnessCalc_run(fit, coordsBB, coordsSC);
+
+	scratch_release(fit->scratch, mark);
+	return fitness;
+}
+
+void FitnessCalc_run_batch(FitnessCalc *fit, const shiftmel **chains, int n, double *out){
+	FitnessCalc_run_batch_delta(fit, NULL, chains, NULL, n, out);
 }
 
-void FitnessCalc_measures(const shiftmel *chain, int *Hcontacts_p, int *collisions_p, double *bbGyration_p){
-	numtrd *coordsBB, *coordsSC;
+/* Returns whether candidate 'i' of a batch is worth evaluating incrementally.
+ * Anchoring a parent costs about as much as evaluating a candidate from scratch, so only parents
+ *   shared with the next or previous candidate are anchored, as onlookers of one solution are.
+ * A change at position 0 moves every bead, so it is always evaluated from scratch.
+ */
+static inline
+bool delta_pays_off(const shiftmel **parents, const int *pos, int n, int i){
+	if(pos[i] <= 0)
+		return false;
+	return (i > 0 && parents[i - 1] == parents[i]) || (i + 1 < n && parents[i + 1] == parents[i]);
+}
+
+/* Evaluates the candidates one after the other.
+ * Weak, so that backends which evaluate batches in parallel can define their own.
+ */
+__attribute__((weak))
+void FitnessCalc_run_batch_delta(FitnessCalc *fit, const shiftmel **parents, const shiftmel **chains, const int *pos, int n, double *out){
+	int i;
+	for(i = 0; i < n; i++){
+		if(parents != NULL && delta_pays_off(parents, pos, n, i))
+			out[i] = FitnessCalc_run_delta(fit, parents[i], chains[i], pos[i]);
+		else
+			out[i] = FitnessCalc_run2(fit, chains[i]);
+	}
+}
 
-	FitnessCalc fitCalc = FitnessCalc_get();
-	int chainSize = fitCalc.hpSize - 1;
+void FitnessCalc_measures(FitnessCalc *fit, const shiftmel *chain, int *Hcontacts_p, int *collisions_p, double *bbGyration_p){
+	int chainSize = fit->hpSize - 1;
 
-	migrch_build_3d(chain, chainSize, &coordsBB, &coordsSC);
+	size_t mark = scratch_mark(fit->scratch);
+	numtrd *coordsBB = scratch_alloc(fit->scratch, sizeof(numtrd) * fit->hpSize);
+	numtrd *coordsSC = scratch_alloc(fit->scratch, sizeof(numtrd) * fit->hpSize);
+	migrch_fill_3d(chain, chainSize, coordsBB, coordsSC);
 
-	BeadMeasures measures = proteinMeasures(coordsBB, coordsSC, fitCalc.chaininghp, fitCalc.hpSize);
+	BeadMeasures measures = proteinMeasures(fit, coordsBB, coordsSC, fit->chaininghp, fit->hpSize);
 
 	if(Hcontacts_p){
 		*Hcontacts_p = measures.hh;
@@ -101,18 +170,17 @@ void FitnessCalc_measures(const shiftmel *chain, int *Hcontacts_p, int *collisio
 		int i;
 
 		// Sum coordinates
-		for(i = 0; i < fitCalc.hpSize; i++){
+		for(i = 0; i < fit->hpSize; i++){
 			sum = numtrd_add(sum, coordsBB[i]);
 		}
 
 		// Get center
-		DPoint center = {  sum.x / (double) fitCalc.hpSize,
-						   sum.y / (double) fitCalc.hpSize,
-						   sum.z / (double) fitCalc.hpSize };
+		DPoint center = {  sum.x / (double) fit->hpSize,
+						   sum.y / (double) fit->hpSize,
+						   sum.z / (double) fit->hpSize };
 
-		*bbGyration_p = calc_gyration(coordsBB, fitCalc.hpSize, center);
+		*bbGyration_p = calc_gyration(coordsBB, fit->hpSize, center);
 	}
 
-	free(coordsBB);
-	free(coordsSC);
+	scratch_release(fit->scratch, mark);
 }
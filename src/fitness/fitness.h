@@ -8,25 +8,69 @@
 #include <migrch.h>
 #include <config.h>
 
-/* Initialize the resources needed for calling the functions in this library.
- *   of this library can be called in parallel among threads.
+/** Resources for evaluating one protein: its sequence, the energy parameters, and the lattices
+ *   and scratch memory of the backend. Each is used by one thread at a time, so that different
+ *   threads may evaluate different proteins with different calculators at the same time.
+ *   Threaded backends spread the work of a call over a team of their own.
  */
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize);
+typedef struct FitnessCalc_ FitnessCalc;
 
-/* Cleans up resources allocated.
+/* Creates a calculator for the protein 'chaininghp', with 'hpSize' beads, under 'energy'.
+ * 'chaininghp' must outlive the calculator.
+ * Threaded backends allocate memory for as many threads as omp_get_max_threads() returns at creation.
  */
-void FitnessCalc_cleanup();
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy);
+
+/* Frees the calculator and all its resources.
+ */
+void FitnessCalc_destroy(FitnessCalc *fit);
 
 
-/* Returns the fitness for a protein already registered with FitnessCalc_initialize,
+/* Returns the fitness for the protein of 'fit',
  *   considering that the protein has its 3d coordinates in coordsBB and coordsSC.
  */
-double FitnessCalc_run(const numtrd *coordsBB, const numtrd *coordsSC);
+double FitnessCalc_run(FitnessCalc *fit, const numtrd *coordsBB, const numtrd *coordsSC);
 
-/* Returns the fitness for a protein already registered with FitnessCalc_initialize,
+/* Returns the fitness for the protein of 'fit',
  *   considering that the protein has movement chain 'chain'.
  */
-double FitnessCalc_run2(const shiftmel * chain);
+double FitnessCalc_run2(FitnessCalc *fit, const shiftmel * chain);
+
+/* Returns the fitness for the protein of 'fit',
+ *   considering that the protein has movement chain 'chain', which differs from 'parent'
+ *   only at position 'pos'.
+ *
+ * Backends that keep a lattice reuse the geometry and bead measures of 'parent' across
+ *   calls, so that only the interactions of the beads moved by the change are recounted.
+ *   Changing to another parent places all of its beads, so it pays off only when several
+ *   candidates of the same parent follow each other. A change at position 0 is evaluated
+ *   with FitnessCalc_run2.
+ * The other backends fall back to FitnessCalc_run2.
+ */
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos);
+
+/* Calculates the fitnesses of 'n' proteins of 'fit',
+ *   with movement chains chains[0..n-1], storing them in out[0..n-1].
+ *
+ * Threaded backends evaluate the proteins in parallel, each thread evaluating whole proteins
+ *   in its own scratch memory.
+ * The other backends use the default in fitness.c, which evaluates them one after the other.
+ */
+void FitnessCalc_run_batch(FitnessCalc *fit, const shiftmel **chains, int n, double *out);
+
+/* Same as FitnessCalc_run_batch, but chains[i] may differ from parents[i] only at position pos[i],
+ *   so that backends with incremental evaluation can use FitnessCalc_run_delta.
+ * Candidates of one parent should be consecutive, as only those are evaluated incrementally.
+ * If pos[i] is negative, chains[i] is evaluated from scratch and parents[i] is ignored.
+ * If 'parents' is NULL, all chains are evaluated from scratch and 'pos' is ignored.
+ */
+void FitnessCalc_run_batch_delta(FitnessCalc *fit, const shiftmel **parents, const shiftmel **chains, const int *pos, int n, double *out);
+
+/* Returns the number of fitness evaluations done so far with 'fit'.
+ * Each protein given to FitnessCalc_run, FitnessCalc_run2, FitnessCalc_run_delta or the batch
+ *   functions counts as one evaluation.
+ */
+long FitnessCalc_evaluations(const FitnessCalc *fit);
 
 /* Returns measures for a given movement chain.
  * chain    - the movement chain from which to extract measures
@@ -36,7 +80,6 @@ double FitnessCalc_run2(const shiftmel * chain);
  * collisions_p - the number of collisions among beads
  * bbGyration_p - the gyration radius for the backbone beads
  */
-void FitnessCalc_measures(const shiftmel *chain, int *Hcontacts_p, int *collisions_p, double *bbGyration_p);
+void FitnessCalc_measures(FitnessCalc *fit, const shiftmel *chain, int *Hcontacts_p, int *collisions_p, double *bbGyration_p);
 
 #endif // FITNESS_H
-
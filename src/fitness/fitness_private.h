@@ -7,6 +7,9 @@
  */
 #include <chaininghp.h>
 #include <numtrd.h>
+#include <fitness/fitness.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 /**********************************
  *    FitnessCalc Procedures      *
@@ -14,14 +17,73 @@
 
 #define MAX_MEMORY ((long int) 4*1E9) // Max total size of memory allocated
 
+/* The dense lattices (measures_linear*.c) are checked against MAX_MEMORY by cell size, so they
+ *   keep cells as narrow as they can and clear the cells around each protein after counting it.
+ * Stamping cells with an epoch instead, so that nothing is cleared, was tried and dropped: it
+ *   widened the cells, which lowered the longest protein accepted, and it was slower (sqline on a
+ *   67-mer took 1.89 s with epochs and 1.15 s without). The hashed backend does stamp its slots,
+ *   as its table grows with the protein rather than with the lattice.
+ */
+
+/** Backend-specific state of a FitnessCalc, defined by each measures_*.c that needs one. */
+struct FitnessBackend_;
+
 /** Structure that holds resources to be reused throughout calls to functions. */
-typedef struct FitnessCalc_ {
+struct FitnessCalc_ {
 	const HPElem * chaininghp;
 	int hpSize;
+	EnergyParams energy;
 	void *space3d;
 	int axisSize;
 	double maxGyration;
-} FitnessCalc;
+	struct ScratchArena_ *scratch; /**< Scratch memory of the thread calling the FitnessCalc_* functions */
+	long evaluations;     /**< See FitnessCalc_evaluations */
+	struct FitnessBackend_ *backend;
+};
+
+/** Bump allocator for the scratch buffers of evaluations, so that evaluating never touches the heap.
+ * Buffers are taken with scratch_alloc, and given back all at once by restoring a mark taken
+ *   with scratch_mark before them. Each thread evaluating proteins must have its own arena.
+ */
+typedef struct ScratchArena_ {
+	char *base;  /**< Memory of the arena */
+	size_t size; /**< Size of the arena, in bytes */
+	size_t used; /**< Number of bytes currently taken */
+} ScratchArena;
+
+/** Number of bytes of scratch memory enough for evaluating a protein with 'hpSize' beads. */
+#define SCRATCH_SIZE(hpSize) (sizeof(numtrd) * (hpSize) * 16 + 256)
+
+/** Creates (destroys) a scratch arena with 'size' bytes. */
+ScratchArena *scratch_create(size_t size);
+void scratch_destroy(ScratchArena *arena);
+
+/** Returns a mark to which the arena can be restored with scratch_release. */
+static inline
+size_t scratch_mark(const ScratchArena *arena){
+	return arena->used;
+}
+
+/** Gives back all buffers taken from the arena after 'mark' was taken. */
+static inline
+void scratch_release(ScratchArena *arena, size_t mark){
+	arena->used = mark;
+}
+
+/** Takes a buffer of 'size' bytes from the arena. */
+static inline
+void *scratch_alloc(ScratchArena *arena, size_t size){
+	size = (size + 15) & ~((size_t) 15); // Keep buffers aligned
+
+	if(arena->used + size > arena->size){
+		fprintf(stderr, "%s", "Scratch arena exhausted.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	void *ptr = arena->base + arena->used;
+	arena->used += size;
+	return ptr;
+}
 
 /** Holds a triple of double values. */
 typedef struct {
@@ -55,7 +117,22 @@ typedef struct {
 	int collisions;
 } BeadMeasures;
 
-FitnessCalc FitnessCalc_get(); // Returns the FIT_BUNDLE of the protein being assessed.
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize);
+/** Allocates a FitnessCalc with the fields common to all backends set, and the others zeroed.
+ * Backends build their FitnessCalc_create on it.
+ */
+FitnessCalc *FitnessCalc_new(const HPElem *chaininghp, int hpSize, const EnergyParams *energy);
+
+/** Returns the measures of a protein of 'fit', given the coordinates of its beads. */
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize);
+
+/** Returns the fitness of the protein of 'fit', given the (already linearized) measures of its
+ *   beads and the coordinates of its side chain beads, which are needed for gyration.
+ */
+double FitnessCalc_from_measures(const FitnessCalc *fit, BeadMeasures measures, const numtrd *coordsSC);
+
+/** Adds 'n' to the count returned by FitnessCalc_evaluations.
+ * Backends call it for evaluations that do not go through FitnessCalc_run. Not thread safe.
+ */
+void FitnessCalc_count_evaluations(FitnessCalc *fit, int n);
 
 #endif
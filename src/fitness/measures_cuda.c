@@ -15,22 +15,21 @@
 #include "fitness_private.h"
 
 
-static FitnessCalc FIT_BUNDLE = {0, 0, NULL, 0, 0};
-
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
-	FIT_BUNDLE.chaininghp = chaininghp;
-	FIT_BUNDLE.hpSize = hpSize;
-	FIT_BUNDLE.maxGyration = calc_max_gyration(chaininghp, hpSize);
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	fit->scratch = scratch_create(SCRATCH_SIZE(hpSize));
+	return fit;
 }
 
-void FitnessCalc_cleanup(){
-	return;
+void FitnessCalc_destroy(FitnessCalc *fit){
+	scratch_destroy(fit->scratch);
+	free(fit);
 }
 
-/* Returns the FitnessCalc
+/* This backend has no incremental evaluation, the candidate is evaluated from scratch.
  */
-FitnessCalc FitnessCalc_get(){
-	return FIT_BUNDLE;
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	return FitnessCalc_run2(fit, chain);
 }
 
 static inline
@@ -39,23 +38,26 @@ ElfFloat3d elfFloat3d(numtrd point){
 	return retval;
 }
 
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
 	int i;
 
-	// Create vectors with desired coordinates of beads
-	ElfFloat3d *coordsAll = malloc(sizeof(ElfFloat3d) * hpSize * 2);
+	// Create vectors with desired coordinates of beads, in the scratch arena
+	ScratchArena *scratch = fit->scratch;
+	size_t mark = scratch_mark(scratch);
+
+	ElfFloat3d *coordsAll = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize * 2);
 	int    sizeAll = 0;
-	ElfFloat3d *coordsBB  = malloc(sizeof(ElfFloat3d) * hpSize);
+	ElfFloat3d *coordsBB  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize);
 	int    sizeBB  = 0;
-	ElfFloat3d *coordsHB  = malloc(sizeof(ElfFloat3d) * hpSize * 2);
+	ElfFloat3d *coordsHB  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize * 2);
 	int    sizeHB  = 0;
-	ElfFloat3d *coordsPB  = malloc(sizeof(ElfFloat3d) * hpSize * 2);
+	ElfFloat3d *coordsPB  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize * 2);
 	int    sizePB  = 0;
-	ElfFloat3d *coordsHH  = malloc(sizeof(ElfFloat3d) * hpSize);
+	ElfFloat3d *coordsHH  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize);
 	int    sizeHH  = 0;
-	ElfFloat3d *coordsHP  = malloc(sizeof(ElfFloat3d) * hpSize);
+	ElfFloat3d *coordsHP  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize);
 	int    sizeHP  = 0;
-	ElfFloat3d *coordsPP  = malloc(sizeof(ElfFloat3d) * hpSize);
+	ElfFloat3d *coordsPP  = scratch_alloc(scratch, sizeof(ElfFloat3d) * hpSize);
 	int    sizePP  = 0;
 
 	for(i = 0; i < hpSize; i++){
@@ -111,13 +113,7 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 	retval.pb = sqrt(retval.pb);
 	retval.collisions = sqrt(retval.collisions);
 
-	free(coordsAll);
-	free(coordsBB);
-	free(coordsHB);
-	free(coordsPB);
-	free(coordsHH);
-	free(coordsHP);
-	free(coordsPP);
+	scratch_release(scratch, mark);
 
 	return retval;
 }
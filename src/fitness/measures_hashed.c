@@ -0,0 +1,414 @@
+#include <numtrd.h>
+#include <chaininghp.h>
+#include <migrch.h>
+#include <fitness/fitness.h>
+#include <config.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "fitness_private.h"
+#include "gyration.h"
+
+#include <heap.h>
+
+/* Sparse lattice backend.
+ * Instead of a dense cube with (2n+6)^3 cells, only the cells holding beads are stored,
+ *   in an open-addressing hash table keyed on the Morton code of the cell coordinates.
+ * The table has O(n) slots and is reused across evaluations: each slot is stamped with
+ *   the epoch in which it was claimed, and slots from older epochs count as empty.
+ */
+
+#define MORTON_BIAS (1 << 20) // Coordinates must lie within (-MORTON_BIAS, MORTON_BIAS)
+#define HASH_MULT 0x9E3779B97F4A7C15ULL
+
+/** Cell of the typed lattice, holding how many beads of each type occupy it. */
+typedef struct {
+	unsigned char h; /**< Hydrophobic side chain beads */
+	unsigned char p; /**< Polar side chain beads */
+	unsigned char b; /**< Backbone beads */
+} LatticeCell;
+
+/** Slot of the hash table that stores the lattice. */
+typedef struct {
+	unsigned long long key; /**< Morton code of the cell */
+	unsigned int epoch;     /**< Epoch in which the slot was claimed */
+	LatticeCell cell;       /**< Beads in the cell */
+} HashSlot;
+
+/** Bead types, as placed in the typed lattice. */
+enum BeadType { BEAD_H, BEAD_P, BEAD_B };
+
+/** Backend state of a FitnessCalc. */
+typedef struct FitnessBackend_ {
+	/** Bookkeeping of the hash table, which is stored in the space3d of the FitnessCalc. */
+	struct {
+		int bits;           /**< The table has 2^bits slots */
+		unsigned int epoch; /**< Current epoch */
+		int used;           /**< Number of slots claimed in the current epoch */
+	} table;
+
+	/** Parent protein whose geometry is kept for incremental (delta) evaluations.
+	 * All its beads are kept placed in the table between calls to FitnessCalc_run_delta.
+	 */
+	struct {
+		shiftmel *chain;      /**< Movement chain of the anchored parent */
+		numtrd *coordsBB;     /**< Backbone coordinates of the parent */
+		numtrd *coordsSC;     /**< Side chain coordinates of the parent */
+		numtrd *deltaBB;      /**< Scratch backbone coordinates for the candidate */
+		numtrd *deltaSC;      /**< Scratch side chain coordinates for the candidate */
+		BeadMeasures counts;  /**< Raw (not linearized) measures of the parent */
+		int nH;               /**< Number of H beads in the protein */
+		bool valid;           /**< Whether there is a parent anchored */
+	} anchor;
+} HashedBackend;
+
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
+	if(hpSize + 3 >= MORTON_BIAS){
+		fprintf(stderr, "Chains longer than %d beads are not supported.\n", MORTON_BIAS - 4);
+		exit(EXIT_FAILURE);
+	}
+
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	HashedBackend *backend = heap_alloc(sizeof(HashedBackend));
+	fit->backend = backend;
+
+	// At least 16 slots per residue. There are 2 beads per residue, and a delta evaluation
+	//   claims at most 2 slots per residue more, so the load stays well below 1/2.
+	backend->table.bits = 4;
+	while((1 << backend->table.bits) < 16 * hpSize) backend->table.bits++;
+
+	fit->space3d = heap_calloc(1 << backend->table.bits, sizeof(HashSlot));
+	backend->table.epoch = 1;
+	backend->table.used = 0;
+
+	fit->scratch = scratch_create(SCRATCH_SIZE(hpSize));
+
+	backend->anchor.chain    = heap_alloc(sizeof(shiftmel) * (hpSize - 1));
+	backend->anchor.coordsBB = heap_alloc(sizeof(numtrd) * hpSize);
+	backend->anchor.coordsSC = heap_alloc(sizeof(numtrd) * hpSize);
+	backend->anchor.deltaBB  = heap_alloc(sizeof(numtrd) * hpSize);
+	backend->anchor.deltaSC  = heap_alloc(sizeof(numtrd) * hpSize);
+
+	int i;
+	backend->anchor.nH = 0;
+	for(i = 0; i < hpSize; i++)
+		if(chaininghp[i] == 'H') backend->anchor.nH++;
+	backend->anchor.valid = false;
+
+	return fit;
+}
+
+void FitnessCalc_destroy(FitnessCalc *fit){
+	HashedBackend *backend = fit->backend;
+	free(backend->anchor.chain);
+	free(backend->anchor.coordsBB);
+	free(backend->anchor.coordsSC);
+	free(backend->anchor.deltaBB);
+	free(backend->anchor.deltaSC);
+	free(backend);
+
+	free(fit->space3d);
+	scratch_destroy(fit->scratch);
+	free(fit);
+}
+
+
+
+
+/* Spreads the 21 lowest bits of 'v' so that there are 2 zero bits between each of them. */
+static inline
+unsigned long long spread_bits(unsigned long long v){
+	v &= 0x1FFFFF;
+	v = (v | v << 32) & 0x1F00000000FFFFULL;
+	v = (v | v << 16) & 0x1F0000FF0000FFULL;
+	v = (v | v << 8)  & 0x100F00F00F00F00FULL;
+	v = (v | v << 4)  & 0x10C30C30C30C30C3ULL;
+	v = (v | v << 2)  & 0x1249249249249249ULL;
+	return v;
+}
+
+/* Returns the Morton code of the cell at (x, y, z). */
+static inline
+unsigned long long morton(int x, int y, int z){
+	return spread_bits(x + MORTON_BIAS)
+	     | spread_bits(y + MORTON_BIAS) << 1
+	     | spread_bits(z + MORTON_BIAS) << 2;
+}
+
+/** Bits of the Morton code holding each of the coordinates. */
+#define MORTON_X 0x1249249249249249ULL
+#define MORTON_Y (MORTON_X << 1)
+#define MORTON_Z (MORTON_X << 2)
+
+/* Returns the Morton code of the cell next to 'key', in the positive direction of the axis
+ *   whose bits are 'mask'. This avoids spreading the bits of the coordinates again.
+ */
+static inline
+unsigned long long morton_inc(unsigned long long key, unsigned long long mask){
+	return (((key | ~mask) + 1) & mask) | (key & ~mask);
+}
+
+/* Same as morton_inc, but in the negative direction. */
+static inline
+unsigned long long morton_dec(unsigned long long key, unsigned long long mask){
+	return (((key & mask) - 1) & mask) | (key & ~mask);
+}
+
+/* Empties the whole table in O(1), by starting a new epoch. */
+static
+void table_clear(FitnessCalc *fit){
+	HashedBackend *backend = fit->backend;
+
+	backend->table.epoch++;
+	backend->table.used = 0;
+
+	// On wrap around, stale stamps could be taken as current.
+	if(backend->table.epoch == UINT_MAX){
+		memset(fit->space3d, 0, sizeof(HashSlot) * (1 << backend->table.bits));
+		backend->table.epoch = 1;
+	}
+}
+
+/* Returns the cell with the given key, or an empty cell if there is no such cell. */
+static inline
+LatticeCell table_get(const FitnessCalc *fit, unsigned long long key){
+	const HashSlot *slots = fit->space3d;
+	unsigned int epoch = fit->backend->table.epoch;
+	int bits = fit->backend->table.bits;
+	unsigned int mask = (1 << bits) - 1;
+	unsigned int idx = (key * HASH_MULT) >> (64 - bits);
+
+	while(slots[idx].epoch == epoch){
+		if(slots[idx].key == key)
+			return slots[idx].cell;
+		idx = (idx + 1) & mask;
+	}
+
+	LatticeCell empty = {0, 0, 0};
+	return empty;
+}
+
+/* Returns the cell with the given key, claiming a slot for it if needed. */
+static inline
+LatticeCell *table_claim(FitnessCalc *fit, unsigned long long key){
+	HashSlot *slots = fit->space3d;
+	unsigned int epoch = fit->backend->table.epoch;
+	int bits = fit->backend->table.bits;
+	unsigned int mask = (1 << bits) - 1;
+	unsigned int idx = (key * HASH_MULT) >> (64 - bits);
+
+	while(slots[idx].epoch == epoch){
+		if(slots[idx].key == key)
+			return &slots[idx].cell;
+		idx = (idx + 1) & mask;
+	}
+
+	slots[idx].key = key;
+	slots[idx].epoch = epoch;
+	memset(&slots[idx].cell, 0, sizeof(LatticeCell));
+	fit->backend->table.used++;
+	return &slots[idx].cell;
+}
+
+/* Adds to 'm' (multiplied by 'sign') the contacts and collisions between a bead of type 'type'
+ *   at 'a' and all beads currently placed in the table.
+ */
+static inline
+void count_typed(const FitnessCalc *fit, BeadMeasures *m, numtrd a, enum BeadType type, int sign){
+	unsigned long long key = morton(a.x, a.y, a.z);
+	LatticeCell c = table_get(fit, key);
+	m->collisions += sign * (c.h + c.p + c.b);
+
+	LatticeCell n[6] = {
+		table_get(fit, morton_inc(key, MORTON_X)), table_get(fit, morton_dec(key, MORTON_X)),
+		table_get(fit, morton_inc(key, MORTON_Y)), table_get(fit, morton_dec(key, MORTON_Y)),
+		table_get(fit, morton_inc(key, MORTON_Z)), table_get(fit, morton_dec(key, MORTON_Z))
+	};
+
+	int i, h = 0, p = 0, b = 0;
+	for(i = 0; i < 6; i++){
+		h += n[i].h;
+		p += n[i].p;
+		b += n[i].b;
+	}
+
+	if(type == BEAD_H){
+		m->hh += sign * h;
+		m->hp += sign * p;
+		m->hb += sign * b;
+	} else if(type == BEAD_P){
+		m->hp += sign * h;
+		m->pp += sign * p;
+		m->pb += sign * b;
+	} else /* type == BEAD_B */ {
+		m->hb += sign * h;
+		m->pb += sign * p;
+		m->bb += sign * b;
+	}
+}
+
+/* Places (delta = 1) or removes (delta = -1) a bead of type 'type' at 'a' in the table.
+ * Emptied cells keep their slots until the table is cleared.
+ */
+static inline
+void place_typed(FitnessCalc *fit, numtrd a, enum BeadType type, int delta){
+	LatticeCell *cell = table_claim(fit, morton(a.x, a.y, a.z));
+	if(type == BEAD_H)      cell->h += delta;
+	else if(type == BEAD_P) cell->p += delta;
+	else                    cell->b += delta;
+}
+
+static inline
+enum BeadType sc_type(const HPElem *chaininghp, int i){
+	return chaininghp[i] == 'H' ? BEAD_H : BEAD_P;
+}
+
+/* Places all beads of a protein in the table, and returns its raw (not linearized) measures.
+ * Each bead is counted against the beads placed before it and then placed, so each pair of beads
+ *   is counted exactly once.
+ */
+static
+BeadMeasures place_protein(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	int i;
+	BeadMeasures counts = {0, 0, 0, 0, 0, 0, 0};
+
+	for(i = 0; i < hpSize; i++){
+		count_typed(fit, &counts, BBbeads[i], BEAD_B, 1);
+		place_typed(fit, BBbeads[i], BEAD_B, 1);
+	}
+
+	for(i = 0; i < hpSize; i++){
+		enum BeadType type = sc_type(chaininghp, i);
+		count_typed(fit, &counts, SCbeads[i], type, 1);
+		place_typed(fit, SCbeads[i], type, 1);
+	}
+
+	return counts;
+}
+
+/* Removes the trivial contacts from raw measures and linearizes them.
+ * 'nH' is the number of H beads in the protein.
+ */
+static
+BeadMeasures linearize_measures(BeadMeasures raw, int hpSize, int nH){
+	// Remove the trivial contacts
+	raw.bb -= (hpSize - 1);
+	raw.hb -= nH;
+	raw.pb -= (hpSize - nH);
+
+	// Linearize amount of collisions and contacts
+	raw.hh = sqrt(raw.hh);
+	raw.pp = sqrt(raw.pp);
+	raw.hp = sqrt(raw.hp);
+	raw.bb = sqrt(raw.bb);
+	raw.hb = sqrt(raw.hb);
+	raw.pb = sqrt(raw.pb);
+	raw.collisions = sqrt(raw.collisions);
+
+	return raw;
+}
+
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	// The table must be empty, so the anchored parent is lost.
+	fit->backend->anchor.valid = false;
+	table_clear(fit);
+
+	BeadMeasures counts = place_protein(fit, BBbeads, SCbeads, chaininghp, hpSize);
+
+	int i, nH = 0;
+	for(i = 0; i < hpSize; i++)
+		if(chaininghp[i] == 'H') nH++;
+
+	return linearize_measures(counts, hpSize, nH);
+}
+
+/* Makes 'parent' the anchored protein, placing all of its beads in a freshly cleared table
+ *   and counting its raw measures. Nothing is done if it is already anchored.
+ */
+static
+void anchor_set(FitnessCalc *fit, const shiftmel *parent){
+	int hpSize = fit->hpSize;
+
+	if(fit->backend->anchor.valid && memcmp(fit->backend->anchor.chain, parent, hpSize - 1) == 0)
+		return;
+
+	table_clear(fit);
+
+	migrch_fill_3d(parent, hpSize - 1, fit->backend->anchor.coordsBB, fit->backend->anchor.coordsSC);
+	memcpy(fit->backend->anchor.chain, parent, hpSize - 1);
+
+	fit->backend->anchor.counts = place_protein(fit, fit->backend->anchor.coordsBB, fit->backend->anchor.coordsSC, fit->chaininghp, hpSize);
+	fit->backend->anchor.valid = true;
+}
+
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	int i;
+	int hpSize = fit->hpSize;
+	const HPElem *chaininghp = fit->chaininghp;
+
+	// A change at position 0 moves every bead, which is cheaper to place from scratch
+	if(pos == 0)
+		return FitnessCalc_run2(fit, chain);
+
+	// Cells emptied by previous candidates still hold slots, so the parent is
+	//   placed again once they take a quarter of the table.
+	if(fit->backend->table.used > (1 << fit->backend->table.bits) / 4)
+		fit->backend->anchor.valid = false;
+
+	anchor_set(fit, parent);
+
+	// Build the candidate's coordinates on top of the parent's
+	numtrd *oldBB = fit->backend->anchor.coordsBB, *oldSC = fit->backend->anchor.coordsSC;
+	numtrd *newBB = fit->backend->anchor.deltaBB,  *newSC = fit->backend->anchor.deltaSC;
+	memcpy(newBB, oldBB, sizeof(numtrd) * hpSize);
+	memcpy(newSC, oldSC, sizeof(numtrd) * hpSize);
+	migrch_rebuild_3d(chain, hpSize - 1, pos, newBB, newSC);
+
+	// Only beads after 'pos' may have moved
+	int first = pos + 1;
+
+	// Take out the moved beads, discounting their interactions with the remaining ones
+	BeadMeasures counts = fit->backend->anchor.counts;
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			place_typed(fit, oldBB[i], BEAD_B, -1);
+			count_typed(fit, &counts, oldBB[i], BEAD_B, -1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			place_typed(fit, oldSC[i], sc_type(chaininghp, i), -1);
+			count_typed(fit, &counts, oldSC[i], sc_type(chaininghp, i), -1);
+		}
+	}
+
+	// Put them back in their new positions, counting their new interactions
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			count_typed(fit, &counts, newBB[i], BEAD_B, 1);
+			place_typed(fit, newBB[i], BEAD_B, 1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			count_typed(fit, &counts, newSC[i], sc_type(chaininghp, i), 1);
+			place_typed(fit, newSC[i], sc_type(chaininghp, i), 1);
+		}
+	}
+
+	// Restore the table to the parent's state
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			place_typed(fit, newBB[i], BEAD_B, -1);
+			place_typed(fit, oldBB[i], BEAD_B, 1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			place_typed(fit, newSC[i], sc_type(chaininghp, i), -1);
+			place_typed(fit, oldSC[i], sc_type(chaininghp, i), 1);
+		}
+	}
+
+	BeadMeasures measures = linearize_measures(counts, hpSize, fit->backend->anchor.nH);
+	FitnessCalc_count_evaluations(fit, 1);
+	return FitnessCalc_from_measures(fit, measures, newSC);
+}
@@ -1,4 +1,3 @@
-
 #include <numtrd.h>
 #include <chaininghp.h>
 #include <migrch.h>
@@ -8,68 +7,223 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "fitness_private.h"
 #include "gyration.h"
 
+#include <heap.h>
+
 #define COORD3D(V, AXIS) COORD(V.x, V.y, V.z, AXIS)
 #define COORD(X, Y, Z, AXIS) ( (Z+AXIS/2) * (AXIS*(long int)AXIS) + (Y+AXIS/2) * ((long int)AXIS) + (X+AXIS/2))
 
-static FitnessCalc FIT_BUNDLE = {0, 0, NULL, 0, 0};
-
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
-	if(FIT_BUNDLE.space3d != NULL){
-		fprintf(stderr, "%s", "Double initialization.\n");
-		exit(EXIT_FAILURE);
-	}
+/** Cell of the typed lattice, holding how many beads of each type occupy it. */
+typedef struct {
+	unsigned char h; /**< Hydrophobic side chain beads */
+	unsigned char p; /**< Polar side chain beads */
+	unsigned char b; /**< Backbone beads */
+} LatticeCell;
 
-	FIT_BUNDLE.chaininghp = chaininghp;
-	FIT_BUNDLE.hpSize = hpSize;
+/** Bead types, as placed in the typed lattice. */
+enum BeadType { BEAD_H, BEAD_P, BEAD_B };
 
+/** Parent protein whose geometry is kept for incremental (delta) evaluations, which is the backend state of a FitnessCalc.
+ * All its beads are kept placed in the lattice of the FitnessCalc between calls to FitnessCalc_run_delta.
+ * Typed cells take 3 bytes, so for proteins whose typed lattice would exceed MAX_MEMORY the lattice
+ *   holds plain bead counts instead, of one byte, and there are no incremental evaluations.
+ */
+typedef struct FitnessBackend_ {
+	shiftmel *chain;      /**< Movement chain of the anchored parent */
+	numtrd *coordsBB;     /**< Backbone coordinates of the parent */
+	numtrd *coordsSC;     /**< Side chain coordinates of the parent */
+	numtrd *deltaBB;      /**< Scratch backbone coordinates for the candidate */
+	numtrd *deltaSC;      /**< Scratch side chain coordinates for the candidate */
+	BeadMeasures counts;  /**< Raw (not linearized) measures of the parent */
+	int nH;               /**< Number of H beads in the protein */
+	bool typed;           /**< Whether the lattice is typed (LatticeCell) or of plain counts (char) */
+	bool valid;           /**< Whether there is a parent anchored */
+} Anchor;
+
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
 	int axisSize = (hpSize+3)*2;
 	long int spaceSize = axisSize * axisSize * (long int) axisSize;
 
 	// Failsafe for memory usage
-	if(spaceSize * sizeof(char) > MAX_MEMORY){
+	bool typed = spaceSize * sizeof(LatticeCell) <= MAX_MEMORY;
+	if(!typed && spaceSize * sizeof(char) > MAX_MEMORY){
 		fprintf(stderr, "Will not allocate more than %g memory.\n", (double) MAX_MEMORY);
 		exit(EXIT_FAILURE);
 	}
 
-	FIT_BUNDLE.axisSize = axisSize;
-	FIT_BUNDLE.space3d = malloc(spaceSize * sizeof(char));
-	FIT_BUNDLE.maxGyration = calc_max_gyration(chaininghp, hpSize);
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	fit->axisSize = axisSize;
+	fit->space3d = heap_calloc(spaceSize, typed ? sizeof(LatticeCell) : sizeof(char));
+
+	fit->scratch = scratch_create(SCRATCH_SIZE(hpSize));
+
+	Anchor *anchor = heap_alloc(sizeof(Anchor));
+	anchor->chain    = heap_alloc(sizeof(shiftmel) * (hpSize - 1));
+	anchor->coordsBB = heap_alloc(sizeof(numtrd) * hpSize);
+	anchor->coordsSC = heap_alloc(sizeof(numtrd) * hpSize);
+	anchor->deltaBB  = heap_alloc(sizeof(numtrd) * hpSize);
+	anchor->deltaSC  = heap_alloc(sizeof(numtrd) * hpSize);
+
+	int i;
+	anchor->nH = 0;
+	for(i = 0; i < hpSize; i++)
+		if(chaininghp[i] == 'H') anchor->nH++;
+	anchor->typed = typed;
+	anchor->valid = false;
+	fit->backend = anchor;
+
+	return fit;
 }
 
-void FitnessCalc_cleanup(){
-	// No checks will be done
-	free(FIT_BUNDLE.space3d);
-	FIT_BUNDLE.space3d = NULL;
+void FitnessCalc_destroy(FitnessCalc *fit){
+	Anchor *anchor = fit->backend;
+	free(anchor->chain);
+	free(anchor->coordsBB);
+	free(anchor->coordsSC);
+	free(anchor->deltaBB);
+	free(anchor->deltaSC);
+	free(anchor);
+
+	free(fit->space3d);
+	scratch_destroy(fit->scratch);
+	free(fit);
 }
 
-/* Returns the FitnessCalc
+
+
+
+/* Adds to 'm' (multiplied by 'sign') the contacts and collisions between a bead of type 'type'
+ *   at 'a' and all beads currently placed in the typed lattice.
  */
-FitnessCalc FitnessCalc_get(){
-	if(FIT_BUNDLE.space3d == NULL){
-		fprintf(stderr, "%s", "FitnessCalc must be initialized.\n");
-		exit(EXIT_FAILURE);
+static inline
+void count_typed(const FitnessCalc *fit, BeadMeasures *m, numtrd a, enum BeadType type, int sign){
+	const LatticeCell *space3d = fit->space3d;
+	int axisSize = fit->axisSize;
+
+	LatticeCell c = space3d[COORD3D(a, axisSize)];
+	m->collisions += sign * (c.h + c.p + c.b);
+
+	int h = 0, p = 0, b = 0;
+	long int idx[6] = {
+		COORD(a.x+1, a.y, a.z, axisSize), COORD(a.x-1, a.y, a.z, axisSize),
+		COORD(a.x, a.y+1, a.z, axisSize), COORD(a.x, a.y-1, a.z, axisSize),
+		COORD(a.x, a.y, a.z+1, axisSize), COORD(a.x, a.y, a.z-1, axisSize)
+	};
+
+	int i;
+	for(i = 0; i < 6; i++){
+		h += space3d[idx[i]].h;
+		p += space3d[idx[i]].p;
+		b += space3d[idx[i]].b;
+	}
+
+	if(type == BEAD_H){
+		m->hh += sign * h;
+		m->hp += sign * p;
+		m->hb += sign * b;
+	} else if(type == BEAD_P){
+		m->hp += sign * h;
+		m->pp += sign * p;
+		m->pb += sign * b;
+	} else /* type == BEAD_B */ {
+		m->hb += sign * h;
+		m->pb += sign * p;
+		m->bb += sign * b;
 	}
-	return FIT_BUNDLE;
 }
 
+/* Places (delta = 1) or removes (delta = -1) a bead of type 'type' at 'a' in the typed lattice. */
+static inline
+void place_typed(FitnessCalc *fit, numtrd a, enum BeadType type, int delta){
+	LatticeCell *space3d = fit->space3d;
+	LatticeCell *cell = &space3d[COORD3D(a, fit->axisSize)];
+	if(type == BEAD_H)      cell->h += delta;
+	else if(type == BEAD_P) cell->p += delta;
+	else                    cell->b += delta;
+}
+
+static inline
+enum BeadType sc_type(const HPElem *chaininghp, int i){
+	return chaininghp[i] == 'H' ? BEAD_H : BEAD_P;
+}
+
+/* Places all beads of a protein in the typed lattice, and returns its raw (not linearized) measures.
+ * Each bead is counted against the beads placed before it and then placed, so each pair of beads
+ *   is counted exactly once, in a single pass over the lattice.
+ */
+static
+BeadMeasures place_protein(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	int i;
+	BeadMeasures counts = {0, 0, 0, 0, 0, 0, 0};
+
+	for(i = 0; i < hpSize; i++){
+		count_typed(fit, &counts, BBbeads[i], BEAD_B, 1);
+		place_typed(fit, BBbeads[i], BEAD_B, 1);
+	}
+
+	for(i = 0; i < hpSize; i++){
+		enum BeadType type = sc_type(chaininghp, i);
+		count_typed(fit, &counts, SCbeads[i], type, 1);
+		place_typed(fit, SCbeads[i], type, 1);
+	}
 
+	return counts;
+}
 
+/* Removes all beads of a protein from the typed lattice. */
+static
+void remove_protein(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	int i;
+	for(i = 0; i < hpSize; i++){
+		place_typed(fit, BBbeads[i], BEAD_B, -1);
+		place_typed(fit, SCbeads[i], sc_type(chaininghp, i), -1);
+	}
+}
 
-/* Counts the number of collision within a vector of beads
- * 'space3d' is 3D lattice whose axis has size axisSize (positive + negative sides of the axis).
+/* Removes the trivial contacts from raw measures and linearizes them.
+ * 'nH' is the number of H beads in the protein.
  */
 static
-int count_collisions(const numtrd *beads, int nBeads){
+BeadMeasures linearize_measures(BeadMeasures raw, int hpSize, int nH){
+	// Remove the trivial contacts
+	raw.bb -= (hpSize - 1);
+	raw.hb -= nH;
+	raw.pb -= (hpSize - nH);
+
+	// Linearize amount of collisions and contacts
+	raw.hh = sqrt(raw.hh);
+	raw.pp = sqrt(raw.pp);
+	raw.hp = sqrt(raw.hp);
+	raw.bb = sqrt(raw.bb);
+	raw.hb = sqrt(raw.hb);
+	raw.pb = sqrt(raw.pb);
+	raw.collisions = sqrt(raw.collisions);
+
+	return raw;
+}
+
+/* Takes the anchored parent, if any, out of the typed lattice. */
+static
+void anchor_evict(FitnessCalc *fit){
+	Anchor *anchor = fit->backend;
+	if(!anchor->valid) return;
+
+	remove_protein(fit, anchor->coordsBB, anchor->coordsSC, fit->chaininghp, fit->hpSize);
+	anchor->valid = false;
+}
+
+/* Counts the number of collision within a vector of beads, in the lattice of plain counts.
+ */
+static
+int count_collisions(FitnessCalc *fit, const numtrd *beads, int nBeads){
 	int i, collisions;
+	char *space3d = fit->space3d;
+	int axisSize = fit->axisSize;
 
-	// Get space3d associated with that thread
-	char *space3d = FIT_BUNDLE.space3d;
-	int axisSize = FIT_BUNDLE.axisSize;
-	
 	collisions = 0;
 
 	// Reset space
@@ -88,19 +242,16 @@ int count_collisions(const numtrd *beads, int nBeads){
 	return collisions;
 }
 
-/* Counts the number of contacts within a vector of beads
- * 'space3d' is 3D lattice whose axis has size axisSize (positive + negative sides of the axis).
+/* Counts the number of contacts within a vector of beads, in the lattice of plain counts.
  */
 static
-int count_contacts(const numtrd *beads, int nBeads){
+int count_contacts(FitnessCalc *fit, const numtrd *beads, int nBeads){
 	int i;
-
-	// Get space3d associated with that thread
-	char *space3d = FIT_BUNDLE.space3d;
-	int axisSize = FIT_BUNDLE.axisSize;
+	char *space3d = fit->space3d;
+	int axisSize = fit->axisSize;
 
 	int contacts = 0;
-	
+
 	// Reset space
 	for(i = 0; i < nBeads; i++){
 		numtrd a = beads[i];
@@ -129,27 +280,33 @@ int count_contacts(const numtrd *beads, int nBeads){
 		contacts += space3d[COORD(a.x, a.y, a.z+1, axisSize)];
 		contacts += space3d[COORD(a.x, a.y, a.z-1, axisSize)];
 	}
-	
+
 	return contacts / 2;
 }
 
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+/* Returns the raw measures of a protein through the lattice of plain counts, with one pass
+ *   over each group of beads, as done before the lattice was typed.
+ */
+static
+BeadMeasures untyped_measures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
 	int i;
 
-	// Create vectors with desired coordinates of beads
-	numtrd *coordsAll = malloc(sizeof(numtrd) * hpSize * 2);
+	// Create vectors with desired coordinates of beads, in the scratch arena
+	size_t mark = scratch_mark(fit->scratch);
+
+	numtrd *coordsAll = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeAll = 0;
-	numtrd *coordsBB  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsBB  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize);
 	int    sizeBB  = 0;
-	numtrd *coordsHB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsHB  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeHB  = 0;
-	numtrd *coordsPB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsPB  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizePB  = 0;
-	numtrd *coordsHH  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHH  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize);
 	int    sizeHH  = 0;
-	numtrd *coordsHP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHP  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize);
 	int    sizeHP  = 0;
-	numtrd *coordsPP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsPP  = scratch_alloc(fit->scratch, sizeof(numtrd) * hpSize);
 	int    sizePP  = 0;
 
 	for(i = 0; i < hpSize; i++){
@@ -173,35 +330,118 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 
 	BeadMeasures retval;
 
-	retval.hh = count_contacts(coordsHH, sizeHH);
-	retval.pp = count_contacts(coordsPP, sizePP);
-	retval.hp = count_contacts(coordsHP, sizeHP) - retval.hh - retval.pp; // HP = all - HH - PP
-	retval.bb = count_contacts(coordsBB, sizeBB);
-	retval.hb = count_contacts(coordsHB, sizeHB) - retval.hh - retval.bb; // HB = all - HH - BB
-	retval.pb = count_contacts(coordsPB, sizePB) - retval.pp - retval.bb; // PB = all - PP - BB
-	retval.collisions = count_collisions(coordsAll, sizeAll);
+	retval.hh = count_contacts(fit, coordsHH, sizeHH);
+	retval.pp = count_contacts(fit, coordsPP, sizePP);
+	retval.hp = count_contacts(fit, coordsHP, sizeHP) - retval.hh - retval.pp; // HP = all - HH - PP
+	retval.bb = count_contacts(fit, coordsBB, sizeBB);
+	retval.hb = count_contacts(fit, coordsHB, sizeHB) - retval.hh - retval.bb; // HB = all - HH - BB
+	retval.pb = count_contacts(fit, coordsPB, sizePB) - retval.pp - retval.bb; // PB = all - PP - BB
+	retval.collisions = count_collisions(fit, coordsAll, sizeAll);
 
-	// Remove the trivial contacts
-	retval.bb -= (hpSize - 1);
-	retval.hb -= (sizeHH);
-	retval.pb -= (sizePP);
-	
-	// Linearize amount of collisions and contacts
-	retval.hh = sqrt(retval.hh);
-	retval.pp = sqrt(retval.pp);
-	retval.hp = sqrt(retval.hp);
-	retval.bb = sqrt(retval.bb);
-	retval.hb = sqrt(retval.hb);
-	retval.pb = sqrt(retval.pb);
-	retval.collisions = sqrt(retval.collisions);
-
-	free(coordsAll);
-	free(coordsBB);
-	free(coordsHB);
-	free(coordsPB);
-	free(coordsHH);
-	free(coordsHP);
-	free(coordsPP);
+	scratch_release(fit->scratch, mark);
 
 	return retval;
 }
+
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	Anchor *anchor = fit->backend;
+	int i, nH = 0;
+	for(i = 0; i < hpSize; i++)
+		if(chaininghp[i] == 'H') nH++;
+
+	if(!anchor->typed)
+		return linearize_measures(untyped_measures(fit, BBbeads, SCbeads, chaininghp, hpSize), hpSize, nH);
+
+	// The lattice must be empty, so the anchored parent is lost.
+	anchor_evict(fit);
+
+	BeadMeasures counts = place_protein(fit, BBbeads, SCbeads, chaininghp, hpSize);
+	remove_protein(fit, BBbeads, SCbeads, chaininghp, hpSize);
+
+	return linearize_measures(counts, hpSize, nH);
+}
+
+/* Makes 'parent' the anchored protein, placing all of its beads in the typed lattice
+ *   and counting its raw measures. Nothing is done if it is already anchored.
+ */
+static
+void anchor_set(FitnessCalc *fit, const shiftmel *parent){
+	Anchor *anchor = fit->backend;
+	int hpSize = fit->hpSize;
+
+	if(anchor->valid && memcmp(anchor->chain, parent, hpSize - 1) == 0)
+		return;
+
+	anchor_evict(fit);
+
+	migrch_fill_3d(parent, hpSize - 1, anchor->coordsBB, anchor->coordsSC);
+	memcpy(anchor->chain, parent, hpSize - 1);
+
+	anchor->counts = place_protein(fit, anchor->coordsBB, anchor->coordsSC, fit->chaininghp, hpSize);
+	anchor->valid = true;
+}
+
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	Anchor *anchor = fit->backend;
+	int i;
+	int hpSize = fit->hpSize;
+	const HPElem *chaininghp = fit->chaininghp;
+
+	// A change at position 0 moves every bead, which is cheaper to place from scratch.
+	// Without a typed lattice, no parent can be anchored.
+	if(pos == 0 || !anchor->typed)
+		return FitnessCalc_run2(fit, chain);
+
+	anchor_set(fit, parent);
+
+	// Build the candidate's coordinates on top of the parent's
+	numtrd *oldBB = anchor->coordsBB, *oldSC = anchor->coordsSC;
+	numtrd *newBB = anchor->deltaBB,  *newSC = anchor->deltaSC;
+	memcpy(newBB, oldBB, sizeof(numtrd) * hpSize);
+	memcpy(newSC, oldSC, sizeof(numtrd) * hpSize);
+	migrch_rebuild_3d(chain, hpSize - 1, pos, newBB, newSC);
+
+	// Only beads after 'pos' may have moved
+	int first = pos + 1;
+
+	// Take out the moved beads, discounting their interactions with the remaining ones
+	BeadMeasures counts = anchor->counts;
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			place_typed(fit, oldBB[i], BEAD_B, -1);
+			count_typed(fit, &counts, oldBB[i], BEAD_B, -1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			place_typed(fit, oldSC[i], sc_type(chaininghp, i), -1);
+			count_typed(fit, &counts, oldSC[i], sc_type(chaininghp, i), -1);
+		}
+	}
+
+	// Put them back in their new positions, counting their new interactions
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			count_typed(fit, &counts, newBB[i], BEAD_B, 1);
+			place_typed(fit, newBB[i], BEAD_B, 1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			count_typed(fit, &counts, newSC[i], sc_type(chaininghp, i), 1);
+			place_typed(fit, newSC[i], sc_type(chaininghp, i), 1);
+		}
+	}
+
+	// Restore the lattice to the parent's state
+	for(i = first; i < hpSize; i++){
+		if(!numtrd_equal(oldBB[i], newBB[i])){
+			place_typed(fit, newBB[i], BEAD_B, -1);
+			place_typed(fit, oldBB[i], BEAD_B, 1);
+		}
+		if(!numtrd_equal(oldSC[i], newSC[i])){
+			place_typed(fit, newSC[i], sc_type(chaininghp, i), -1);
+			place_typed(fit, oldSC[i], sc_type(chaininghp, i), 1);
+		}
+	}
+
+	BeadMeasures measures = linearize_measures(counts, hpSize, anchor->nH);
+	FitnessCalc_count_evaluations(fit, 1);
+	return FitnessCalc_from_measures(fit, measures, newSC);
+}
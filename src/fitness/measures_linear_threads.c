@@ -8,22 +8,33 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <omp.h>
 
 #include "fitness_private.h"
 #include "gyration.h"
 
+#include <heap.h>
+
 #define COORD3D(V, AXIS) COORD(V.x, V.y, V.z, AXIS)
 #define COORD(X, Y, Z, AXIS) ( (Z+AXIS/2) * (AXIS*(long int)AXIS) + (Y+AXIS/2) * ((long int)AXIS) + (X+AXIS/2))
 
-static FitnessCalc *FIT_BUNDLE = NULL;
+/** Lattice and scratch memory of one thread of the team. */
+typedef struct {
+	char *space3d;
+	int axisSize;
+	ScratchArena *scratch;
+} ThreadLattice;
 
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
-	if(FIT_BUNDLE != NULL){
-		fprintf(stderr, "%s", "Double initialization.\n");
-		exit(EXIT_FAILURE);
-	}
+/** Backend state of a FitnessCalc: the lattice of each thread of its team.
+ * The scratch of the FitnessCalc is the one of thread 0.
+ */
+typedef struct FitnessBackend_ {
+	int nThreads;
+	ThreadLattice *threads;
+} LinearThreadsBackend;
 
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
 	int i;
 	int numThreads = omp_get_max_threads();
 	int axisSize = (hpSize+3)*2;
@@ -35,67 +46,58 @@ void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
 		exit(EXIT_FAILURE);
 	}
 
-	// Allocate on bundle for each thread
-	FIT_BUNDLE = (FitnessCalc *) malloc(sizeof(FitnessCalc) * numThreads);
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	fit->axisSize = axisSize;
 
-	// Initialize bundles
-	for(i = 0; i < numThreads; i++){
-		FIT_BUNDLE[i].chaininghp  = chaininghp;
-		FIT_BUNDLE[i].hpSize   = hpSize;
-		FIT_BUNDLE[i].axisSize = axisSize;
-	}
+	// This backend has always truncated the maximum gyration
+	fit->maxGyration = (int) fit->maxGyration;
 
-	// Keep initializing bundles
-	const int gyration = calc_max_gyration(chaininghp, hpSize);
+	// Allocate one lattice for each thread
+	LinearThreadsBackend *backend = heap_alloc(sizeof(LinearThreadsBackend));
+	backend->nThreads = numThreads;
+	backend->threads = heap_alloc(sizeof(ThreadLattice) * numThreads);
 	for(i = 0; i < numThreads; i++){
-		FIT_BUNDLE[i].maxGyration = gyration;
+		backend->threads[i].space3d  = heap_calloc(spaceSize, sizeof(char));
+		backend->threads[i].axisSize = axisSize;
+		backend->threads[i].scratch  = scratch_create(SCRATCH_SIZE(hpSize));
 	}
 
-	// Final initialization
-	for(i = 0; i < numThreads; i++){
-		FIT_BUNDLE[i].space3d = (void *) malloc(spaceSize * sizeof(char));
-		if(FIT_BUNDLE[i].space3d == NULL){
-			fprintf(stderr, "Malloc returned error when allocating memory! Attempted to allocate %lf GiB\n", numThreads * spaceSize * sizeof(char) / 1024.0 / 1024.0 / 1024.0);
-		}
-	}
+	fit->backend = backend;
+	fit->scratch = backend->threads[0].scratch;
+	return fit;
 }
 
-void FitnessCalc_cleanup(){
+void FitnessCalc_destroy(FitnessCalc *fit){
 	int i;
-	int numThreads = omp_get_max_threads();
-	
-	for(i = 0; i < numThreads; i++){
-		free(FIT_BUNDLE[i].space3d);
+	LinearThreadsBackend *backend = fit->backend;
+
+	for(i = 0; i < backend->nThreads; i++){
+		free(backend->threads[i].space3d);
+		scratch_destroy(backend->threads[i].scratch);
 	}
 
-	free(FIT_BUNDLE);
-	FIT_BUNDLE = NULL;
+	free(backend->threads);
+	free(backend);
+	free(fit);
 }
 
-/* Returns the FitnessCalc
+/* This backend has no incremental evaluation, the candidate is evaluated from scratch.
  */
-FitnessCalc FitnessCalc_get(){
-	if(FIT_BUNDLE == NULL){
-		fprintf(stderr, "%s", "FitnessCalc must be initialized.\n");
-		exit(EXIT_FAILURE);
-	}
-	return FIT_BUNDLE[0];
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	return FitnessCalc_run2(fit, chain);
 }
 
 
 
 
 /* Counts the number of collision within a vector of beads
- * 'space3d' is 3D lattice whose axis has size axisSize (positive + negative sides of the axis).
  */
 static
-int count_collisions(int tid, const numtrd *beads, int nBeads){
+int count_collisions(ThreadLattice *lattice, const numtrd *beads, int nBeads){
 	int i, collisions;
+	char *space3d = lattice->space3d;
+	int axisSize = lattice->axisSize;
 
-	// Get space3d associated with that thread
-	char *space3d = FIT_BUNDLE[tid].space3d;
-	int axisSize = FIT_BUNDLE[tid].axisSize;
-	
 	collisions = 0;
 
 	// Reset space
@@ -115,15 +117,12 @@ int count_collisions(int tid, const numtrd *beads, int nBeads){
 }
 
 /* Counts the number of contacts within a vector of beads
- * 'space3d' is 3D lattice whose axis has size axisSize (positive + negative sides of the axis).
  */
 static
-int count_contacts(int tid, const numtrd *beads, int nBeads){
+int count_contacts(ThreadLattice *lattice, const numtrd *beads, int nBeads){
 	int i;
-
-	// Get space3d associated with that thread
-	char *space3d = FIT_BUNDLE[tid].space3d;
-	int axisSize = FIT_BUNDLE[tid].axisSize;
+	char *space3d = lattice->space3d;
+	int axisSize = lattice->axisSize;
 
 	int contacts = 0;
 	
@@ -159,23 +158,32 @@ int count_contacts(int tid, const numtrd *beads, int nBeads){
 	return contacts / 2;
 }
 
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+/* Calculates the measures of a protein of 'fit'.
+ * If 'parallel' is true, the seven counts are spread over the threads of a new parallel region.
+ * Otherwise they are all done by the calling thread, whose id is 'tid'.
+ */
+static
+BeadMeasures split_measures(FitnessCalc *fit, int tid, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize, bool parallel){
 	int i;
+	LinearThreadsBackend *backend = fit->backend;
+
+	// Create vectors with desired coordinates of beads, in the scratch arena
+	ScratchArena *scratch = backend->threads[tid].scratch;
+	size_t mark = scratch_mark(scratch);
 
-	// Create vectors with desired coordinates of beads
-	numtrd *coordsAll = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsAll = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeAll = 0;
-	numtrd *coordsBB  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsBB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeBB  = 0;
-	numtrd *coordsHB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsHB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeHB  = 0;
-	numtrd *coordsPB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsPB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizePB  = 0;
-	numtrd *coordsHH  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHH  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHH  = 0;
-	numtrd *coordsHP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHP  = 0;
-	numtrd *coordsPP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsPP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizePP  = 0;
 
 	for(i = 0; i < hpSize; i++){
@@ -199,36 +207,42 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 
 	BeadMeasures retval;
 
-	#pragma omp parallel for schedule(dynamic, 1)
+	#pragma omp parallel for schedule(dynamic, 1) if(parallel) num_threads(backend->nThreads)
 	for(i = 0; i < 7; i++){
-		int tid = omp_get_thread_num();
+		ThreadLattice *lattice = &backend->threads[parallel ? omp_get_thread_num() : tid];
 
 		switch(i){
 		case 0:
-			retval.hh = count_contacts(tid, coordsHH, sizeHH);
+			retval.hh = count_contacts(lattice, coordsHH, sizeHH);
 			break;
 		case 1:
-			retval.pp = count_contacts(tid, coordsPP, sizePP);
+			retval.pp = count_contacts(lattice, coordsPP, sizePP);
 			break;
 		case 2:
-			retval.hp = count_contacts(tid, coordsHP, sizeHP) - retval.hh - retval.pp; // HP = all - HH - PP
+			retval.hp = count_contacts(lattice, coordsHP, sizeHP);
 			break;
 		case 3:
-			retval.bb = count_contacts(tid, coordsBB, sizeBB);
+			retval.bb = count_contacts(lattice, coordsBB, sizeBB);
 			break;
 		case 4:
-			retval.hb = count_contacts(tid, coordsHB, sizeHB) - retval.hh - retval.bb; // HB = all - HH - BB
+			retval.hb = count_contacts(lattice, coordsHB, sizeHB);
 			break;
 		case 5:
-			retval.pb = count_contacts(tid, coordsPB, sizePB) - retval.pp - retval.bb; // PB = all - PP - BB
+			retval.pb = count_contacts(lattice, coordsPB, sizePB);
 			break;
 		case 6:
-			retval.collisions = count_collisions(tid, coordsAll, sizeAll);
+			retval.collisions = count_collisions(lattice, coordsAll, sizeAll);
 			break;
 		default: break;
 		}
 	}
 
+	// The counts above are of all contacts among the beads of each vector.
+	// They are only separated here, as the tasks may run in any order.
+	retval.hp -= retval.hh + retval.pp; // HP = all - HH - PP
+	retval.hb -= retval.hh + retval.bb; // HB = all - HH - BB
+	retval.pb -= retval.pp + retval.bb; // PB = all - PP - BB
+
 	// Remove the trivial contacts
 	retval.bb -= (hpSize - 1);
 	retval.hb -= (sizeHH);
@@ -243,13 +257,37 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 	retval.pb = sqrt(retval.pb);
 	retval.collisions = sqrt(retval.collisions);
 
-	free(coordsAll);
-	free(coordsBB);
-	free(coordsHB);
-	free(coordsPB);
-	free(coordsHH);
-	free(coordsHP);
-	free(coordsPP);
+	scratch_release(scratch, mark);
 
 	return retval;
 }
+
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	return split_measures(fit, 0, BBbeads, SCbeads, chaininghp, hpSize, true);
+}
+
+void FitnessCalc_run_batch_delta(FitnessCalc *fit, const shiftmel **parents, const shiftmel **chains, const int *pos, int n, double *out){
+	int i;
+	int hpSize = fit->hpSize;
+	const HPElem *chaininghp = fit->chaininghp;
+	LinearThreadsBackend *backend = fit->backend;
+
+	// This backend has no incremental evaluation, so 'parents' is not needed.
+	// Whole proteins are spread over the threads, each using its own lattice.
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(backend->nThreads)
+	for(i = 0; i < n; i++){
+		int tid = omp_get_thread_num();
+		ScratchArena *scratch = backend->threads[tid].scratch;
+		size_t mark = scratch_mark(scratch);
+		numtrd *coordsBB = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
+		numtrd *coordsSC = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
+
+		migrch_fill_3d(chains[i], hpSize - 1, coordsBB, coordsSC);
+		BeadMeasures measures = split_measures(fit, tid, coordsBB, coordsSC, chaininghp, hpSize, false);
+		out[i] = FitnessCalc_from_measures(fit, measures, coordsSC);
+
+		scratch_release(scratch, mark);
+	}
+
+	FitnessCalc_count_evaluations(fit, n);
+}
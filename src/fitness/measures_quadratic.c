@@ -12,26 +12,23 @@
 #include "fitness_private.h"
 #include "gyration.h"
 
-static FitnessCalc FIT_BUNDLE = {0, 0, NULL, 0, 0};
-
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
-	FIT_BUNDLE.chaininghp = chaininghp;
-	FIT_BUNDLE.hpSize = hpSize;
-	FIT_BUNDLE.maxGyration = calc_max_gyration(chaininghp, hpSize);
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	fit->scratch = scratch_create(SCRATCH_SIZE(hpSize));
+	return fit;
 }
 
-void FitnessCalc_cleanup(){
-	return;
+void FitnessCalc_destroy(FitnessCalc *fit){
+	scratch_destroy(fit->scratch);
+	free(fit);
 }
 
-/* Returns the FitnessCalc
+/* This backend has no incremental evaluation, the candidate is evaluated from scratch.
  */
-FitnessCalc FitnessCalc_get(){
-	return FIT_BUNDLE;
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	return FitnessCalc_run2(fit, chain);
 }
 
-
-
 /* Counts the number of conflicts among the protein beads.
  */
 static
@@ -72,23 +69,26 @@ int count_contacts(const numtrd *beads, int nBeads){
 	return contacts;
 }
 
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
 	int i;
 
-	// Create vectors with desired coordinates of beads
-	numtrd *coordsAll = malloc(sizeof(numtrd) * hpSize * 2);
+	// Create vectors with desired coordinates of beads, in the scratch arena
+	ScratchArena *scratch = fit->scratch;
+	size_t mark = scratch_mark(scratch);
+
+	numtrd *coordsAll = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeAll = 0;
-	numtrd *coordsBB  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsBB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeBB  = 0;
-	numtrd *coordsHB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsHB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeHB  = 0;
-	numtrd *coordsPB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsPB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizePB  = 0;
-	numtrd *coordsHH  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHH  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHH  = 0;
-	numtrd *coordsHP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHP  = 0;
-	numtrd *coordsPP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsPP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizePP  = 0;
 
 	for(i = 0; i < hpSize; i++){
@@ -134,13 +134,7 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 	retval.pb = sqrt(retval.pb);
 	retval.collisions = sqrt(retval.collisions);
 
-	free(coordsAll);
-	free(coordsBB);
-	free(coordsHB);
-	free(coordsPB);
-	free(coordsHH);
-	free(coordsHP);
-	free(coordsPP);
+	scratch_release(scratch, mark);
 
 	return retval;
 }
@@ -8,27 +8,52 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <omp.h>
 
 #include "fitness_private.h"
 #include "gyration.h"
 
-static FitnessCalc FIT_BUNDLE = {0, 0, NULL, 0, 0};
+#include <heap.h>
 
-void FitnessCalc_initialize(const HPElem * chaininghp, int hpSize){
-	FIT_BUNDLE.chaininghp = chaininghp;
-	FIT_BUNDLE.hpSize = hpSize;
-	FIT_BUNDLE.maxGyration = calc_max_gyration(chaininghp, hpSize);
+/** Backend state of a FitnessCalc: the scratch arena of each thread of its team.
+ * The scratch of the FitnessCalc is the one of thread 0.
+ */
+typedef struct FitnessBackend_ {
+	int nThreads;
+	ScratchArena **scratch;
+} ThreadsBackend;
+
+FitnessCalc *FitnessCalc_create(const HPElem * chaininghp, int hpSize, const EnergyParams *energy){
+	int i;
+	FitnessCalc *fit = FitnessCalc_new(chaininghp, hpSize, energy);
+	ThreadsBackend *backend = heap_alloc(sizeof(ThreadsBackend));
+	fit->backend = backend;
+
+	backend->nThreads = omp_get_max_threads();
+	backend->scratch = heap_alloc(sizeof(ScratchArena *) * backend->nThreads);
+	for(i = 0; i < backend->nThreads; i++)
+		backend->scratch[i] = scratch_create(SCRATCH_SIZE(hpSize));
+	fit->scratch = backend->scratch[0];
+
+	return fit;
 }
 
-void FitnessCalc_cleanup(){
-	return;
+void FitnessCalc_destroy(FitnessCalc *fit){
+	int i;
+	ThreadsBackend *backend = fit->backend;
+
+	for(i = 0; i < backend->nThreads; i++)
+		scratch_destroy(backend->scratch[i]);
+	free(backend->scratch);
+	free(backend);
+	free(fit);
 }
 
-/* Returns the FitnessCalc
+/* This backend has no incremental evaluation, the candidate is evaluated from scratch.
  */
-FitnessCalc FitnessCalc_get(){
-	return FIT_BUNDLE;
+double FitnessCalc_run_delta(FitnessCalc *fit, const shiftmel *parent, const shiftmel *chain, int pos){
+	return FitnessCalc_run2(fit, chain);
 }
 
 
@@ -73,23 +98,30 @@ int count_contacts(const numtrd *beads, int nBeads){
 	return contacts;
 }
 
-BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+/* Calculates the measures of a protein, using the 'scratch' arena of the calling thread.
+ * If 'parallel' is true, the seven counts are spread over the threads of a new parallel region.
+ * Otherwise they are all done by the calling thread.
+ */
+static
+BeadMeasures split_measures(ScratchArena *scratch, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize, bool parallel){
 	int i;
 
-	// Create vectors with desired coordinates of beads
-	numtrd *coordsAll = malloc(sizeof(numtrd) * hpSize * 2);
+	// Create vectors with desired coordinates of beads, in the scratch arena
+	size_t mark = scratch_mark(scratch);
+
+	numtrd *coordsAll = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeAll = 0;
-	numtrd *coordsBB  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsBB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeBB  = 0;
-	numtrd *coordsHB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsHB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizeHB  = 0;
-	numtrd *coordsPB  = malloc(sizeof(numtrd) * hpSize * 2);
+	numtrd *coordsPB  = scratch_alloc(scratch, sizeof(numtrd) * hpSize * 2);
 	int    sizePB  = 0;
-	numtrd *coordsHH  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHH  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHH  = 0;
-	numtrd *coordsHP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsHP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizeHP  = 0;
-	numtrd *coordsPP  = malloc(sizeof(numtrd) * hpSize);
+	numtrd *coordsPP  = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
 	int    sizePP  = 0;
 
 	for(i = 0; i < hpSize; i++){
@@ -113,7 +145,7 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 
 	BeadMeasures retval;
 
-	#pragma omp parallel for schedule(dynamic, 1)
+	#pragma omp parallel for schedule(dynamic, 1) if(parallel)
 	for(i = 0; i < 7; i++){
 		switch(i){
 		case 0:
@@ -123,16 +155,16 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 			retval.pp = count_contacts(coordsPP, sizePP);
 			break;
 		case 2:
-			retval.hp = count_contacts(coordsHP, sizeHP) - retval.hh - retval.pp; // HP = all - HH - PP
+			retval.hp = count_contacts(coordsHP, sizeHP);
 			break;
 		case 3:
 			retval.bb = count_contacts(coordsBB, sizeBB);
 			break;
 		case 4:
-			retval.hb = count_contacts(coordsHB, sizeHB) - retval.hh - retval.bb; // HB = all - HH - BB
+			retval.hb = count_contacts(coordsHB, sizeHB);
 			break;
 		case 5:
-			retval.pb = count_contacts(coordsPB, sizePB) - retval.pp - retval.bb; // PB = all - PP - BB
+			retval.pb = count_contacts(coordsPB, sizePB);
 			break;
 		case 6:
 			retval.collisions = count_collisions(coordsAll, sizeAll);
@@ -141,6 +173,12 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 		}
 	}
 
+	// The counts above are of all contacts among the beads of each vector.
+	// They are only separated here, as the tasks may run in any order.
+	retval.hp -= retval.hh + retval.pp; // HP = all - HH - PP
+	retval.hb -= retval.hh + retval.bb; // HB = all - HH - BB
+	retval.pb -= retval.pp + retval.bb; // PB = all - PP - BB
+
 	// Remove the trivial contacts
 	retval.bb -= (hpSize - 1);
 	retval.hb -= (sizeHH);
@@ -155,13 +193,36 @@ BeadMeasures proteinMeasures(const numtrd *BBbeads, const numtrd *SCbeads, const
 	retval.pb = sqrt(retval.pb);
 	retval.collisions = sqrt(retval.collisions);
 
-	free(coordsAll);
-	free(coordsBB);
-	free(coordsHB);
-	free(coordsPB);
-	free(coordsHH);
-	free(coordsHP);
-	free(coordsPP);
+	scratch_release(scratch, mark);
 
 	return retval;
 }
+
+BeadMeasures proteinMeasures(FitnessCalc *fit, const numtrd *BBbeads, const numtrd *SCbeads, const HPElem *chaininghp, int hpSize){
+	return split_measures(fit->scratch, BBbeads, SCbeads, chaininghp, hpSize, true);
+}
+
+void FitnessCalc_run_batch_delta(FitnessCalc *fit, const shiftmel **parents, const shiftmel **chains, const int *pos, int n, double *out){
+	int i;
+	int hpSize = fit->hpSize;
+	const HPElem *chaininghp = fit->chaininghp;
+	ThreadsBackend *backend = fit->backend;
+
+	// This backend has no incremental evaluation, so 'parents' is not needed.
+	// Whole proteins are spread over the threads, as many as there are scratch arenas.
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(backend->nThreads)
+	for(i = 0; i < n; i++){
+		ScratchArena *scratch = backend->scratch[omp_get_thread_num()];
+		size_t mark = scratch_mark(scratch);
+		numtrd *coordsBB = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
+		numtrd *coordsSC = scratch_alloc(scratch, sizeof(numtrd) * hpSize);
+
+		migrch_fill_3d(chains[i], hpSize - 1, coordsBB, coordsSC);
+		BeadMeasures measures = split_measures(scratch, coordsBB, coordsSC, chaininghp, hpSize, false);
+		out[i] = FitnessCalc_from_measures(fit, measures, coordsSC);
+
+		scratch_release(scratch, mark);
+	}
+
+	FitnessCalc_count_evaluations(fit, n);
+}
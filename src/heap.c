@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "heap.h"
+
+/** Number of allocations made so far. Atomic, as threads may allocate concurrently. */
+static atomic_long N_ALLOCATIONS = 0;
+
+static
+void *check(void *ptr, size_t size){
+	if(ptr == NULL && size > 0){
+		fprintf(stderr, "Failed to allocate %lu bytes.\n", (unsigned long) size);
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+void *heap_alloc(size_t size){
+	atomic_fetch_add(&N_ALLOCATIONS, 1);
+	return check(malloc(size), size);
+}
+
+void *heap_calloc(size_t n, size_t size){
+	atomic_fetch_add(&N_ALLOCATIONS, 1);
+	return check(calloc(n, size), n * size);
+}
+
+long heap_allocations(){
+	return atomic_load(&N_ALLOCATIONS);
+}
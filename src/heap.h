@@ -0,0 +1,21 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+/** \file heap.h Routines for heap allocation, which keep count of the allocations made.
+ *
+ * All heap allocations of the program go through these routines, so that heap_allocations
+ *   can tell whether some part of the program (e.g. the steady-state ABC loop) touched the heap.
+ */
+
+#include <stdlib.h>
+
+/** Same as malloc, but exits on failure and counts the allocation. */
+void *heap_alloc(size_t size);
+
+/** Same as calloc, but exits on failure and counts the allocation. */
+void *heap_calloc(size_t n, size_t size);
+
+/** Returns the number of allocations made so far with heap_alloc and heap_calloc. */
+long heap_allocations();
+
+#endif // HEAP_H
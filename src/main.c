@@ -9,19 +9,7 @@
 #include "fitness/fitness.h"
 #include "abc_alg/abc_alg.h"
 #include "config.h"
-
-#undef MT_GENERATE_CODE_IN_HEADER
-#define MT_GENERATE_CODE_IN_HEADER 0
-#include "twirmt/twirmt.h"
-
-void fixed_seed(int seed){
-	mt_seed32(seed);
-}
-
-// Seeds the mersenne twister random number generator
-void random_seed(){
-	mt_seed();
-}
+#include "random.h"
 
 void print_3d(const shiftmel * migrch, const HPElem * chaininghp, int hpSize, FILE *fp){
 	numtrd *coordsBB, *coordsSC;
@@ -41,44 +29,19 @@ void print_3d(const shiftmel * migrch, const HPElem * chaininghp, int hpSize, FI
 	free(coordsSC);
 }
 
-char validatechaininghp(HPElem *chaininghp){
-	int i;
-	char bad = 1;
-
-	// Verify existence of at least 1 hydrophobic bead
-	for(i = 0; chaininghp[i] != '\0'; i++){
-		if(chaininghp[i] == 'H')
-			bad = 0;
-	}
-	if(bad){
-		// No H beads in the string.
-		return 1;
-	}
-
-	// Verify if all characters are either H or P
-	int nH = 0;
-	int nP = 0;
-	int n  = 0;
-	for(i = 0; chaininghp[i] != '\0'; i++){
-		n++;
-		if(chaininghp[i] == 'H') nH++;
-		if(chaininghp[i] == 'P') nP++;
-	}
-	if(nH + nP == n){
-		// Success
-		return 0;
-	} else {
-		// Weird characters in the string.
-		return 2;
-	}
-}
-
 int main(int argc, char *argv[]){
 	if(argc == 2 && strcmp(argv[1], "-h") == 0){
-		fprintf(stderr, "Usage: %s [HP_Sequence] [num_cycles] [output file]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [--resume] [HP_Sequence] [num_cycles] [output file]\n", argv[0]);
 		return 1;
 	}
 
+	// Continues an interrupted run from its checkpoint (see CHECKPOINT_INTERVAL)
+	bool resume = argc > 1 && strcmp(argv[1], "--resume") == 0;
+	if(resume){
+		argc--;
+		argv++;
+	}
+
 	// Initialize configuration variables
 	initialize_configuration();
 
@@ -88,14 +51,11 @@ int main(int argc, char *argv[]){
 	int   nCycles  = argc >= 3 ? atoi(argv[2]) : N_CYCLES;
 	char *outFile  = argc >= 4 ? argv[3]       : "output.txt";
 
-	if(RANDOM_SEED < 0){
-		random_seed();
-	} else {
-		fixed_seed(RANDOM_SEED);
-	}
+	// Seeds the mersenne twister random number generator, randomly if RANDOM_SEED is negative
+	random_initialize(RANDOM_SEED);
 
 	// Validate HP Chain
-	if(validatechaininghp(chaininghp) != 0){
+	if(chaininghp_validate(chaininghp) != 0){
 		fprintf(stderr, "Invalid HP Chain given: %s.\n"
 		                "Chain must consist only of 'H' and 'P' characters.\n"
 		                "Chain must also have at least 1 'H' bead.\n", argv[1]);
@@ -106,8 +66,15 @@ int main(int argc, char *argv[]){
 	struct timespec wall_beg, wall_end;
 	clock_gettime(CLOCK_REALTIME, &wall_beg);
 
+	EnergyParams energy = configuration_energy();
+	PredictionContext *ctx = PredictionContext_create(chaininghp, hpSize, &energy);
+	if(CHECKPOINT_INTERVAL > 0 || resume)
+		ctx->checkpointFile = CHECKPOINT_FILE;
+	ctx->checkpointInterval = CHECKPOINT_INTERVAL;
+	ctx->resume = resume;
+
 	PredResults results;
-	Solution sol = ABC_predict_structure(chaininghp, hpSize, nCycles, &results);
+	Solution sol = ABC_predict_structure(ctx, nCycles, &results);
 
 	double clk_time = (clock() - clk_beg) / (double) CLOCKS_PER_SEC;
 	clock_gettime(CLOCK_REALTIME, &wall_end);
@@ -125,9 +92,11 @@ int main(int argc, char *argv[]){
 		print_3d(Solution_chain(sol), chaininghp, hpSize, fp);
 
 		fclose(fp);
-		Solution_free(sol);
 	}
 
+	Solution_free(NULL, sol);
+	PredictionContext_destroy(ctx);
+
 	if(freeChain)
 		free(chaininghp);
 
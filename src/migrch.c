@@ -6,13 +6,14 @@
 #include "shiftmel.h"
 #include "numtrd.h"
 #include "random.h"
+#include "heap.h"
 
 void migrch_set_element(shiftmel * chain, int eleIdx, unsigned char bb, unsigned char sc){
 	chain[eleIdx] = shiftmel_make(bb, sc);
 }
 
 shiftmel * migrch_create(int size){
-	shiftmel * chain = malloc(sizeof(shiftmel) * size);
+	shiftmel * chain = heap_alloc(sizeof(shiftmel) * size);
 	int i;
 	for(i = 0; i < size; i++)
 		migrch_set_element(chain, i, FRONT, RIGHT);
@@ -20,55 +21,74 @@ shiftmel * migrch_create(int size){
 	return chain;
 }
 
-// Given a predecessor vector and a movement, applies such
-//   movement in the predecessor vector and returns the result.
+/* Unit vectors are represented by direction indices, so that placing a bead takes table
+ *   lookups instead of branches.
+ */
+enum _Directions { X_POS = 0, X_NEG, Y_POS, Y_NEG, Z_POS, Z_NEG };
+
+// Unit vector of each direction.
+static const numtrd DIR_VEC[6] = {
+	{ 1, 0, 0}, {-1, 0, 0},
+	{ 0, 1, 0}, { 0,-1, 0},
+	{ 0, 0, 1}, { 0, 0,-1},
+};
+
+// NEXT_DIR[pred][movement] is the direction resulting from applying 'movement'
+//   (FRONT, LEFT, RIGHT, UP, DOWN) to a predecessor vector with direction 'pred'.
+// FRONT keeps the direction. Otherwise, UP/DOWN fill the first coordinate other than the
+//   predecessor's axis, and RIGHT/LEFT fill the second one.
+static const unsigned char NEXT_DIR[6][5] = {
+	/*          FRONT  LEFT   RIGHT  UP     DOWN  */
+	/* X_POS */ {X_POS, Z_NEG, Z_POS, Y_POS, Y_NEG},
+	/* X_NEG */ {X_NEG, Z_NEG, Z_POS, Y_POS, Y_NEG},
+	/* Y_POS */ {Y_POS, Z_NEG, Z_POS, X_POS, X_NEG},
+	/* Y_NEG */ {Y_NEG, Z_NEG, Z_POS, X_POS, X_NEG},
+	/* Z_POS */ {Z_POS, Y_NEG, Y_POS, X_POS, X_NEG},
+	/* Z_NEG */ {Z_NEG, Y_NEG, Y_POS, X_POS, X_NEG},
+};
+
+// Returns the direction index of unit vector 'vec'.
 static inline
-numtrd getNext(numtrd pred, unsigned int movement){
-	int *first, *second;
-	numtrd result;
-
-	result = numtrd_make(0, 0, 0);
-
-	// Get first and second filled coordinates
-	if(pred.x != 0){
-		first = &result.y;
-		second = &result.z;
-	} else if(pred.y != 0) {
-		first = &result.x;
-		second = &result.z;
-	} else /* z != 0 */ {
-		first = &result.x;
-		second = &result.y;
-	}
-
-	// Make the movement
-	if(movement == FRONT){
-		result = pred;
-	} else if(movement == UP) {
-		*first = 1; // fill first filled coordinate positively
-	} else if(movement == DOWN) {
-		*first = -1;
-	} else if(movement == RIGHT) {
-		*second = 1;
-	} else /* movement == RIGHT */ {
-		*second = -1;
-	}
-
-	return result;
+int direction_of(numtrd vec){
+	if(vec.x != 0) return vec.x > 0 ? X_POS : X_NEG;
+	if(vec.y != 0) return vec.y > 0 ? Y_POS : Y_NEG;
+	return vec.z > 0 ? Z_POS : Z_NEG;
 }
 
-void migrch_build_3d(const shiftmel * chain,
+// Places the beads with index in [first, chainSize], given that all beads before
+//   'first' are already placed and 'predDir' is the direction of the backbone vector arriving at bead first-1.
+static inline
+void build_from(const shiftmel * chain,
 	int chainSize,
-	numtrd **coordsBB_p,
-	numtrd **coordsSC_p
+	int first,
+	int predDir,
+	numtrd *coordsBB,
+	numtrd *coordsSC
 ){
-	numtrd *coordsBB;
-	numtrd *coordsSC;
+	// There should be N+1 beads and N chain elements
+	int i;
+	numtrd prevBead = coordsBB[first-1];
+	for(i = first; i <= chainSize; i++){ // i represents index of current bead being added
+		shiftmel elem = chain[i-1];
 
-	// Allocate sufficient space for the coordinates
-	coordsBB = malloc(sizeof(numtrd) * (chainSize + 1));
-	coordsSC = malloc(sizeof(numtrd) * (chainSize + 1));
+		// Backbone direction, which is the predecessor for the side chain and the next element
+		int bbDir = NEXT_DIR[predDir][shiftmel_getBB(elem)];
+		int scDir = NEXT_DIR[bbDir][shiftmel_getSC(elem)];
+
+		// Add next backbone and side chain beads
+		prevBead = numtrd_add(prevBead, DIR_VEC[bbDir]);
+		coordsBB[i] = prevBead;
+		coordsSC[i] = numtrd_add(prevBead, DIR_VEC[scDir]);
 
+		predDir = bbDir;
+	}
+}
+
+void migrch_fill_3d(const shiftmel * chain,
+	int chainSize,
+	numtrd *coordsBB,
+	numtrd *coordsSC
+){
 	// Add initial BB
 	// As a convention, the first backbone beads are at (1, 0, 0) and (2, 0, 0).
 	coordsBB[0] = numtrd_make(1, 0, 0);
@@ -81,46 +101,51 @@ void migrch_build_3d(const shiftmel * chain,
 	unsigned char mov1 = shiftmel_getBB(elem);
 	unsigned char mov2 = shiftmel_getSC(elem);
 
-	// predecessor vector and displacement vector
-	numtrd predVec, dispVec;
-
 	// Add SC beads.
 	// First predecessor vector is (-1, 0, 0) from BB[1] to BB[0].
 	// Second is (1, 0, 0) from BB[0] to BB[1]. 
-	coordsSC[0] = numtrd_add(getNext(numtrd_make(-1, 0, 0), mov1), coordsBB[0]);
-	predVec = numtrd_make(1, 0, 0); // Will feed the loop as the first predecessor vector
-	coordsSC[1] = numtrd_add(getNext(predVec, mov2), coordsBB[1]);
+	coordsSC[0] = numtrd_add(DIR_VEC[NEXT_DIR[X_NEG][mov1]], coordsBB[0]);
+	coordsSC[1] = numtrd_add(DIR_VEC[NEXT_DIR[X_POS][mov2]], coordsBB[1]);
 
 	// Iterate over the chain
-	// There should be N+1 beads and N chain elements
-	int i;
-	for(i = 2; i <= chainSize; i++){ // i represents index of current bead being added
-		shiftmel elem = chain[i-1];
-		mov1 = shiftmel_getBB(elem);
-		mov2 = shiftmel_getSC(elem);
-
-		// Get displacement vector for backbone
-		dispVec = getNext(predVec, mov1);
-
-		// Add next backbone bead
-		numtrd nextBead = numtrd_add(dispVec, coordsBB[i-1]);
-		coordsBB[i] = nextBead;
+	// (1, 0, 0) will feed the loop as the first predecessor vector
+	build_from(chain, chainSize, 2, X_POS, coordsBB, coordsSC);
+}
 
-		// Update predecessor vector
-		predVec = dispVec;
+void migrch_build_3d(const shiftmel * chain,
+	int chainSize,
+	numtrd **coordsBB_p,
+	numtrd **coordsSC_p
+){
+	// Allocate sufficient space for the coordinates
+	numtrd *coordsBB = heap_alloc(sizeof(numtrd) * (chainSize + 1));
+	numtrd *coordsSC = heap_alloc(sizeof(numtrd) * (chainSize + 1));
 
-		// Get displacement vector for side chain
-		dispVec = getNext(predVec, mov2);
+	migrch_fill_3d(chain, chainSize, coordsBB, coordsSC);
 
-		// Add next sidechain bead
-		nextBead = numtrd_add(dispVec, coordsBB[i]);
-		coordsSC[i] = nextBead;
+	*coordsBB_p = coordsBB;
+	*coordsSC_p = coordsSC;
+}
 
-		// Predecessor vector is kept for next iteration.
+void migrch_rebuild_3d(const shiftmel * chain,
+	int chainSize,
+	int pos,
+	numtrd *coordsBB,
+	numtrd *coordsSC
+){
+	if(pos == 0){
+		// The first element only holds the directions of the first 2 SC's.
+		shiftmel elem = chain[0];
+		coordsSC[0] = numtrd_add(DIR_VEC[NEXT_DIR[X_NEG][shiftmel_getBB(elem)]], coordsBB[0]);
+		coordsSC[1] = numtrd_add(DIR_VEC[NEXT_DIR[X_POS][shiftmel_getSC(elem)]], coordsBB[1]);
+		return;
 	}
 
-	*coordsBB_p = coordsBB;
-	*coordsSC_p = coordsSC;
+	// Element 'pos' places bead pos+1, arriving from bead pos.
+	numtrd predVec = numtrd_make(coordsBB[pos].x - coordsBB[pos-1].x,
+	                             coordsBB[pos].y - coordsBB[pos-1].y,
+	                             coordsBB[pos].z - coordsBB[pos-1].z);
+	build_from(chain, chainSize, pos + 1, direction_of(predVec), coordsBB, coordsSC);
 }
 
 /* DEBUGGING PROCEDURES
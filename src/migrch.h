@@ -29,5 +29,25 @@ void migrch_build_3d(const shiftmel * chain, // input
 	numtrd **coordsSC_p  // output
 );
 
+/** Same as migrch_build_3d, but the coordinates are stored in 'coordsBB' and 'coordsSC', which
+ *   must have room for chainSize+1 beads each. No memory is allocated.
+ */
+void migrch_fill_3d(const shiftmel * chain, // input
+	int chainSize,    // input
+	numtrd *coordsBB, // output
+	numtrd *coordsSC  // output
+);
+
+/** Updates the spatial positions built by migrch_build_3d after element 'pos' of 'chain' changed.
+ * 'coordsBB' and 'coordsSC' must hold the coordinates of the chain as it was before the change.
+ * Only the beads placed by element 'pos' and the ones following them are recomputed.
+ */
+void migrch_rebuild_3d(const shiftmel * chain, // input
+	int chainSize,    // input
+	int pos,          // input
+	numtrd *coordsBB, // input and output
+	numtrd *coordsSC  // input and output
+);
+
 
 #endif // migrch_H
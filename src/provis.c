@@ -0,0 +1,43 @@
+#include <string.h>
+
+#include "provis.h"
+#include "chaininghp.h"
+#include "config.h"
+#include "random.h"
+#include "heap.h"
+
+// Documented in header file
+bool Provis_initialize(const char *configFile){
+	bool ok = configFile == NULL || configuration_load(configFile);
+	random_initialize(RANDOM_SEED);
+	return ok;
+}
+
+// Documented in header file
+int Provis_predict(const HPElem *chaininghp, int nCycles, int seed, const EnergyParams *energy,
+                   PredResults *results, shiftmel *chain, numtrd *coordsBB, numtrd *coordsSC){
+	int hpSize = strlen(chaininghp);
+	if(hpSize < 2 || chaininghp_validate(chaininghp) != 0)
+		return PROVIS_INVALID_CHAIN;
+
+	EnergyParams configEnergy = configuration_energy();
+	PredictionContext *ctx = PredictionContext_create(chaininghp, hpSize, energy ? energy : &configEnergy);
+	if(seed >= 0)
+		ctx->seed = seed;
+
+	Solution sol = ABC_predict_structure(ctx, nCycles, results);
+
+	if(chain)
+		memcpy(chain, Solution_chain(sol), sizeof(shiftmel) * (hpSize - 1));
+
+	// The coordinates are built in pairs, so a missing buffer is replaced by a scratch one
+	if(coordsBB || coordsSC){
+		numtrd *scratch = coordsBB && coordsSC ? NULL : heap_alloc(sizeof(numtrd) * hpSize);
+		migrch_fill_3d(Solution_chain(sol), hpSize - 1, coordsBB ? coordsBB : scratch, coordsSC ? coordsSC : scratch);
+		free(scratch);
+	}
+
+	Solution_free(NULL, sol);
+	PredictionContext_destroy(ctx);
+	return PROVIS_OK;
+}
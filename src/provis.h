@@ -0,0 +1,54 @@
+#ifndef PROVIS_H
+#define PROVIS_H
+
+/** \file provis.h Public header of libprovis, with which other programs predict protein structures
+ *   in their own process, instead of running one of the executables per protein.
+ *
+ * The library is the sequential build, with the hashed fitness backend. Programs compile with
+ *   '-I src' and link with 'libprovis.a -fopenmp -lm', or with 'libprovis.so'.
+ *
+ * Provis_predict folds a protein and writes the results in buffers of the caller. The routines it
+ *   is made of may also be called directly:
+ *
+ *   PredictionContext_create, ABC_predict_structure, PredictionContext_destroy  (abc_alg.h)
+ *   FitnessCalc_create, FitnessCalc_run2, FitnessCalc_measures, FitnessCalc_destroy  (fitness.h),
+ *     to evaluate structures found elsewhere
+ *   migrch_fill_3d  (migrch.h), to get the coordinates of the beads of a movement chain
+ *
+ * All of them are reentrant, so different threads may fold different proteins at the same time.
+ * Only Provis_initialize is not, and it must be called once before anything else.
+ */
+
+#include <abc_alg/abc_alg.h>
+#include <fitness/fitness.h>
+#include <migrch.h>
+
+/** @{ */
+/** Values returned by Provis_predict. */
+#define PROVIS_OK            0 /**< The protein was folded */
+#define PROVIS_INVALID_CHAIN 1 /**< The chain has less than 2 beads, no 'H', or characters other than 'H' and 'P' */
+/** @} */
+
+/** Sets up the library with the configuration in 'configFile', which has the format of configuration.yml,
+ *   and seeds it with the RANDOM_SEED in it.
+ * If 'configFile' is NULL, the defaults of config.c are used, with a random seed.
+ * Returns false if 'configFile' could not be read.
+ */
+bool Provis_initialize(const char *configFile);
+
+/** Folds protein 'chaininghp' with 'nCycles' cycles of the ABC algorithm.
+ * The energy is 'energy', or the one of the configuration if 'energy' is NULL. The search draws
+ *   from random streams derived from 'seed', or from the seed of the library if 'seed' is negative,
+ *   so the same seed gives the same structure.
+ *
+ * Results are written in the following buffers, any of which may be NULL:
+ *   results            fitness and measures of the structure found
+ *   chain              its hpSize-1 movements
+ *   coordsBB, coordsSC coordinates of its hpSize backbone and side-chain beads
+ *
+ * Returns PROVIS_OK, or PROVIS_INVALID_CHAIN without writing anything.
+ */
+int Provis_predict(const HPElem *chaininghp, int nCycles, int seed, const EnergyParams *energy,
+                   PredResults *results, shiftmel *chain, numtrd *coordsBB, numtrd *coordsSC);
+
+#endif // PROVIS_H
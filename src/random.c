@@ -1,3 +1,36 @@
 
 #define RANDOM_SOURCE_CODE
 #include "random.h"
+
+/** Seed given to random_initialize, from which the seeds of the streams are derived. */
+static uint32_t BASE_SEED = 0;
+
+// Documented in header file
+void random_initialize(int seed){
+	if(seed < 0){
+		BASE_SEED = mt_seed();
+	} else {
+		random_set_base_seed(seed);
+	}
+}
+
+// Documented in header file
+void random_set_base_seed(uint32_t seed){
+	BASE_SEED = seed;
+	mt_seed32(seed);
+}
+
+// Documented in header file
+uint32_t random_base_seed(){
+	return BASE_SEED;
+}
+
+// Documented in header file
+void random_seed_stream(mt_state *rng, int streamId){
+	random_seed_stream_from(rng, BASE_SEED, streamId);
+}
+
+// Documented in header file
+void random_seed_stream_from(mt_state *rng, uint32_t baseSeed, int streamId){
+	mts_seed32new(rng, baseSeed + streamId);
+}
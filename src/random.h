@@ -1,7 +1,12 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
-/** \file random.h Routines for random number generation. */
+/** \file random.h Routines for random number generation.
+ *
+ * Numbers can either be drawn from the global generator (drandom_x, urandom_max), or from
+ *   an independent stream (drandom_r, urandom_max_r), so that each thread or hive can draw
+ *   numbers without sharing state with the others.
+ */
 
 #undef MT_GENERATE_CODE_IN_HEADER
 #define MT_GENERATE_CODE_IN_HEADER 0
@@ -13,6 +18,29 @@
 	#define RANDOM_INLINE extern inline
 #endif
 
+/** Seeds the global generator with 'seed', or with a random seed if 'seed' is negative.
+ * Streams seeded afterwards with random_seed_stream derive their seeds from it.
+ */
+void random_initialize(int seed);
+
+/** Seeds the global generator with 'seed', and makes it the seed from which streams derive theirs.
+ * Lets processes that must draw the same streams agree on a seed chosen by one of them.
+ */
+void random_set_base_seed(uint32_t seed);
+
+/** Returns the seed from which the seeds of the streams are derived. */
+uint32_t random_base_seed();
+
+/** Seeds 'rng' as the stream number 'streamId' (e.g. a thread id or a hive id).
+ * The seed is the one given to random_initialize plus 'streamId', so streams are reproducible.
+ */
+void random_seed_stream(mt_state *rng, int streamId);
+
+/** Same as random_seed_stream, but deriving the seed from 'baseSeed' instead of the one given to
+ *   random_initialize, so that callers running at the same time may use different seeds.
+ */
+void random_seed_stream_from(mt_state *rng, uint32_t baseSeed, int streamId);
+
 /** Returns a random double within [0,1) */
 RANDOM_INLINE
 double drandom_x(){
@@ -25,4 +53,16 @@ unsigned int urandom_max(unsigned int max){
 	return drandom_x() * max;
 }
 
+/** Returns a random double within [0,1), drawn from stream 'rng' */
+RANDOM_INLINE
+double drandom_r(mt_state *rng){
+	return mts_drand(rng);
+}
+
+/** Returns an unsigned integer within [0,max), drawn from stream 'rng' */
+RANDOM_INLINE
+unsigned int urandom_max_r(mt_state *rng, unsigned int max){
+	return drandom_r(rng) * max;
+}
+
 #endif // RANDOM_H
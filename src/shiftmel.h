@@ -45,10 +45,10 @@ shiftmel shiftmel_make(unsigned char bb, unsigned char sc){
 	return (bb << 4) | sc;
 }
 
-/** Returns a uniformly random shiftmel. */
+/** Returns a uniformly random shiftmel, drawn from random stream 'rng'. */
 shiftmel_INLINE
-shiftmel shiftmel_random(){
-	return shiftmel_make(urandom_max(DOWN+1), urandom_max(DOWN+1));
+shiftmel shiftmel_random(mt_state *rng){
+	return shiftmel_make(urandom_max_r(rng, DOWN+1), urandom_max_r(rng, DOWN+1));
 }
 
 /** Returns the movement for the backbone (BB) stored in a shiftmel. */
@@ -1,3 +1,74 @@
-
 #define SOLUTION_SOURCE_CODE
 #include "solution.h"
+
+#include <heap.h>
+
+/** A single block of 'capacity' chains of 'stride' bytes each.
+ * Free chains are linked through their first bytes, so allocating and freeing are O(1).
+ */
+struct ChainSlab_ {
+	char *base;     /**< First byte of the block */
+	char *end;      /**< One past the last byte of the block */
+	size_t stride;  /**< Distance between consecutive chains */
+	void *freeList; /**< First free chain, or NULL if the slab is full */
+};
+
+// Documented in header file
+ChainSlab *ChainSlab_create(int hpSize, int capacity){
+	ChainSlab *slab = heap_alloc(sizeof(ChainSlab));
+
+	// Each chain must be able to hold the free-list link, and links must be aligned
+	size_t stride = sizeof(shiftmel) * (hpSize - 1);
+	if(stride < sizeof(void *))
+		stride = sizeof(void *);
+	stride = (stride + 7) & ~(size_t) 7;
+
+	slab->stride = stride;
+	slab->base = heap_alloc(stride * capacity);
+	slab->end = slab->base + stride * capacity;
+
+	// Thread all chains into the free list
+	int i;
+	slab->freeList = NULL;
+	for(i = capacity - 1; i >= 0; i--){
+		void **chain = (void **) (slab->base + stride * i);
+		*chain = slab->freeList;
+		slab->freeList = chain;
+	}
+
+	return slab;
+}
+
+// Documented in header file
+void ChainSlab_destroy(ChainSlab *slab){
+	free(slab->base);
+	free(slab);
+}
+
+// Documented in header file
+bool ChainSlab_fits(const ChainSlab *slab, int hpSize){
+	return slab->stride >= sizeof(shiftmel) * (hpSize - 1);
+}
+
+// Documented in header file
+shiftmel *Solution_chain_alloc(ChainSlab *slab, int hpSize){
+	if(slab && slab->freeList){
+		void **chain = slab->freeList;
+		slab->freeList = *chain;
+		return (shiftmel *) chain;
+	}
+
+	return heap_alloc(sizeof(shiftmel) * (hpSize - 1));
+}
+
+// Documented in header file
+void Solution_chain_free(ChainSlab *slab, shiftmel *chain){
+	char *ptr = (char *) chain;
+
+	if(slab && ptr >= slab->base && ptr < slab->end){
+		*(void **) chain = slab->freeList;
+		slab->freeList = chain;
+	} else {
+		free(chain);
+	}
+}
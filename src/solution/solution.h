@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <assert.h>
 
 #include <fitness/fitness.h>
 #include <shiftmel.h>
@@ -23,55 +24,84 @@
 
 typedef struct Solution_ Solution;
 
-/** Returns a Solution whose fields are all uninitialized, but with due memory allocated. */
+/** Fixed-stride slab from which the movement chains of solutions are allocated. */
+typedef struct ChainSlab_ ChainSlab;
+
+/** Creates a slab with room for 'capacity' movement chains of a protein with 'hpSize' beads. */
+ChainSlab *ChainSlab_create(int hpSize, int capacity);
+
+/** Frees the slab. Chains still allocated from it become invalid. */
+void ChainSlab_destroy(ChainSlab *slab);
+
+/** Returns whether the chains of 'slab' can hold the movement chain of a protein with 'hpSize' beads,
+ *   i.e. whether it was created for proteins at least as long.
+ */
+bool ChainSlab_fits(const ChainSlab *slab, int hpSize);
+
+/** Allocates a movement chain for a protein with 'hpSize' beads, from 'slab'.
+ * The chain comes from the heap if 'slab' is NULL or full.
+ * A slab must only be used by one thread at a time.
+ */
+shiftmel *Solution_chain_alloc(ChainSlab *slab, int hpSize);
+
+/** Frees a movement chain allocated by Solution_chain_alloc with the same 'slab'. */
+void Solution_chain_free(ChainSlab *slab, shiftmel *chain);
+
+/** Returns a Solution whose fields are all uninitialized, but with its chain allocated from 'slab'. */
 SOLUTION_INLINE
-Solution Solution_blank(int hpSize){
+Solution Solution_blank(ChainSlab *slab, int hpSize){
 	Solution retval;
-	retval.chain = malloc(sizeof(shiftmel) * (hpSize - 1));
+	retval.chain = Solution_chain_alloc(slab, hpSize);
 	retval.fitness = FITNESS_MIN;
+	retval.evaluated = false;
 	retval.idle_iterations = 0;
+	retval.perturbed_pos = -1;
 	return retval;
 }
 
-/** Returns a deep copy (all memory recursively duplicated) of the given solution. */
+/** Returns a deep copy (all memory recursively duplicated) of the given solution, with its chain from 'slab'. */
 SOLUTION_INLINE
-Solution Solution_copy(Solution sol, int hpSize){
+Solution Solution_copy(ChainSlab *slab, Solution sol, int hpSize){
 	Solution retval;
 	retval.fitness = sol.fitness;
+	retval.evaluated = sol.evaluated;
 	retval.idle_iterations = sol.idle_iterations;
+	retval.perturbed_pos = sol.perturbed_pos;
 
 	int chainSize = hpSize - 1;
 
-	retval.chain = malloc(sizeof(shiftmel) * chainSize);
+	retval.chain = Solution_chain_alloc(slab, hpSize);
 	memcpy(retval.chain, sol.chain, sizeof(shiftmel) * chainSize);
 
 	return retval;
 }
 
-/** Frees memory allocated for given solution */
+/** Frees memory allocated for given solution, whose chain came from 'slab' */
 SOLUTION_INLINE
-void Solution_free(Solution sol){
-	free(sol.chain);
+void Solution_free(ChainSlab *slab, Solution sol){
+	Solution_chain_free(slab, sol.chain);
 }
 
-/** Returns a Solution whose movement chain is uniformly random.
+/** Returns a Solution whose movement chain is uniformly random, drawn from random stream 'rng'.
  * The returned Solution has its idle_iterations set to 0.
  * The returned Solution won't have its fitness calculated.
  */
 SOLUTION_INLINE
-Solution Solution_random(int hpSize){
+Solution Solution_random(ChainSlab *slab, int hpSize, mt_state *rng){
 	Solution sol;
 	int nMovements = hpSize - 1;
 
 	sol.idle_iterations = 0;
 
 	// Generate random shiftmel *
-	sol.chain = malloc(sizeof(shiftmel) * nMovements);
+	sol.chain = Solution_chain_alloc(slab, hpSize);
 	int i;
 	for(i = 0; i < nMovements; i++)
-		sol.chain[i] = shiftmel_random();
+		sol.chain[i] = shiftmel_random(rng);
 
 	sol.fitness = FITNESS_MIN;
+	sol.evaluated = false;
+	sol.perturbed_pos = -1;
 
 	return sol;
 }
@@ -81,26 +111,28 @@ Solution Solution_random(int hpSize){
  * Takes the distance DIST between ELEM1 and ELEM2
  * Changes 'perturb' so that its ELEM1 approaches ELEM2 by a random amount, from 0 to 100%.
  * The solution 'perturb' is returned.
+ * All random numbers are drawn from random stream 'rng', and the new chain comes from 'slab'.
  *
  * The returned Solution has its idle_iterations set to 0.
- * The returned Solution won't have its fitness calculated.
+ * The returned Solution won't have its fitness calculated, but it remembers ELEM1's position
+ *   so that Solution_fitness_from_parent can calculate it incrementally.
  */
 SOLUTION_INLINE
-Solution Solution_perturb_relative(Solution perturb, Solution other, int hpSize){
+Solution Solution_perturb_relative(ChainSlab *slab, Solution perturb, Solution other, int hpSize, mt_state *rng){
 	int chainSize = hpSize - 1;
-	int pos1 = urandom_max(chainSize);
-	int pos2 = urandom_max(chainSize);
+	int pos1 = urandom_max_r(rng, chainSize);
+	int pos2 = urandom_max_r(rng, chainSize);
 
 	pos2 = pos1;
 
-	Solution retval = Solution_copy(perturb, hpSize);
+	Solution retval = Solution_copy(slab, perturb, hpSize);
 	unsigned char elem1 = shiftmel_to_number(retval.chain[pos1]);
 	unsigned char elem2 = shiftmel_to_number(other.chain[pos2]);
 
 	char distance = elem2 - (char) elem1;
 
 	// Generate a number in [0, distance)
-	double aux = drandom_x() * (double) distance;
+	double aux = drandom_r(rng) * (double) distance;
 
 	// Fit the number in the discrete space [0, distance]
 	char delta = (char) round(aux);
@@ -108,26 +140,63 @@ Solution Solution_perturb_relative(Solution perturb, Solution other, int hpSize)
 	retval.chain[pos1] = shiftmel_from_number(elem1 + delta);
 	retval.idle_iterations = 0;
 	retval.fitness = FITNESS_MIN;
+	retval.evaluated = false;
+	retval.perturbed_pos = pos1;
 
 	return retval;
 }
 
-/** Returns the fitness of the given solution, calculating it only if needed.
+/** Returns whether the fitness of the given solution has already been calculated. */
+SOLUTION_INLINE
+bool Solution_is_evaluated(Solution sol){
+	return sol.evaluated;
+}
+
+/** Returns the fitness of the given solution, which must have already been calculated
+ *   (see Solution_evaluate).
  * \return The fitness of `sol`.
  */
 SOLUTION_INLINE
 double Solution_fitness(Solution sol){
-	if(sol.fitness < (FITNESS_MIN + 0.1)){
-		sol.fitness = FitnessCalc_run2(sol.chain);
-	}
+	assert(sol.evaluated);
 	return sol.fitness;
 }
 
-/** Sets the fitness of a solution.
+/** Returns the fitness of the given solution, calculating it with 'fit' and storing it in 'sol' only if needed.
+ * \return The fitness of `sol`.
+ */
+SOLUTION_INLINE
+double Solution_evaluate(FitnessCalc *fit, Solution *sol){
+	if(!sol->evaluated){
+		sol->fitness = FitnessCalc_run2(fit, sol->chain);
+		sol->evaluated = true;
+	}
+	return sol->fitness;
+}
+
+/** Same as Solution_evaluate, but if 'sol' was made by Solution_perturb_relative from 'parent',
+ *   the fitness is calculated incrementally, reusing the geometry of 'parent'.
+ * \return The fitness of `sol`.
+ */
+SOLUTION_INLINE
+double Solution_fitness_from_parent(FitnessCalc *fit, Solution *sol, Solution parent){
+	if(!sol->evaluated){
+		if(sol->perturbed_pos >= 0){
+			sol->fitness = FitnessCalc_run_delta(fit, parent.chain, sol->chain, sol->perturbed_pos);
+		} else {
+			sol->fitness = FitnessCalc_run2(fit, sol->chain);
+		}
+		sol->evaluated = true;
+	}
+	return sol->fitness;
+}
+
+/** Sets the fitness of a solution, which becomes evaluated.
  */
 SOLUTION_INLINE
 void Solution_set_fitness(Solution *sol, double fitness){
 	sol->fitness = fitness;
+	sol->evaluated = true;
 }
 
 /** Returns the number of iterations through which the solution didn't improve.
@@ -144,6 +213,19 @@ void Solution_inc_idle_iterations(Solution *sol){
 	sol->idle_iterations++;
 }
 
+/** Sets the number of idle iterations of the given solution, e.g. when restoring it from a checkpoint. */
+SOLUTION_INLINE
+void Solution_set_idle_iterations(Solution *sol, int idle){
+	sol->idle_iterations = idle;
+}
+
+/** Returns the only position in which the given solution differs from the solution it was
+ *   perturbed from, or -1 if it wasn't made by Solution_perturb_relative.
+ */
+SOLUTION_INLINE
+int Solution_perturbed_pos(Solution sol){
+	return sol.perturbed_pos;
+}
 
 /** Returns the migrch of the given solution.
  * \return The migrch of the given solution, which shouldn't be modified.
@@ -154,4 +236,33 @@ const shiftmel *Solution_chain(Solution sol){
 }
 
 
+/** Returns the size of a solution record: its fitness followed by its chain.
+ * Records are plain bytes, so arrays of them can be sent through MPI as MPI_BYTE or queued
+ *   between threads with no packing.
+ */
+SOLUTION_INLINE
+int Solution_record_size(int hpSize){
+	return sizeof(double) + hpSize - 1;
+}
+
+/** Writes the record of a Solution in 'rec'. Its fitness must have already been calculated. */
+SOLUTION_INLINE
+void Solution_write_record(Solution sol, int hpSize, void *rec){
+	double fitness = Solution_fitness(sol);
+	memcpy(rec, &fitness, sizeof(double));
+	memcpy((char *) rec + sizeof(double), sol.chain, hpSize - 1);
+}
+
+/** Returns a new Solution with the contents of record 'rec', with its chain from 'slab'. */
+SOLUTION_INLINE
+Solution Solution_read_record(ChainSlab *slab, const void *rec, int hpSize){
+	Solution sol = Solution_blank(slab, hpSize);
+	double fitness;
+	memcpy(&fitness, rec, sizeof(double));
+	memcpy(sol.chain, (const char *) rec + sizeof(double), hpSize - 1);
+	Solution_set_fitness(&sol, fitness);
+	return sol;
+}
+
+
 #endif
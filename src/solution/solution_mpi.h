@@ -6,6 +6,7 @@
 #include <mpi/mpi.h>
 #include <elf_tree_comm/elf_tree_comm.h>
 #include "solution.h"
+#include <heap.h>
 
 #ifndef SOLUTION_PARALLEL_SOURCE_CODE
 	#define SOLUTION_PARALLEL_INLINE inline
@@ -13,115 +14,550 @@
 	#define SOLUTION_PARALLEL_INLINE extern inline
 #endif
 
-/** Packs a Solution in the given buffer. */
+/** Chain byte that marks an empty slot of a block, which slaves skip */
+#define SOLUTION_MPI_NOOP 0xFE
+
+/** @{ */
+/** Kinds of block broadcast to the slaves of the block evaluator. */
+#define SOLUTION_MPI_STOP   0 /**< No block, slaves should return */
+#define SOLUTION_MPI_CHAINS 1 /**< Each slot holds a whole movement chain */
+#define SOLUTION_MPI_DELTAS 2 /**< Each slot holds a ChainDelta relative to the replica */
+/** @} */
+
+/** Header broadcast before each block, so slaves know what to receive. */
+typedef struct BlockHeader_ {
+	int kind;      /**< SOLUTION_MPI_STOP, SOLUTION_MPI_CHAINS or SOLUTION_MPI_DELTAS */
+	int blockSize; /**< Number of slots per node */
+	int nPatches;  /**< Number of hive solutions sent whole to the replicas before the block */
+	unsigned long replicaHash; /**< For deltas, hash of the replica of node 0 once patched */
+} BlockHeader;
+
+/** Movement 'move' at position 'pos' of the chain of hive solution 'slot', which describes a
+ *   candidate perturbed from it. A candidate with negative 'slot' marks an empty slot of a block.
+ */
+typedef struct ChainDelta_ {
+	int slot;
+	int pos;
+	shiftmel move;
+} ChainDelta;
+
+/** Movement chains of the solutions of a hive, as all nodes of the block evaluator keep them,
+ *   so that candidates can be sent as a ChainDelta relative to them.
+ * Node 0 sends the solutions replaced in the hive before each block, and the hash of the whole
+ *   replica, against which the slaves check theirs. The hash is kept as the sum of a hash of
+ *   each solution, so patching a solution costs no more than copying it.
+ * Node 0 also compares one solution of its replica with the hive at each block, in turn, so that
+ *   a replacement that was never sent is eventually noticed.
+ */
+typedef struct SolutionReplica_ {
+	shiftmel *chains;          /**< Chains of the solutions, one after the other */
+	unsigned long *slotHashes; /**< Hash of the chain of each solution, weighted by its index */
+	unsigned long hash;        /**< Sum of slotHashes */
+	int nSols;
+	int chainSize;
+	int nextCheck;             /**< Solution that node 0 compares with the hive at the next block */
+	char *patchBuf;            /**< Patches of a block: indexes of the solutions, then their chains. Room for all solutions */
+	shiftmel *candBuf;         /**< Chains of the candidates of a block, rebuilt from their parents */
+	int maxCands;              /**< Number of chains candBuf can hold */
+} SolutionReplica;
+
+/** Sets the chain of solution 'slot' of 'replica' to 'chain', updating the hash of the replica. */
+SOLUTION_PARALLEL_INLINE
+void Solution_replica_set(SolutionReplica *replica, int slot, const shiftmel *chain){
+	int i;
+	unsigned long hash = 5381;
+	for(i = 0; i < replica->chainSize; i++)
+		hash = hash * 33 + chain[i];
+	hash *= 2 * slot + 1; // So that swapping solutions changes the hash of the replica
+
+	memcpy(replica->chains + slot * replica->chainSize, chain, replica->chainSize);
+	replica->hash += hash - replica->slotHashes[slot];
+	replica->slotHashes[slot] = hash;
+}
+
+/** Returns a replica of the movement chains of the 'nSols' solutions of a hive, for blocks of
+ *   deltas of up to 'maxCands' candidates.
+ * All nodes of the hive must call this with their own (identical) initial hive. The program is
+ *   aborted if any of them disagrees with node 0.
+ * All memory needed to keep the replica and evaluate the blocks is allocated here, once.
+ */
 SOLUTION_PARALLEL_INLINE
-void Solution_pack(Solution sol, int hpSize, void *buf, int maxSize, int *position, MPI_Comm comm){
-	MPI_Pack(&sol.fitness, 1, MPI_DOUBLE, buf, maxSize, position, comm);
-	MPI_Pack(sol.chain, hpSize-1, MPI_CHAR, buf, maxSize, position, comm);
+SolutionReplica *Solution_replica_create(const Solution *sols, int nSols, int maxCands, int hpSize, MPI_Comm comm){
+	int i;
+	SolutionReplica *replica = heap_alloc(sizeof(SolutionReplica));
+	replica->nSols = nSols;
+	replica->chainSize = hpSize - 1;
+	replica->chains = heap_alloc(nSols * replica->chainSize);
+	replica->slotHashes = heap_calloc(nSols, sizeof(unsigned long));
+	replica->hash = 0;
+	replica->nextCheck = 0;
+	replica->patchBuf = heap_alloc(nSols * (sizeof(int) + replica->chainSize));
+	replica->candBuf = heap_alloc(maxCands * replica->chainSize);
+	replica->maxCands = maxCands;
+
+	for(i = 0; i < nSols; i++)
+		Solution_replica_set(replica, i, sols[i].chain);
+
+	// All nodes seed the hive from the same stream, so they must agree
+	unsigned long masterHash = replica->hash;
+	MPI_Bcast(&masterHash, 1, MPI_UNSIGNED_LONG, 0, comm);
+	if(masterHash != replica->hash){
+		fprintf(stderr, "The initial hive of a node differs from the one of node 0.\n");
+		MPI_Abort(comm, EXIT_FAILURE);
+	}
+
+	return replica;
 }
 
-/** Unpacks a Solution and returns it. */
+/** Frees a replica made by Solution_replica_create. */
 SOLUTION_PARALLEL_INLINE
-Solution Solution_unpack(int hpSize, void *buf, int maxSize, int *position, MPI_Comm comm){
-	Solution sol = Solution_blank(hpSize);
-	MPI_Unpack(buf, maxSize, position, &sol.fitness, 1, MPI_DOUBLE, comm);
-	MPI_Unpack(buf, maxSize, position, sol.chain, hpSize-1, MPI_CHAR, comm);
-	return sol;
+void Solution_replica_destroy(SolutionReplica *replica){
+	free(replica->chains);
+	free(replica->slotHashes);
+	free(replica->patchBuf);
+	free(replica->candBuf);
+	free(replica);
 }
 
-/** Calculates the fitness for all solutions in the given vector, using all nodes
- *   in the MPI communicator registered in the HIVE (HIVE_COMM.comm).
+/** Evaluates with 'fit' the chains in the first 'blockSize' slots of 'chainBuf', which are followed by
+ *   empty slots (first byte SOLUTION_MPI_NOOP), and writes their fitnesses to 'fitBuf'.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_evaluate_block(FitnessCalc *fit, const shiftmel *chainBuf, int blockSize, int hpSize, double *fitBuf){
+	int i, n;
+	const shiftmel *chains[blockSize];
+
+	for(n = 0; n < blockSize; n++){
+		const shiftmel *chain = chainBuf + n * (hpSize - 1);
+		if(chain[0] == SOLUTION_MPI_NOOP)
+			break;
+		chains[n] = chain;
+	}
+
+	FitnessCalc_run_batch(fit, chains, n, fitBuf);
+	for(i = n; i < blockSize; i++)
+		fitBuf[i] = 0;
+}
+
+/** Same as Solution_evaluate_block, but the slots of 'deltaBuf' describe candidates perturbed
+ *   from the solutions in 'replica'.
+ * The candidates are evaluated incrementally from the geometry of their parents.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_evaluate_deltas(FitnessCalc *fit, const ChainDelta *deltaBuf, int blockSize, int hpSize, const SolutionReplica *replica, double *fitBuf){
+	int i, n;
+	int chainSize = hpSize - 1;
+	const shiftmel *parents[blockSize];
+	const shiftmel *chains[blockSize];
+	int positions[blockSize];
+	assert(blockSize <= replica->maxCands);
+
+	for(n = 0; n < blockSize && deltaBuf[n].slot >= 0; n++){
+		shiftmel *chain = replica->candBuf + n * chainSize;
+		parents[n] = replica->chains + deltaBuf[n].slot * chainSize;
+		memcpy(chain, parents[n], chainSize);
+		chain[deltaBuf[n].pos] = deltaBuf[n].move;
+		chains[n] = chain;
+		positions[n] = deltaBuf[n].pos;
+	}
+
+	if(n > 0)
+		FitnessCalc_run_batch_delta(fit, parents, chains, positions, n, fitBuf);
+	for(i = n; i < blockSize; i++)
+		fitBuf[i] = 0;
+}
+
+/** Evaluation of a block posted by node 0, whose fitnesses were not collected yet. */
+typedef struct PendingBlock_ {
+	int kind;          /**< SOLUTION_MPI_CHAINS or SOLUTION_MPI_DELTAS */
+	FitnessCalc *fit;  /**< Calculator with which node 0 evaluates its own block */
+	Solution *sols;    /**< Solutions being evaluated */
+	int nSols;
+	int blockSize;
+	int hpSize;
+	const SolutionReplica *replica; /**< For deltas, hive solutions as known by the slaves */
+	ElfTreeHier *tree;
+} PendingBlock;
+
+/** Returns the index of the first solution in the block of node 'rank'.
+ * Slaves take the first full blocks and node 0 the remainder, so the node that also generates
+ *   and replaces solutions has the least to evaluate.
  */
 SOLUTION_PARALLEL_INLINE
-void Solution_calculate_fitness_master(Solution *sols, int nSols, int hpSize, MPI_Comm comm){
+int Solution_block_first(int rank, int blockSize, int commSize){
+	return rank == 0 ? (commSize - 1) * blockSize : (rank - 1) * blockSize;
+}
+
+/** Starts calculating the fitness of all solutions in the given vector, using all nodes
+ *   in the tree registered in the HIVE (HIVE_COMM.tree).
+ *
+ * The solutions are split in contiguous blocks of ceil(nSols/commSize) chains, one per node,
+ *   so that the whole vector takes a single scatter and a single gather.
+ * A header is broadcast beforehand, so slaves know how much to receive.
+ * Blocks are written straight into the memory the tree shares within each machine, so slaves
+ *   on the same machine as node 0 read their chains without any copy.
+ *
+ * Returns once the slaves have their blocks, so node 0 can do other work while they evaluate.
+ * Node 0 evaluates its own block with 'fit' when the evaluation is waited for.
+ * Fitnesses are only set by Solution_wait_fitness_master, which must be called before posting
+ *   another block, and before 'sols' go out of scope.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_post_fitness_master(FitnessCalc *fit, Solution *sols, int nSols, int hpSize, ElfTreeHier *tree, PendingBlock *pend){
 	int i, j;
+	MPI_Comm comm = ElfTreeHier_comm(tree);
+
+	*pend = (PendingBlock) {SOLUTION_MPI_CHAINS, fit, sols, nSols, 0, hpSize, NULL, tree};
+	if(nSols == 0) return;
 
 	int commSize;
 	MPI_Comm_size(comm, &commSize);
 
-	// Allocate buffer for MPI_Scatter / Gather
-	int buffSize = commSize * (hpSize - 1);
-	shiftmel *buff = malloc(buffSize); // We send mov chains
-	double recvBuff[commSize];        // And receive fitnesses
+	BlockHeader header = {SOLUTION_MPI_CHAINS, (nSols + commSize - 1) / commSize, 0};
+	MPI_Bcast(&header, sizeof(BlockHeader), MPI_BYTE, 0, comm);
+	int blockSize = pend->blockSize = header.blockSize;
+
+	// We send mov chains and receive fitnesses
+	int chainBytes = blockSize * (hpSize - 1);
+	int fitBytes = sizeof(double) * blockSize;
+	ElfTreeHier_reserve(tree, chainBytes > fitBytes ? chainBytes : fitBytes);
 
-	for(i = 0; i < nSols; i += commSize){
-		// Build scatter buffer content
-		for(j = 0; j < commSize; j++){
-			if((i+j) < nSols){
-				memcpy(buff + j*(hpSize-1), sols[i+j].chain, hpSize - 1);
+	// Build scatter blocks. Blocks past the end of the vector are left with empty slots.
+	for(i = 0; i < commSize; i++){
+		shiftmel *chainBuf = ElfTreeHier_scatter_piece(tree, i, chainBytes);
+		int first = Solution_block_first(i, blockSize, commSize);
+		for(j = 0; j < blockSize; j++){
+			if(first + j < nSols){
+				memcpy(chainBuf + j*(hpSize-1), sols[first + j].chain, hpSize - 1);
 			} else {
-				memset(buff + j*(hpSize-1), 0xFEFEFEFE, hpSize - 1);
+				memset(chainBuf + j*(hpSize-1), SOLUTION_MPI_NOOP, hpSize - 1);
 			}
 		}
+	}
+
+	// Scatter blocks
+	ElfTreeHier_scatter(tree, chainBytes);
+}
+
+/** Same as Solution_post_fitness_master, but sols[i] must have been perturbed from the hive
+ *   solution with index parents[i], and only that one movement is sent to the slaves.
+ *
+ * 'replica' holds the hive solutions as the slaves know them (see Solution_replica_create).
+ * Before the block, the 'nReplaced' solutions of 'hiveSols' with indexes 'replaced', which are
+ *   those replaced since the last block, are broadcast whole, so that the replicas of all nodes
+ *   match 'hiveSols' again. If 'nSols' is 0, nothing is sent, so they must be given again with
+ *   the next block.
+ * 'nSols' must not exceed the number of candidates 'replica' was made for.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_post_fitness_master_delta(FitnessCalc *fit, Solution *sols, const int *parents, int nSols, int hpSize,
+                                        SolutionReplica *replica, const Solution *hiveSols, const int *replaced, int nReplaced,
+                                        ElfTreeHier *tree, PendingBlock *pend){
+	int i, j;
+	int chainSize = hpSize - 1;
+	MPI_Comm comm = ElfTreeHier_comm(tree);
+
+	*pend = (PendingBlock) {SOLUTION_MPI_DELTAS, fit, sols, nSols, 0, hpSize, replica, tree};
+	if(nSols == 0) return;
+	assert(nSols <= replica->maxCands);
+
+	int commSize;
+	MPI_Comm_size(comm, &commSize);
+
+	// Patch our replica, laying the patches out as the slaves apply them
+	int *patchSlots = (int *) replica->patchBuf;
+	shiftmel *patchChains = (shiftmel *) (replica->patchBuf + nReplaced * sizeof(int));
+	for(i = 0; i < nReplaced; i++){
+		patchSlots[i] = replaced[i];
+		memcpy(patchChains + i * chainSize, hiveSols[replaced[i]].chain, chainSize);
+		Solution_replica_set(replica, replaced[i], hiveSols[replaced[i]].chain);
+	}
 
-		// Scatter buffer
-		ElfTreeComm_scatter(buff, hpSize - 1, MPI_CHAR, comm);
+	int check = replica->nextCheck;
+	replica->nextCheck = (check + 1) % replica->nSols;
+	if(memcmp(replica->chains + check * chainSize, hiveSols[check].chain, chainSize) != 0){
+		fprintf(stderr, "Hive solution %d was replaced without being sent to the slaves.\n", check);
+		MPI_Abort(comm, EXIT_FAILURE);
+	}
 
-		// Calculate own fitness
-		double fit = FitnessCalc_run2(buff);
-		sols[i].fitness = fit;
+	BlockHeader header = {SOLUTION_MPI_DELTAS, (nSols + commSize - 1) / commSize, nReplaced, replica->hash};
+	MPI_Bcast(&header, sizeof(BlockHeader), MPI_BYTE, 0, comm);
+	int blockSize = pend->blockSize = header.blockSize;
 
-		// Gather fitnesses
-		ElfTreeComm_gather(recvBuff, 1, MPI_DOUBLE, comm);
+	// Synchronize replicas
+	if(nReplaced > 0)
+		MPI_Bcast(replica->patchBuf, nReplaced * (sizeof(int) + chainSize), MPI_BYTE, 0, comm);
 
-		// Place fitnesses into the due solutions
-		for(j = 1; j < commSize && (i+j) < nSols; j++){
-			sols[i+j].fitness = recvBuff[j];
+	// We send single movements and receive fitnesses
+	int deltaBytes = sizeof(ChainDelta) * blockSize;
+	int fitBytes = sizeof(double) * blockSize;
+	ElfTreeHier_reserve(tree, deltaBytes > fitBytes ? deltaBytes : fitBytes);
 
-			// For verifying correctness of fitness
-			// int good = sols[i+j].fitness == FitnessCalc_run2(buff + j * (hpSize - 1));
+	for(i = 0; i < commSize; i++){
+		ChainDelta *deltaBuf = ElfTreeHier_scatter_piece(tree, i, deltaBytes);
+		int first = Solution_block_first(i, blockSize, commSize);
+		for(j = 0; j < blockSize; j++){
+			int idx = first + j;
+			if(idx < nSols){
+				int pos = Solution_perturbed_pos(sols[idx]);
+				assert(pos >= 0);
+				deltaBuf[j] = (ChainDelta) {parents[idx], pos, sols[idx].chain[pos]};
+			} else {
+				deltaBuf[j] = (ChainDelta) {-1, -1, SOLUTION_MPI_NOOP};
+			}
 		}
 	}
 
-	free(buff);
+	ElfTreeHier_scatter(tree, deltaBytes);
 }
 
-/** Tells slaves to return
- * Allocate buffer for MPI_Scatter / Gather */
+/** Calculates the block of node 0 of a posted evaluation, gathers the fitnesses of the slaves,
+ *   and places them into the due solutions.
+ */
 SOLUTION_PARALLEL_INLINE
-void Solution_calculate_fitness_master_kill_slaves(int hpSize, MPI_Comm comm){
-	int commSize;
-	MPI_Comm_size(comm, &commSize);
+void Solution_wait_fitness_master(PendingBlock *pend){
+	int i, j, commSize;
+	if(pend->nSols == 0) return;
+
+	ElfTreeHier *tree = pend->tree;
+	MPI_Comm_size(ElfTreeHier_comm(tree), &commSize);
 
-	int buffSize = commSize * (hpSize - 1);
-	void *buff = malloc(buffSize);
-	memset(buff, 0xFFFFFFFF, buffSize);
-	ElfTreeComm_scatter(buff, hpSize - 1, MPI_CHAR, comm);
-	free(buff);
+	int blockSize = pend->blockSize;
+	int hpSize = pend->hpSize;
+	int fitBytes = sizeof(double) * blockSize;
+
+	// Calculate own block
+	if(pend->kind == SOLUTION_MPI_CHAINS)
+		Solution_evaluate_block(pend->fit, ElfTreeHier_scatter_piece(tree, 0, blockSize * (hpSize - 1)), blockSize, hpSize,
+		                        ElfTreeHier_gather_piece(tree, 0, fitBytes));
+	else
+		Solution_evaluate_deltas(pend->fit, ElfTreeHier_scatter_piece(tree, 0, sizeof(ChainDelta) * blockSize), blockSize, hpSize,
+		                         pend->replica, ElfTreeHier_gather_piece(tree, 0, fitBytes));
+
+	// Gather fitnesses and place them into the due solutions
+	ElfTreeHier_gather(tree, fitBytes);
+	for(i = 0; i < commSize; i++){
+		const double *fitBuf = ElfTreeHier_gather_piece(tree, i, fitBytes);
+		int first = Solution_block_first(i, blockSize, commSize);
+		for(j = 0; j < blockSize && first + j < pend->nSols; j++)
+			Solution_set_fitness(&pend->sols[first + j], fitBuf[j]);
+	}
+
+	pend->nSols = 0;
 }
 
-/** Procedure that the slave nodes should execute.
- * Consists of waiting for migrchs, calculating its fitness, and sending the fitness back to node 0.
- * The fitness is sent back with the same MPI_TAG that was received with the migrch.
- * The slave will return once the first element of the migrch received is equal 0xFF.
+/** Calculates the fitness for all solutions in the given vector, using all nodes in 'tree'.
+ * Same as Solution_post_fitness_master followed by Solution_wait_fitness_master.
  */
 SOLUTION_PARALLEL_INLINE
-void Solution_calculate_fitness_slave(const HPElem *chaininghp, int hpSize, MPI_Comm comm){
-	int commSize;
-	MPI_Comm_size(comm, &commSize);
+void Solution_calculate_fitness_master(FitnessCalc *fit, Solution *sols, int nSols, int hpSize, ElfTreeHier *tree){
+	PendingBlock pend;
+	Solution_post_fitness_master(fit, sols, nSols, hpSize, tree, &pend);
+	Solution_wait_fitness_master(&pend);
+}
+
+/** Same as Solution_post_fitness_master_delta followed by Solution_wait_fitness_master. */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_master_delta(FitnessCalc *fit, Solution *sols, const int *parents, int nSols, int hpSize,
+                                             SolutionReplica *replica, const Solution *hiveSols, const int *replaced, int nReplaced,
+                                             ElfTreeHier *tree){
+	PendingBlock pend;
+	Solution_post_fitness_master_delta(fit, sols, parents, nSols, hpSize, replica, hiveSols, replaced, nReplaced, tree, &pend);
+	Solution_wait_fitness_master(&pend);
+}
 
-	// Create scatter/gather buffers
-	int buffSize = commSize * (hpSize - 1);
-	shiftmel *buff = malloc(buffSize);
-	double sendBuff[commSize];
+/** Tells slaves to return */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_master_kill_slaves(int hpSize, MPI_Comm comm){
+	BlockHeader header = {SOLUTION_MPI_STOP, 0, 0};
+	MPI_Bcast(&header, sizeof(BlockHeader), MPI_BYTE, 0, comm);
+}
+
+/** Procedure that the slave nodes should execute.
+ * Consists of waiting for a block of migrchs, or of movements relative to the hive solutions in
+ *   'replica', calculating their fitnesses with 'fit', and sending the fitnesses back to node 0.
+ * Blocks are read from, and fitnesses written to, the memory shared by 'tree' within the machine.
+ * 'replica' is kept up to date with the patches broadcast by node 0, and checked against the hash
+ *   of the replica of node 0. The program is aborted if they differ.
+ * The slave will return once the header broadcast by node 0 is of kind SOLUTION_MPI_STOP.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_slave(FitnessCalc *fit, int hpSize, SolutionReplica *replica, ElfTreeHier *tree){
+	int i, myRank;
+	MPI_Comm comm = ElfTreeHier_comm(tree);
+	MPI_Comm_rank(comm, &myRank);
+	long allocations = heap_allocations();
 
 	while(true){
-		ElfTreeComm_scatter(buff, hpSize-1, MPI_CHAR, comm);
-		if(0xFF == buff[0]){ // Detect end of work
-			free(buff);
+		BlockHeader header;
+		MPI_Bcast(&header, sizeof(BlockHeader), MPI_BYTE, 0, comm);
+		if(header.kind == SOLUTION_MPI_STOP){ // Detect end of work
+			// Serving blocks never touches the heap
+			assert(heap_allocations() == allocations);
 			return;
 		}
 
-		if(0xFE == buff[0]){ // Detect no-op
-			sendBuff[0] = 0;
+		int blockSize = header.blockSize;
+		int fitBytes = sizeof(double) * blockSize;
+
+		if(header.kind == SOLUTION_MPI_CHAINS){
+			int chainBytes = blockSize * (hpSize - 1);
+			ElfTreeHier_reserve(tree, chainBytes > fitBytes ? chainBytes : fitBytes);
+			ElfTreeHier_scatter(tree, chainBytes);
+			Solution_evaluate_block(fit, ElfTreeHier_scatter_piece(tree, myRank, chainBytes), blockSize, hpSize,
+			                        ElfTreeHier_gather_piece(tree, myRank, fitBytes));
 		} else {
-			sendBuff[0] = FitnessCalc_run2(buff);
+			if(header.nPatches > 0){
+				int chainSize = hpSize - 1;
+				MPI_Bcast(replica->patchBuf, header.nPatches * (sizeof(int) + chainSize), MPI_BYTE, 0, comm);
+
+				const int *patchSlots = (const int *) replica->patchBuf;
+				const shiftmel *patchChains = (const shiftmel *) (replica->patchBuf + header.nPatches * sizeof(int));
+				for(i = 0; i < header.nPatches; i++)
+					Solution_replica_set(replica, patchSlots[i], patchChains + i * chainSize);
+			}
+
+			if(replica->hash != header.replicaHash){
+				fprintf(stderr, "The hive solutions known by node %d differ from those of node 0.\n", myRank);
+				MPI_Abort(comm, EXIT_FAILURE);
+			}
+
+			int deltaBytes = sizeof(ChainDelta) * blockSize;
+			ElfTreeHier_reserve(tree, deltaBytes > fitBytes ? deltaBytes : fitBytes);
+			ElfTreeHier_scatter(tree, deltaBytes);
+			Solution_evaluate_deltas(fit, ElfTreeHier_scatter_piece(tree, myRank, deltaBytes), blockSize, hpSize, replica,
+			                         ElfTreeHier_gather_piece(tree, myRank, fitBytes));
+		}
+
+		ElfTreeHier_gather(tree, fitBytes);
+	}
+}
+
+/** MPI tag that tells slaves of the dynamic evaluator to return.
+ * Candidate i is sent, and its fitness returned, with tag i+1.
+ */
+#define SOLUTION_MPI_STOP_TAG 0
+
+/** Load of a node under the dynamic evaluator. All doubles, so it can be gathered as such. */
+typedef struct EvalLoad_ {
+	double evaluations; /**< Number of fitnesses calculated by the node */
+	double busyTime;    /**< Seconds spent calculating them */
+	double elapsed;     /**< Seconds during which the node was serving */
+} EvalLoad;
+
+/** Same as Solution_calculate_fitness_master, but candidates are handed out one at a time,
+ *   with non-blocking sends, to whichever slave returns a fitness first.
+ * Each slave has up to 'inFlight' candidates queued, so it never waits for the master.
+ * While no slave has answered, the master calculates candidates itself with 'fit', from the back of 'sols'.
+ * The work done by the master is added to 'load'.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_master_dynamic(FitnessCalc *fit, Solution *sols, int nSols, int hpSize, int inFlight, EvalLoad *load, MPI_Comm comm){
+	int i, w;
+
+	if(nSols == 0) return;
+	assert(nSols < 32767); // Tags are only guaranteed to go this far
+
+	int commSize;
+	MPI_Comm_size(comm, &commSize);
+
+	MPI_Request sendReqs[nSols];
+	int next = 0;       // Next candidate to hand out
+	int last = nSols;   // Candidates from 'last' on are calculated by the master
+	int pending = 0;    // Candidates handed out whose fitness wasn't received yet
+
+	// Fill the queue of each slave
+	for(i = 0; i < inFlight; i++){
+		for(w = 1; w < commSize && next < last; w++){
+			MPI_Isend(sols[next].chain, hpSize - 1, MPI_CHAR, w, next + 1, comm, &sendReqs[next]);
+			next++;
+			pending++;
 		}
+	}
 
-		ElfTreeComm_gather(sendBuff, 1, MPI_DOUBLE, comm);
+	while(pending > 0 || next < last){
+		int ready = 0;
+		MPI_Status status;
+		if(pending > 0)
+			MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &ready, &status);
+
+		if(!ready && next < last){
+			// No slave answered yet, so the master calculates a candidate itself
+			last--;
+			double start = MPI_Wtime();
+			Solution_set_fitness(&sols[last], FitnessCalc_run2(fit, sols[last].chain));
+			load->busyTime += MPI_Wtime() - start;
+			load->evaluations++;
+			continue;
+		}
+
+		// Receive from whichever slave answers first, and refill its queue
+		double fitness;
+		MPI_Recv(&fitness, 1, MPI_DOUBLE, MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &status);
+		Solution_set_fitness(&sols[status.MPI_TAG - 1], fitness);
+		pending--;
+
+		if(next < last){
+			MPI_Isend(sols[next].chain, hpSize - 1, MPI_CHAR, status.MPI_SOURCE, next + 1, comm, &sendReqs[next]);
+			next++;
+			pending++;
+		}
 	}
+
+	MPI_Waitall(next, sendReqs, MPI_STATUSES_IGNORE);
+}
+
+/** Tells slaves of the dynamic evaluator to return, and gathers their loads.
+ * 'loads' must have room for one EvalLoad per node, and loads[0] must hold the load of the master.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_master_dynamic_kill_slaves(EvalLoad *loads, MPI_Comm comm){
+	int w, commSize;
+	MPI_Comm_size(comm, &commSize);
+
+	for(w = 1; w < commSize; w++)
+		MPI_Send(NULL, 0, MPI_CHAR, w, SOLUTION_MPI_STOP_TAG, comm);
+
+	MPI_Gather(MPI_IN_PLACE, 3, MPI_DOUBLE, loads, 3, MPI_DOUBLE, 0, comm);
 }
 
+/** Procedure that the slave nodes of the dynamic evaluator should execute.
+ * Consists of waiting for a migrch, calculating its fitness with 'fit', and sending the fitness back to node 0
+ *   with the same MPI_TAG that was received with the migrch.
+ * The slave will return once it receives SOLUTION_MPI_STOP_TAG, after sending its load to node 0.
+ */
+SOLUTION_PARALLEL_INLINE
+void Solution_calculate_fitness_slave_dynamic(FitnessCalc *fit, int hpSize, MPI_Comm comm){
+	EvalLoad load = {0, 0, 0};
+	double begin = MPI_Wtime();
+	shiftmel *chain = heap_alloc(hpSize - 1);
+	long allocations = heap_allocations();
 
+	// Every candidate arrives the same way, so the receive is set up once and restarted
+	MPI_Request recvReq;
+	MPI_Recv_init(chain, hpSize - 1, MPI_CHAR, 0, MPI_ANY_TAG, comm, &recvReq);
+
+	while(true){
+		MPI_Status status;
+		MPI_Start(&recvReq);
+		MPI_Wait(&recvReq, &status);
+		if(status.MPI_TAG == SOLUTION_MPI_STOP_TAG)
+			break;
+
+		double start = MPI_Wtime();
+		double fitness = FitnessCalc_run2(fit, chain);
+		load.busyTime += MPI_Wtime() - start;
+		load.evaluations++;
+
+		MPI_Send(&fitness, 1, MPI_DOUBLE, 0, status.MPI_TAG, comm);
+	}
+
+	// Serving candidates never touches the heap
+	assert(heap_allocations() == allocations);
+	MPI_Request_free(&recvReq);
+	free(chain);
+	load.elapsed = MPI_Wtime() - begin;
+	MPI_Gather(&load, 3, MPI_DOUBLE, NULL, 3, MPI_DOUBLE, 0, comm);
+}
 
 #endif
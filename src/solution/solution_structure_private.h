@@ -1,10 +1,14 @@
 
 /** \file solution_structure_private.h Holds the opaque structure Solution, which shouldn't be modified by files other than solution files. */
 
+#include <stdbool.h>
+
 /** Encapsulates a solution, which is a protein conformation that is developed by a bee. */
 typedef struct Solution_ {
 	shiftmel *chain;       /**< Position of such solution */
-	double fitness;       /**< Fitness of such solution. Calculated lazily. */
+	double fitness;       /**< Fitness of such solution. Only meaningful if 'evaluated' is true. */
+	bool evaluated;       /**< Whether 'fitness' holds the fitness of 'chain' */
 	int idle_iterations;  /**< Number of iterations through which the food didn't improve */
+	int perturbed_pos;    /**< Only position in which it differs from the solution it was perturbed from, or -1 */
 } Solution;
 
@@ -0,0 +1,60 @@
+#include <string.h>
+#include <stdatomic.h>
+
+#include "heap.h"
+#include "spsc.h"
+
+/** The producer only writes 'tail' and the consumer only writes 'head', so each index has a single writer.
+ * Both count items ever pushed/popped, and the slot of an index is that count modulo 'capacity'.
+ * They are padded apart, so that the two threads do not keep invalidating each other's cache line.
+ */
+struct SpscQueue_ {
+	atomic_long head; /**< Next item to pop */
+	char pad1[64 - sizeof(atomic_long)];
+	atomic_long tail; /**< Next item to push */
+	char pad2[64 - sizeof(atomic_long)];
+	int capacity;
+	int itemSize;
+	char *items;
+};
+
+SpscQueue *SpscQueue_create(int capacity, int itemSize){
+	SpscQueue *queue = heap_alloc(sizeof(SpscQueue));
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	queue->capacity = capacity;
+	queue->itemSize = itemSize;
+	queue->items = heap_alloc((size_t) capacity * itemSize);
+	return queue;
+}
+
+void SpscQueue_destroy(SpscQueue *queue){
+	free(queue->items);
+	free(queue);
+}
+
+bool SpscQueue_push(SpscQueue *queue, const void *item){
+	long tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	long head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if(tail - head == queue->capacity)
+		return false;
+
+	memcpy(queue->items + (tail % queue->capacity) * queue->itemSize, item, queue->itemSize);
+
+	// The item must be in place before the consumer sees the new tail
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool SpscQueue_pop(SpscQueue *queue, void *item){
+	long head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	long tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if(head == tail)
+		return false;
+
+	memcpy(item, queue->items + (head % queue->capacity) * queue->itemSize, queue->itemSize);
+
+	// The slot must be read before the producer may overwrite it
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
@@ -0,0 +1,30 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+/** \file spsc.h Bounded lock-free queue between one producer thread and one consumer thread.
+ *
+ * Items are fixed-size blocks of bytes, copied in and out of the queue.
+ * Neither end ever blocks: pushing to a full queue and popping from an empty one just fail.
+ */
+
+#include <stdbool.h>
+
+typedef struct SpscQueue_ SpscQueue;
+
+/** Creates a queue with room for 'capacity' items of 'itemSize' bytes. */
+SpscQueue *SpscQueue_create(int capacity, int itemSize);
+
+/** Frees the queue. No thread may be using it anymore. */
+void SpscQueue_destroy(SpscQueue *queue);
+
+/** Copies 'item' at the back of the queue. Only to be called by the producer.
+ * \return false if the queue was full, in which case the item is not queued.
+ */
+bool SpscQueue_push(SpscQueue *queue, const void *item);
+
+/** Copies the item at the front of the queue into 'item' and removes it. Only to be called by the consumer.
+ * \return false if the queue was empty, in which case 'item' is untouched.
+ */
+bool SpscQueue_pop(SpscQueue *queue, void *item);
+
+#endif // SPSC_H
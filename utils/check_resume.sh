@@ -0,0 +1,41 @@
+#!/bin/sh
+# Checks that a run resumed from a checkpoint ends exactly as an uninterrupted one.
+# The interrupted run stops right at its first checkpoint, so the checkpoint is the first one
+#   ever written into the buffers of the writer.
+#
+# Usage, from the root of the repository:
+#   sh utils/check_resume.sh ./sqline
+#   sh utils/check_resume.sh ./milin "mpirun --oversubscribe -np 4" 2
+# The optional third argument is N_HIVES. MIGRATION_INTERVAL is fixed, as by default it depends on
+#   the number of cycles, which differs between the interrupted run and the whole one.
+
+EXE=$(realpath "$1")
+LAUNCH=$2
+HIVES=${3:-1}
+CHAIN=HHPPHPHPHHHPPHPHHHPPPHHHHPPHPHHHPHPHHPPH
+CYCLES=60
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+sed -e "s/^N_HIVES: .*/N_HIVES: $HIVES/" -e "s/^RANDOM_SEED: .*/RANDOM_SEED: 72/" \
+    -e "s/^MIGRATION_INTERVAL: .*/MIGRATION_INTERVAL: 7/" \
+    -e "s/^CHECKPOINT_FILE: .*/CHECKPOINT_FILE: checkpoint.bin/" configuration.yml > "$DIR/configuration.yml"
+cd "$DIR" || exit 1
+
+set_interval(){
+	sed -i "s/^CHECKPOINT_INTERVAL: .*/CHECKPOINT_INTERVAL: $1/" configuration.yml
+}
+
+set_interval 0
+$LAUNCH "$EXE" $CHAIN $((2 * CYCLES)) whole.txt > /dev/null 2>&1 || { echo "FAIL: uninterrupted run"; exit 1; }
+
+set_interval $CYCLES
+$LAUNCH "$EXE" $CHAIN $CYCLES first.txt > /dev/null 2>&1 || { echo "FAIL: run up to the first checkpoint"; exit 1; }
+$LAUNCH "$EXE" --resume $CHAIN $((2 * CYCLES)) resumed.txt > /dev/null 2>&1 || { echo "FAIL: resumed run"; exit 1; }
+
+if cmp -s whole.txt resumed.txt; then
+	echo "OK: $1 resumed exactly"
+else
+	echo "FAIL: $1 resumed to another structure"
+	exit 1
+fi